@@ -0,0 +1,385 @@
+#include "autotune.h"
+
+#include "cmd_args.h"
+#include "config.h"
+#include "opt_simd.h"
+#include "timer.h"
+#include <fstream>
+#include <omp.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Repetitions of each timing; the fastest counts
+#define TUNE_REPS 3
+
+// Added to StageMotion to time motion and delta together
+#define TUNE_FUSED 0x100
+
+// Intermediates of one P frame, the input of every stage
+typedef struct TuneFrames
+{
+  int width;
+  int height;
+  Image *rgb;
+  Frame *lowpassed[2];
+  Channel *chroma;
+  vector<mVector> *motion_vectors;
+  Frame *delta;
+  Channel *dct;
+  Channel *quant;
+  Channel *zigzag;
+} TuneFrames;
+
+static Frame *
+tuneLowPass (const Backends *b, Image *rgb)
+{
+  int width = rgb->width;
+  int height = rgb->height;
+  Image ycbcr (width, height, FULLSIZE);
+  Frame *f = new Frame (width, height, FULLSIZE);
+
+  b->convert (rgb, &ycbcr);
+  f->Y->copy (ycbcr.rc);
+  b->lowpass (ycbcr.gc, f->Cb);
+  b->lowpass (ycbcr.bc, f->Cr);
+  return f;
+}
+
+static void
+initTuneFrames (TuneFrames *t, const Backends *b, Image *first, Image *second)
+{
+  int width = first->width;
+  int height = first->height;
+
+  t->width = width;
+  t->height = height;
+  t->rgb = first;
+  t->lowpassed[0] = tuneLowPass (b, first);
+  t->lowpassed[1] = tuneLowPass (b, second);
+  t->chroma = new Channel (t->lowpassed[0]->Cb);
+  t->motion_vectors
+      = b->motion (t->lowpassed[0], t->lowpassed[1], width, height);
+  t->delta = b->delta (t->lowpassed[0], t->lowpassed[1], t->motion_vectors);
+  t->dct = new Channel (width, height);
+  Channel in (t->delta->Y);
+  b->dct (&in, t->dct);
+  t->quant = new Channel (width, height);
+  b->quant (t->dct, t->quant);
+  t->zigzag = new Channel (MPEG_CONSTANT, width * height / MPEG_CONSTANT);
+  b->zigzag (t->quant, t->zigzag);
+}
+
+static void
+freeTuneFrames (TuneFrames *t)
+{
+  delete t->lowpassed[0];
+  delete t->lowpassed[1];
+  delete t->chroma;
+  delete t->motion_vectors;
+  delete t->delta;
+  delete t->dct;
+  delete t->quant;
+  delete t->zigzag;
+}
+
+// Seconds one call of the selected implementation of stage takes
+static double
+runStage (const TuneFrames *t, const Backends *b, int stage)
+{
+  int width = t->width;
+  int height = t->height;
+
+  stageThreads (b, stage & ~TUNE_FUSED);
+  switch (stage)
+    {
+    case StageConvert:
+      {
+        Image out (width, height, FULLSIZE);
+        START_TIMER (timer);
+        b->convert (t->rgb, &out);
+        END_TIMER (timer);
+        return timer;
+      }
+    case StageLowPass:
+      {
+        Channel out (width, height);
+        START_TIMER (timer);
+        b->lowpass (t->chroma, &out);
+        END_TIMER (timer);
+        return timer;
+      }
+    case StageMotion:
+      {
+        START_TIMER (timer);
+        vector<mVector> *out
+            = b->motion (t->lowpassed[0], t->lowpassed[1], width, height);
+        END_TIMER (timer);
+        delete out;
+        return timer;
+      }
+    case StageMotion | TUNE_FUSED:
+      {
+        // Motion and the delta it feeds, the pair fused=fused works as
+        START_TIMER (timer);
+        vector<mVector> *out
+            = b->motion (t->lowpassed[0], t->lowpassed[1], width, height);
+        stageThreads (b, StageDelta);
+        Frame *delta = b->delta (t->lowpassed[0], t->lowpassed[1], out);
+        END_TIMER (timer);
+        delete out;
+        delete delta;
+        return timer;
+      }
+    case StageDelta:
+      {
+        START_TIMER (timer);
+        Frame *out
+            = b->delta (t->lowpassed[0], t->lowpassed[1], t->motion_vectors);
+        END_TIMER (timer);
+        delete out;
+        return timer;
+      }
+    case StageDownSample:
+      {
+        START_TIMER (timer);
+        Channel *out = b->downsample (t->delta->Cb);
+        END_TIMER (timer);
+        delete out;
+        return timer;
+      }
+    case StageDCT:
+      {
+        Channel in (t->delta->Y);
+        Channel out (width, height);
+        START_TIMER (timer);
+        b->dct (&in, &out);
+        END_TIMER (timer);
+        return timer;
+      }
+    case StageQuant:
+      {
+        Channel in (t->dct);
+        Channel out (width, height);
+        START_TIMER (timer);
+        b->quant (&in, &out);
+        END_TIMER (timer);
+        return timer;
+      }
+    case StageZigZag:
+      {
+        Channel in (t->quant);
+        Channel out (MPEG_CONSTANT, width * height / MPEG_CONSTANT);
+        START_TIMER (timer);
+        b->zigzag (&in, &out);
+        END_TIMER (timer);
+        return timer;
+      }
+    case StageEncode:
+      {
+        SMatrix out (width * height / MPEG_CONSTANT, MPEG_CONSTANT);
+        START_TIMER (timer);
+        b->encode (t->zigzag, &out);
+        END_TIMER (timer);
+        return timer;
+      }
+    }
+  return 0;
+}
+
+// Fastest of TUNE_REPS runs.  Candidates much slower than best are only
+// run once.
+static double
+timeStage (const TuneFrames *t, const Backends *b, int stage, double best)
+{
+  double fastest = runStage (t, b, stage);
+  if (fastest > 2 * best)
+    return fastest;
+  for (int rep = 1; rep < TUNE_REPS; ++rep)
+    fastest = min (fastest, runStage (t, b, stage));
+  return fastest;
+}
+
+static string
+cpuModel (void)
+{
+  ifstream cpuinfo ("/proc/cpuinfo");
+  string line;
+  while (getline (cpuinfo, line))
+    if (line.compare (0, 10, "model name") == 0)
+      {
+        size_t colon = line.find (':');
+        size_t begin = line.find_first_not_of (" \t", colon + 1);
+        if (colon != string::npos && begin != string::npos)
+          return line.substr (begin);
+      }
+  return "unknown";
+}
+
+static string
+planKey (int width, int height, uint8_t optimization_mode)
+{
+  return cpuModel () + "\t" + to_string (width) + "x" + to_string (height)
+         + "\t" + to_string (optimization_mode) + "\t" + simd.name + "\t";
+}
+
+static string
+loadPlan (const char *cache_path, const string &key)
+{
+  ifstream cache (cache_path);
+  string line;
+  while (getline (cache, line))
+    if (line.compare (0, key.size (), key) == 0)
+      return line.substr (key.size ());
+  return "";
+}
+
+static void
+savePlan (const char *cache_path, const string &key, const string &plan)
+{
+  vector<string> lines;
+  {
+    ifstream cache (cache_path);
+    string line;
+    while (getline (cache, line))
+      if (line.compare (0, key.size (), key) != 0)
+        lines.push_back (line);
+  }
+  lines.push_back (key + plan);
+
+  string tmp_path = string (cache_path) + ".tmp";
+  ofstream tmp (tmp_path.c_str ());
+  for (size_t i = 0; i < lines.size (); ++i)
+    tmp << lines[i] << "\n";
+  tmp.close ();
+  if (!tmp || rename (tmp_path.c_str (), cache_path))
+    fprintf (stderr, "Failed writing autotune cache %s\n", cache_path);
+}
+
+void
+autotuneBackends (Backends *b, uint8_t optimization_mode, Image *first,
+                  Image *second, const char *cache_path, FILE *log)
+{
+  string key = planKey (first->width, first->height, optimization_mode);
+  string plan = loadPlan (cache_path, key);
+  if (!plan.empty ())
+    {
+      Backends cached = *b;
+      string err = parseBackendSpec (&cached, plan.c_str ());
+      for (int s = 0; s < N_STAGES && err.empty (); ++s)
+        if (cached.stage[s]->tolerance != 0)
+          err = string ("it picks inexact ") + stage_info[s].name + "="
+                + cached.stage[s]->name;
+      if (err.empty ())
+        {
+          fprintf (log, "Autotune: plan from %s\n", cache_path);
+          *b = cached;
+          return;
+        }
+      fprintf (log, "Autotune: ignoring cached plan, %s\n", err.c_str ());
+    }
+
+  uint8_t available
+      = Cache | SIMD | OpenMP | OpenACC | (optimization_mode & OpenCL);
+  int max_threads = omp_get_max_threads ();
+
+  // motion=fused only pays off with delta=fused taking the residual it
+  // pooled, so the two are timed as a pair once the rest are picked
+  const Backend *fused_motion = findBackend (StageMotion, "fused");
+  const Backend *fused_delta = findBackend (StageDelta, "fused");
+  double stage_time[N_STAGES];
+
+  TuneFrames frames;
+  initTuneFrames (&frames, b, first, second);
+
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      const StageInfo *info = &stage_info[s];
+      Backends trial = *b;
+      const Backend *best = NULL;
+      double best_time = 1e30;
+
+      fprintf (log, "Autotune %s:", info->name);
+      for (int i = 0; i < info->n_backends; ++i)
+        {
+          const Backend *backend = &info->backends[i];
+          // Only exact implementations are candidates; an inexact one is
+          // used when --backend names it
+          if (i > 0
+              && (backend->tolerance != 0 || (backend->mode & ~available)
+                  || backend == fused_motion || backend == fused_delta))
+            continue;
+          setBackend (&trial, s, backend);
+          trial.threads[s] = max_threads;
+          double time = timeStage (&frames, &trial, s, best_time);
+          fprintf (log, " %s %.3f ms", backend->name, time * 1000);
+          if (time < best_time)
+            {
+              best = backend;
+              best_time = time;
+            }
+        }
+
+      // Fewer threads than the processors may win for memory bound stages
+      // or small frames
+      setBackend (&trial, s, best);
+      int best_threads = max_threads;
+      for (int threads = 1; threads < max_threads; threads *= 2)
+        {
+          trial.threads[s] = threads;
+          double time = timeStage (&frames, &trial, s, best_time);
+          fprintf (log, ", %d threads %.3f ms", threads, time * 1000);
+          if (time < best_time)
+            {
+              best_threads = threads;
+              best_time = time;
+            }
+        }
+      fprintf (log, "; %s:%d\n", best->name, best_threads);
+
+      setBackend (b, s, best);
+      b->threads[s] = best_threads;
+      stage_time[s] = best_time;
+    }
+
+  if (fused_motion && fused_delta)
+    {
+      Backends trial = *b;
+      double best_time = stage_time[StageMotion] + stage_time[StageDelta];
+      int best_threads = 0;
+
+      fprintf (log, "Autotune motion+delta: %s+%s %.3f ms,",
+               b->stage[StageMotion]->name, b->stage[StageDelta]->name,
+               best_time * 1000);
+      setBackend (&trial, StageMotion, fused_motion);
+      setBackend (&trial, StageDelta, fused_delta);
+      for (int threads = max_threads; threads >= 1; threads /= 2)
+        {
+          trial.threads[StageMotion] = threads;
+          trial.threads[StageDelta] = threads;
+          double time = timeStage (&frames, &trial, StageMotion | TUNE_FUSED,
+                                   best_time);
+          fprintf (log, " fused %d threads %.3f ms", threads, time * 1000);
+          if (time < best_time)
+            {
+              best_threads = threads;
+              best_time = time;
+            }
+        }
+      if (best_threads)
+        {
+          fprintf (log, "; fused:%d\n", best_threads);
+          setBackend (b, StageMotion, fused_motion);
+          setBackend (b, StageDelta, fused_delta);
+          b->threads[StageMotion] = best_threads;
+          b->threads[StageDelta] = best_threads;
+        }
+      else
+        fprintf (log, "; kept\n");
+    }
+
+  freeTuneFrames (&frames);
+  savePlan (cache_path, key, backendSpec (b));
+}
@@ -0,0 +1,24 @@
+#ifndef autotune_h
+#define autotune_h
+
+#include "backend.h"
+#include "custom_types.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Plans found by --autotune, one per line:
+// CPU model <TAB> WIDTHxHEIGHT <TAB> optimisation flags <TAB> SIMD kernels
+// <TAB> backend spec
+#define AUTOTUNE_CACHE "autotune.cache"
+
+// Pick the fastest implementation and OpenMP thread count of every stage,
+// timing them on the frames first and second.  The reference and every
+// exact (tolerance 0) implementation are tried; OpenCL ones only if
+// optimization_mode has OpenCL, motion=fused and delta=fused only together.
+// Inexact ones are left to --backend.  A plan cached in cache_path for
+// this CPU, resolution, optimization_mode and SIMD kernels is used without
+// timing anything; a new plan is added to the cache.
+void autotuneBackends (Backends *b, uint8_t optimization_mode, Image *first,
+                       Image *second, const char *cache_path, FILE *log);
+
+#endif
@@ -0,0 +1,328 @@
+#include "backend.h"
+
+#include "cmd_args.h"
+#include "config.h"
+#include <error.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+#define BACKEND(name, mode, tolerance, type, fn)                              \
+  {                                                                           \
+    name, mode, tolerance, (BackendFn)(type)fn                                \
+  }
+
+#define N_OF(array) ((int)(sizeof (array) / sizeof (array[0])))
+
+static const Backend convert_backends[] = {
+  BACKEND ("ref", 0, 0, ConvertFn, convertRGBtoYCbCr),
+  BACKEND ("omp", OpenMP, 0, ConvertFn, convertRGBtoYCbCrOMP),
+  BACKEND ("simd", SIMD, 0, ConvertFn, convertSIMD),
+  BACKEND ("acc", OpenACC, 1e-3, ConvertFn, convertRGBtoYCbCrACC),
+  BACKEND ("cl", OpenCL, 1e-3, ConvertFn, convertRGBtoYCbCrCL),
+};
+
+static const Backend lowpass_backends[] = {
+  BACKEND ("ref", 0, 0, LowPassFn, lowPass),
+  BACKEND ("omp", OpenMP, 0, LowPassFn, lowPassOMP),
+  BACKEND ("simd", SIMD, 0, LowPassFn, lowPassSIMD),
+};
+
+// Motion search results with a tolerance are compared by SAD, so an
+// implementation that breaks ties differently passes as long as its vectors
+// are as good, within the relative tolerance; the rest must match exactly.
+static const Backend motion_backends[] = {
+  BACKEND ("ref", 0, 0, MotionFn, motionVectorSearch),
+  BACKEND ("simd", SIMD, 0, MotionFn, motionVectorSearchSIMD),
+  BACKEND ("pde", 0, 0, MotionFn, motionVectorSearchPDE),
+  BACKEND ("sea", 0, 0, MotionFn, motionVectorSearchSEA),
+  BACKEND ("fused", 0, 0, MotionFn, motionVectorSearchFused),
+  BACKEND ("cl", OpenCL, 1e-3, MotionFn, motionVectorSearchCL),
+};
+
+static const Backend delta_backends[] = {
+  BACKEND ("ref", 0, 0, DeltaFn, computeDelta),
+  BACKEND ("cache", Cache, 0, DeltaFn, computeDeltaCache),
+  BACKEND ("fused", 0, 0, DeltaFn, computeDeltaFused),
+  BACKEND ("cl", OpenCL, 0, DeltaFn, computeDeltaCL),
+};
+
+static const Backend downsample_backends[] = {
+  BACKEND ("ref", 0, 0, DownSampleFn, downSample),
+  BACKEND ("cache", Cache, 0, DownSampleFn, downSampleCache),
+};
+
+static const Backend dct_backends[] = {
+  BACKEND ("ref", 0, 0, ChannelFn, dct8x8),
+  BACKEND ("cache", Cache, 0, ChannelFn, dct8x8Cache),
+  BACKEND ("simd", SIMD, 0, ChannelFn, dct8x8SIMD),
+  BACKEND ("fixed", 0, 0.25, ChannelFn, dct8x8Fixed),
+  // Drops AC coefficients below half a quantiser step, at most about 6
+  BACKEND ("flat", 0, 6, ChannelFn, dct8x8Flat),
+};
+
+static const Backend quant_backends[] = {
+  BACKEND ("ref", 0, 0, ChannelFn, quant8x8),
+  BACKEND ("cache", Cache, 0, ChannelFn, quant8x8Cache),
+  BACKEND ("simd", SIMD, 0, ChannelFn, quant8x8SIMD),
+  BACKEND ("mask", 0, 0, ChannelFn, quant8x8Mask),
+};
+
+static const Backend zigzag_backends[] = {
+  BACKEND ("ref", 0, 0, ChannelFn, zigZagOrder),
+  BACKEND ("simd", SIMD, 0, ChannelFn, zigZagOrderSIMD),
+  BACKEND ("mask", 0, 0, ChannelFn, zigZagOrderMask),
+};
+
+static const Backend encode_backends[] = {
+  BACKEND ("ref", 0, 0, EncodeFn, encode8x8),
+  BACKEND ("mask", 0, 0, EncodeFn, encode8x8Mask),
+};
+
+#define STAGE(name, backends)                                                 \
+  {                                                                           \
+    name, backends, N_OF (backends)                                           \
+  }
+
+const StageInfo stage_info[N_STAGES] = {
+  STAGE ("convert", convert_backends),
+  STAGE ("lowpass", lowpass_backends),
+  STAGE ("motion", motion_backends),
+  STAGE ("delta", delta_backends),
+  STAGE ("downsample", downsample_backends),
+  STAGE ("dct", dct_backends),
+  STAGE ("quant", quant_backends),
+  STAGE ("zigzag", zigzag_backends),
+  STAGE ("encode", encode_backends),
+};
+
+static const char *
+modeName (uint8_t mode)
+{
+  switch (mode)
+    {
+    case Cache:
+      return "--cache";
+    case SIMD:
+      return "--simd";
+    case OpenMP:
+      return "--omp";
+    case OpenCL:
+      return "--cl";
+    case OpenACC:
+      return "--acc";
+    default:
+      return "--backend";
+    }
+}
+
+void
+setBackend (Backends *b, int stage, const Backend *backend)
+{
+  b->stage[stage] = backend;
+  switch (stage)
+    {
+    case StageConvert:
+      b->convert = (ConvertFn)backend->fn;
+      break;
+    case StageLowPass:
+      b->lowpass = (LowPassFn)backend->fn;
+      break;
+    case StageMotion:
+      b->motion = (MotionFn)backend->fn;
+      break;
+    case StageDelta:
+      b->delta = (DeltaFn)backend->fn;
+      break;
+    case StageDownSample:
+      b->downsample = (DownSampleFn)backend->fn;
+      break;
+    case StageDCT:
+      b->dct = (ChannelFn)backend->fn;
+      break;
+    case StageQuant:
+      b->quant = (ChannelFn)backend->fn;
+      break;
+    case StageZigZag:
+      b->zigzag = (ChannelFn)backend->fn;
+      break;
+    case StageEncode:
+      b->encode = (EncodeFn)backend->fn;
+      break;
+    }
+}
+
+const Backend *
+findBackend (int stage, const char *name)
+{
+  for (int i = 0; i < stage_info[stage].n_backends; ++i)
+    if (!strcmp (stage_info[stage].backends[i].name, name))
+      return &stage_info[stage].backends[i];
+  return NULL;
+}
+
+void
+selectBackends (Backends *b, uint8_t optimization_mode, const char *spec)
+{
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      const StageInfo *info = &stage_info[s];
+      const Backend *chosen = &info->backends[0];
+      for (int i = 1; i < info->n_backends; ++i)
+        {
+          uint8_t mode = info->backends[i].mode;
+          if (mode && (optimization_mode & mode) == mode)
+            chosen = &info->backends[i];
+        }
+      setBackend (b, s, chosen);
+      b->threads[s] = 0;
+    }
+
+  applyBackendSpec (b, spec);
+}
+
+void
+applyBackendSpec (Backends *b, const char *spec)
+{
+  string err = parseBackendSpec (b, spec);
+  if (!err.empty ())
+    error (EXIT_FAILURE, 0, "%s (see --list-backends)", err.c_str ());
+}
+
+string
+parseBackendSpec (Backends *b, const char *spec)
+{
+  if (!spec)
+    return "";
+
+  string list = spec;
+  size_t pos = 0;
+  while (pos <= list.size ())
+    {
+      size_t comma = list.find (',', pos);
+      if (comma == string::npos)
+        comma = list.size ();
+      string item = list.substr (pos, comma - pos);
+      pos = comma + 1;
+      if (item.empty ())
+        continue;
+
+      size_t eq = item.find ('=');
+      if (eq == string::npos)
+        return "expected stage=backend, got '" + item + "'";
+      string stage = item.substr (0, eq);
+      string name = item.substr (eq + 1);
+
+      int threads = 0;
+      size_t colon = name.find (':');
+      if (colon != string::npos)
+        {
+          char *end;
+          threads = strtol (name.c_str () + colon + 1, &end, 10);
+          if (*end || threads < 1)
+            return "bad thread count in '" + item + "'";
+          name.erase (colon);
+        }
+
+      if (stage == "all")
+        {
+          int found = 0;
+          for (int s = 0; s < N_STAGES; ++s)
+            {
+              const Backend *backend = findBackend (s, name.c_str ());
+              if (backend)
+                {
+                  setBackend (b, s, backend);
+                  b->threads[s] = threads;
+                  found = 1;
+                }
+            }
+          if (!found)
+            return "no stage has a backend '" + name + "'";
+          continue;
+        }
+
+      int s;
+      for (s = 0; s < N_STAGES; ++s)
+        if (stage == stage_info[s].name)
+          break;
+      if (s == N_STAGES)
+        return "unknown stage '" + stage + "'";
+      const Backend *backend = findBackend (s, name.c_str ());
+      if (!backend)
+        return "stage " + stage + " has no backend '" + name + "'";
+      setBackend (b, s, backend);
+      b->threads[s] = threads;
+    }
+  return "";
+}
+
+string
+backendSpec (const Backends *b)
+{
+  string spec;
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      if (s)
+        spec += ",";
+      spec += string (stage_info[s].name) + "=" + b->stage[s]->name;
+      if (b->threads[s])
+        spec += ":" + to_string (b->threads[s]);
+    }
+  return spec;
+}
+
+void
+stageThreads (const Backends *b, int stage)
+{
+  // The thread count OpenMP started with, from OMP_NUM_THREADS or the
+  // number of processors
+  static int default_threads = omp_get_max_threads ();
+
+  omp_set_num_threads (b->threads[stage] ? b->threads[stage]
+                                         : default_threads);
+}
+
+int
+backendsUse (const Backends *b, uint8_t mode)
+{
+  for (int s = 0; s < N_STAGES; ++s)
+    if (b->stage[s]->mode & mode)
+      return 1;
+  return 0;
+}
+
+void
+printBackends (const Backends *b, FILE *file)
+{
+  fprintf (file, "Backends:");
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      fprintf (file, " %s=%s", stage_info[s].name, b->stage[s]->name);
+      if (b->threads[s])
+        fprintf (file, ":%d", b->threads[s]);
+    }
+  fprintf (file, "\n");
+}
+
+void
+listBackends (FILE *file)
+{
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      const StageInfo *info = &stage_info[s];
+      fprintf (file, "%-12s", info->name);
+      for (int i = 0; i < info->n_backends; ++i)
+        {
+          if (i == 0)
+            fprintf (file, " %s", info->backends[i].name);
+          else
+            fprintf (file, " %s(%s)", info->backends[i].name,
+                     modeName (info->backends[i].mode));
+        }
+      fprintf (file, "\n");
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef backend_h
+#define backend_h
+
+#include "stages.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+enum Stage
+{
+  StageConvert,
+  StageLowPass,
+  StageMotion,
+  StageDelta,
+  StageDownSample,
+  StageDCT,
+  StageQuant,
+  StageZigZag,
+  StageEncode,
+  N_STAGES
+};
+
+typedef void (*BackendFn) (void);
+
+// One implementation of a stage.  fn has the stage's function type from
+// stages.h.
+typedef struct Backend
+{
+  const char *name;
+  // Optimization bit that selects this implementation when no --backend
+  // names one; 0 if it is only used when named
+  uint8_t mode;
+  // Largest difference from the reference that the checks in check.h
+  // accept
+  float tolerance;
+  BackendFn fn;
+} Backend;
+
+typedef struct StageInfo
+{
+  const char *name;
+  const Backend *backends;
+  int n_backends;
+} StageInfo;
+
+// Registry of every stage and its implementations.  backends[0] is the
+// reference implementation.
+extern const StageInfo stage_info[N_STAGES];
+
+// The implementation picked for each stage, plus typed shortcuts to it
+typedef struct Backends
+{
+  const Backend *stage[N_STAGES];
+  // OpenMP threads for each stage, 0 for the default
+  int threads[N_STAGES];
+
+  ConvertFn convert;
+  LowPassFn lowpass;
+  MotionFn motion;
+  DeltaFn delta;
+  DownSampleFn downsample;
+  ChannelFn dct;
+  ChannelFn quant;
+  ChannelFn zigzag;
+  EncodeFn encode;
+} Backends;
+
+// For each stage take the last implementation whose mode is in
+// optimization_mode, then apply spec, a comma separated list of
+// stage=backend[:threads] items ("all" names every stage that has the
+// backend).
+void selectBackends (Backends *b, uint8_t optimization_mode,
+                     const char *spec);
+
+// Apply spec on top of the current selection; exits on a bad spec.
+void applyBackendSpec (Backends *b, const char *spec);
+
+// Like applyBackendSpec, but returns what is wrong with spec instead of
+// exiting, or an empty string if it applied.
+std::string parseBackendSpec (Backends *b, const char *spec);
+
+// The selection as a spec that selectBackends accepts
+std::string backendSpec (const Backends *b);
+
+// Switch OpenMP to the thread count of stage before running it
+void stageThreads (const Backends *b, int stage);
+
+void setBackend (Backends *b, int stage, const Backend *backend);
+
+const Backend *findBackend (int stage, const char *name);
+
+// Nonzero if any selected implementation needs the given Optimization
+int backendsUse (const Backends *b, uint8_t mode);
+
+void printBackends (const Backends *b, FILE *file);
+
+void listBackends (FILE *file);
+
+#endif
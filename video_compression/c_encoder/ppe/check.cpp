@@ -0,0 +1,563 @@
+#include "check.h"
+
+#include "cmd_args.h"
+#include "config.h"
+#include <algorithm>
+#include <error.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string>
+
+using namespace std;
+
+// Where an intermediate first departs from the reference
+typedef struct Divergence
+{
+  // Largest difference over the whole intermediate
+  float max_diff;
+  // Plane and top-left pixel of the first block off by more than the
+  // tolerance; plane is NULL if there is none
+  const char *plane;
+  int row;
+  int col;
+  // Largest difference within that block
+  float block_diff;
+} Divergence;
+
+static void
+initDivergence (Divergence *d)
+{
+  d->max_diff = 0;
+  d->plane = NULL;
+  d->row = d->col = -1;
+  d->block_diff = 0;
+}
+
+static void
+diverged (Divergence *d, float diff, float tolerance, const char *plane,
+          int row, int col)
+{
+  if (!(diff <= d->max_diff))
+    d->max_diff = diff;
+  if (!(diff <= tolerance) && !d->plane)
+    {
+      d->plane = plane;
+      d->row = row;
+      d->col = col;
+      d->block_diff = diff;
+    }
+}
+
+// Compare ref and got 8x8 block by block, in the order dct8x8 visits them
+static void
+compareChannel (const Channel *ref, const Channel *got, float tolerance,
+                const char *plane, Divergence *d)
+{
+  if (ref->width != got->width || ref->height != got->height)
+    {
+      diverged (d, INFINITY, tolerance, plane, 0, 0);
+      return;
+    }
+
+  int width = ref->width;
+  for (int row = 0; row < ref->height; row += 8)
+    for (int col = 0; col < width; col += 8)
+      {
+        float diff = 0;
+        for (int x = row; x < min (row + 8, ref->height); ++x)
+          for (int y = col; y < min (col + 8, width); ++y)
+            {
+              float dd = fabsf (ref->data[x * width + y]
+                                - got->data[x * width + y]);
+              if (!(dd <= diff))
+                diff = dd;
+            }
+        diverged (d, diff, tolerance, plane, row, col);
+      }
+}
+
+// Blocks of 64 coefficients, in the order zigZagOrder writes them, of the
+// width x height channel they were taken from
+static void
+compareOrdered (const Channel *ref, const Channel *got, int width,
+                float tolerance, const char *plane, Divergence *d)
+{
+  int blocks_per_row = width / 8;
+  int n_blocks = ref->width * ref->height / MPEG_CONSTANT;
+  for (int b = 0; b < n_blocks; ++b)
+    {
+      float diff = 0;
+      for (int i = 0; i < MPEG_CONSTANT; ++i)
+        {
+          float dd = fabsf (ref->data[b * MPEG_CONSTANT + i]
+                            - got->data[b * MPEG_CONSTANT + i]);
+          if (!(dd <= diff))
+            diff = dd;
+        }
+      diverged (d, diff, tolerance, plane, b / blocks_per_row * 8,
+                b % blocks_per_row * 8);
+    }
+}
+
+static void
+compareEncoded (const SMatrix *ref, const SMatrix *got, int width,
+                const char *plane, Divergence *d)
+{
+  int blocks_per_row = width / 8;
+  int n_blocks = ref->width * ref->height / MPEG_CONSTANT;
+  for (int b = 0; b < n_blocks; ++b)
+    {
+      float diff = 0;
+      for (int i = b * MPEG_CONSTANT; i < (b + 1) * MPEG_CONSTANT; ++i)
+        if (!ref->data[i] != !got->data[i]
+            || (ref->data[i] && *ref->data[i] != *got->data[i]))
+          diff = INFINITY;
+      diverged (d, diff, 0, plane, b / blocks_per_row * 8,
+                b % blocks_per_row * 8);
+    }
+}
+
+// SAD of the block at (mx, my) displaced by v, as motionVectorSearch
+// computes it
+static float
+blockSAD (Frame *source, Frame *match, int width, int mx, int my, mVector v)
+{
+  float sad = 0;
+  for (int y = 0; y < BLOCK_SIZE; y++)
+    for (int x = 0; x < BLOCK_SIZE; x++)
+      {
+        int m = (mx + x) * width + my + y;
+        int s = (mx + v.a + x) * width + my + v.b + y;
+        sad = sad + (0.5f * fabsf (match->Y->data[m] - source->Y->data[s])
+                     + 0.25f * fabsf (match->Cb->data[m] - source->Cb->data[s])
+                     + 0.25f * fabsf (match->Cr->data[m] - source->Cr->data[s]));
+      }
+  return sad;
+}
+
+// A backend registered exact must return ref's vectors.  One registered
+// with a tolerance may pick others where they are as good: the difference
+// of a macroblock is then the relative SAD excess of got's vector over ref's.
+static void
+compareMotion (Frame *source, Frame *match, vector<mVector> *ref,
+               vector<mVector> *got, const Backend *backend, float tolerance,
+               Divergence *d)
+{
+  int width = source->width;
+  int height = source->height;
+  if (ref->size () != got->size ())
+    {
+      diverged (d, INFINITY, tolerance, "vectors", 0, 0);
+      return;
+    }
+
+  int inset = WINDOW_SIZE;
+  size_t i = 0;
+  for (int my = inset; my < height - (inset + WINDOW_SIZE) + 1;
+       my += BLOCK_SIZE)
+    for (int mx = inset; mx < width - (inset + WINDOW_SIZE) + 1;
+         mx += BLOCK_SIZE, ++i)
+      {
+        mVector r = (*ref)[i];
+        mVector g = (*got)[i];
+        float diff = 0;
+        if (r.a != g.a || r.b != g.b)
+          {
+            if (backend->tolerance == 0 || abs (g.a) > WINDOW_SIZE
+                || abs (g.b) > WINDOW_SIZE)
+              diff = INFINITY;
+            else
+              {
+                float ref_sad = blockSAD (source, match, width, mx, my, r);
+                float got_sad = blockSAD (source, match, width, mx, my, g);
+                diff = max (0.f, (got_sad - ref_sad) / max (ref_sad, 1.f));
+              }
+          }
+        diverged (d, diff, tolerance, "vectors", mx, my);
+      }
+}
+
+static void
+compareFrame (const Frame *ref, const Frame *got, float tolerance,
+              Divergence *d)
+{
+  compareChannel (ref->Y, got->Y, tolerance, "Y", d);
+  compareChannel (ref->Cb, got->Cb, tolerance, "Cb", d);
+  compareChannel (ref->Cr, got->Cr, tolerance, "Cr", d);
+}
+
+// Print the outcome of stage; returns 1 if it differs.  Without a frame
+// number (verifyBackends) only the P frame reports stages that agree.
+static int
+report (FILE *log, int frame_number, int is_p_frame, int stage,
+        const Backend *backend, float tolerance, const Divergence *d)
+{
+  if (frame_number < 0 && !is_p_frame && !d->plane)
+    return 0;
+  if (frame_number < 0)
+    fprintf (log, "Verify %s=%s: ", stage_info[stage].name, backend->name);
+  else
+    fprintf (log, "Check frame %d %s=%s: ", frame_number,
+             stage_info[stage].name, backend->name);
+  fprintf (log, "max difference %g (tolerance %g) ", d->max_diff, tolerance);
+  if (!d->plane)
+    {
+      fprintf (log, "ok\n");
+      return 0;
+    }
+  fprintf (log, "FAILED, first at %s block row %d column %d (%g)\n",
+           d->plane, d->row, d->col, d->block_diff);
+  return 1;
+}
+
+void
+initCheck (CheckState *state, const Backends *b, const char *spec)
+{
+  state->previous = NULL;
+  for (int s = 0; s < N_STAGES; ++s)
+    state->tolerance[s] = b->stage[s]->tolerance;
+
+  if (!spec)
+    return;
+
+  string list = spec;
+  size_t pos = 0;
+  while (pos <= list.size ())
+    {
+      size_t comma = list.find (',', pos);
+      if (comma == string::npos)
+        comma = list.size ();
+      string item = list.substr (pos, comma - pos);
+      pos = comma + 1;
+      if (item.empty ())
+        continue;
+
+      size_t eq = item.find ('=');
+      int s = 0;
+      if (eq != string::npos)
+        for (s = 0; s < N_STAGES; ++s)
+          if (item.compare (0, eq, stage_info[s].name) == 0)
+            break;
+      char *end = NULL;
+      float tolerance
+          = eq == string::npos ? 0 : strtof (item.c_str () + eq + 1, &end);
+      if (eq == string::npos || s == N_STAGES || *end || tolerance < 0)
+        error (EXIT_FAILURE, 0,
+               "--tolerance expects stage=tolerance, got '%s'",
+               item.c_str ());
+      state->tolerance[s] = tolerance;
+    }
+}
+
+void
+freeCheck (CheckState *state)
+{
+  delete state->previous;
+  state->previous = NULL;
+}
+
+int
+checkFrame (CheckState *state, const Backends *b, Image *rgb,
+            int frame_number, int is_p_frame, FILE *log)
+{
+  Backends ref;
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      setBackend (&ref, s, &stage_info[s].backends[0]);
+      ref.threads[s] = 0;
+    }
+
+  int width = rgb->width;
+  int height = rgb->height;
+  int failures = 0;
+  Divergence d[N_STAGES];
+  for (int s = 0; s < N_STAGES; ++s)
+    initDivergence (&d[s]);
+  const float *tol = state->tolerance;
+#define CHECKED(s) (b->stage[s] != ref.stage[s])
+
+  // Convert to YCbCr
+  Image ycbcr (width, height, FULLSIZE);
+  ref.convert (rgb, &ycbcr);
+  if (CHECKED (StageConvert))
+    {
+      Image out (width, height, FULLSIZE);
+      b->convert (rgb, &out);
+      compareChannel (ycbcr.rc, out.rc, tol[StageConvert], "Y",
+                      &d[StageConvert]);
+      compareChannel (ycbcr.gc, out.gc, tol[StageConvert], "Cb",
+                      &d[StageConvert]);
+      compareChannel (ycbcr.bc, out.bc, tol[StageConvert], "Cr",
+                      &d[StageConvert]);
+    }
+
+  // Low pass filter the chroma
+  Frame *lowpassed = new Frame (width, height, FULLSIZE);
+  lowpassed->Y->copy (ycbcr.rc);
+  ref.lowpass (ycbcr.gc, lowpassed->Cb);
+  ref.lowpass (ycbcr.bc, lowpassed->Cr);
+  if (CHECKED (StageLowPass))
+    {
+      Channel out (width, height);
+      b->lowpass (ycbcr.gc, &out);
+      compareChannel (lowpassed->Cb, &out, tol[StageLowPass], "Cb",
+                      &d[StageLowPass]);
+      b->lowpass (ycbcr.bc, &out);
+      compareChannel (lowpassed->Cr, &out, tol[StageLowPass], "Cr",
+                      &d[StageLowPass]);
+    }
+
+  // Motion vectors and the residual for P frames
+  Frame *final = lowpassed;
+  if (is_p_frame && state->previous)
+    {
+      // With --pad, as in encode (), previous was padded when it was kept
+      Frame *match = args.pad ? padFrame (lowpassed, WINDOW_SIZE) : lowpassed;
+      vector<mVector> *mv = ref.motion (state->previous, match, match->width,
+                                        match->height);
+      if (CHECKED (StageMotion))
+        {
+          vector<mVector> *out = b->motion (state->previous, match,
+                                            match->width, match->height);
+          compareMotion (state->previous, match, mv, out,
+                         b->stage[StageMotion], tol[StageMotion],
+                         &d[StageMotion]);
+          delete out;
+        }
+
+      final = ref.delta (state->previous, match, mv);
+      if (CHECKED (StageDelta))
+        {
+          Frame *out = b->delta (state->previous, match, mv);
+          compareFrame (final, out, tol[StageDelta], &d[StageDelta]);
+          delete out;
+        }
+      if (args.pad)
+        {
+          Frame *padded = final;
+          final = cropFrame (padded, WINDOW_SIZE);
+          delete padded;
+          delete match;
+        }
+      delete mv;
+      delete lowpassed;
+    }
+  delete state->previous;
+  state->previous
+      = keepReference (final, args.pad ? WINDOW_SIZE : 0, false);
+
+  // Downsample the chroma
+  Frame downsampled (width, height, DOWNSAMPLE);
+  downsampled.Y->copy (final->Y);
+  Channel *chroma[2] = { final->Cb, final->Cr };
+  Channel *chroma_out[2] = { downsampled.Cb, downsampled.Cr };
+  const char *chroma_name[2] = { "Cb", "Cr" };
+  for (int c = 0; c < 2; ++c)
+    {
+      Channel *out = ref.downsample (chroma[c]);
+      chroma_out[c]->copy (out);
+      delete out;
+      if (CHECKED (StageDownSample))
+        {
+          out = b->downsample (chroma[c]);
+          compareChannel (chroma_out[c], out, tol[StageDownSample],
+                          chroma_name[c], &d[StageDownSample]);
+          delete out;
+        }
+    }
+  delete final;
+
+  // The block coding stages, plane by plane
+  Channel *planes[3] = { downsampled.Y, downsampled.Cb, downsampled.Cr };
+  const char *plane_name[3] = { "Y", "Cb", "Cr" };
+  for (int p = 0; p < 3; ++p)
+    {
+      int w = planes[p]->width;
+      int h = planes[p]->height;
+
+      Channel dct (w, h);
+      {
+        Channel in (planes[p]);
+        ref.dct (&in, &dct);
+      }
+      if (CHECKED (StageDCT))
+        {
+          Channel in (planes[p]);
+          Channel out (w, h);
+          b->dct (&in, &out);
+          compareChannel (&dct, &out, tol[StageDCT], plane_name[p],
+                          &d[StageDCT]);
+        }
+
+      Channel quant (w, h);
+      {
+        Channel in (&dct);
+        ref.quant (&in, &quant);
+      }
+      if (CHECKED (StageQuant))
+        {
+          Channel in (&dct);
+          Channel out (w, h);
+          b->quant (&in, &out);
+          compareChannel (&quant, &out, tol[StageQuant], plane_name[p],
+                          &d[StageQuant]);
+        }
+
+      Channel zigzag (MPEG_CONSTANT, w * h / MPEG_CONSTANT);
+      ref.zigzag (&quant, &zigzag);
+      if (CHECKED (StageZigZag))
+        {
+          Channel out (MPEG_CONSTANT, w * h / MPEG_CONSTANT);
+          b->zigzag (&quant, &out);
+          compareOrdered (&zigzag, &out, w, tol[StageZigZag], plane_name[p],
+                          &d[StageZigZag]);
+        }
+
+      if (CHECKED (StageEncode))
+        {
+          SMatrix encoded (w * h / MPEG_CONSTANT, MPEG_CONSTANT);
+          SMatrix out (w * h / MPEG_CONSTANT, MPEG_CONSTANT);
+          ref.encode (&zigzag, &encoded);
+          b->encode (&zigzag, &out);
+          compareEncoded (&encoded, &out, w, plane_name[p], &d[StageEncode]);
+        }
+    }
+
+  for (int s = 0; s < N_STAGES; ++s)
+    if (CHECKED (s)
+        && ((s != StageMotion && s != StageDelta) || is_p_frame))
+      failures += report (log, frame_number, is_p_frame, s, b->stage[s],
+                          tol[s], &d[s]);
+#undef CHECKED
+
+  return failures;
+}
+
+// The stages 2 to 8 of --cl-pipeline, reported as one zigzag backend
+static const Backend device_pipeline = { "cl-pipeline", OpenCL, 0, NULL };
+
+int
+checkDeviceFrame (CheckState *state, Image *rgb, int frame_number,
+                  vector<mVector> *motion_vectors, Frame *zigzag, FILE *log)
+{
+  Backends ref;
+  for (int s = 0; s < N_STAGES; ++s)
+    {
+      setBackend (&ref, s, &stage_info[s].backends[0]);
+      ref.threads[s] = 0;
+    }
+  const Backend *motion = findBackend (StageMotion, "cl");
+
+  int width = rgb->width;
+  int height = rgb->height;
+  int failures = 0;
+  Divergence d[N_STAGES];
+  for (int s = 0; s < N_STAGES; ++s)
+    initDivergence (&d[s]);
+  const float *tol = state->tolerance;
+
+  Image ycbcr (width, height, FULLSIZE);
+  ref.convert (rgb, &ycbcr);
+  Frame *final = new Frame (width, height, FULLSIZE);
+  final->Y->copy (ycbcr.rc);
+  ref.lowpass (ycbcr.gc, final->Cb);
+  ref.lowpass (ycbcr.bc, final->Cr);
+
+  if (motion_vectors && state->previous)
+    {
+      Frame *lowpassed = final;
+      vector<mVector> *mv = ref.motion (state->previous, lowpassed, width,
+                                        height);
+      compareMotion (state->previous, lowpassed, mv, motion_vectors, motion,
+                     tol[StageMotion], &d[StageMotion]);
+      failures += report (log, frame_number, 1, StageMotion, motion,
+                          tol[StageMotion], &d[StageMotion]);
+      final = ref.delta (state->previous, lowpassed,
+                         d[StageMotion].plane ? mv : motion_vectors);
+      delete mv;
+      delete lowpassed;
+    }
+  delete state->previous;
+  state->previous = keepReference (final, 0, false);
+
+  Frame downsampled (width, height, DOWNSAMPLE);
+  downsampled.Y->copy (final->Y);
+  Channel *cb = ref.downsample (final->Cb);
+  Channel *cr = ref.downsample (final->Cr);
+  downsampled.Cb->copy (cb);
+  downsampled.Cr->copy (cr);
+  delete cb;
+  delete cr;
+  delete final;
+
+  Channel *planes[3] = { downsampled.Y, downsampled.Cb, downsampled.Cr };
+  Channel *got[3] = { zigzag->Y, zigzag->Cb, zigzag->Cr };
+  const char *plane_name[3] = { "Y", "Cb", "Cr" };
+  for (int p = 0; p < 3; ++p)
+    {
+      int w = planes[p]->width;
+      int h = planes[p]->height;
+      Channel dct (w, h);
+      Channel quant (w, h);
+      Channel ordered (MPEG_CONSTANT, w * h / MPEG_CONSTANT);
+      ref.dct (planes[p], &dct);
+      ref.quant (&dct, &quant);
+      ref.zigzag (&quant, &ordered);
+      compareOrdered (&ordered, got[p], w, tol[StageZigZag], plane_name[p],
+                      &d[StageZigZag]);
+    }
+  failures += report (log, frame_number, motion_vectors != NULL,
+                      StageZigZag, &device_pipeline, tol[StageZigZag],
+                      &d[StageZigZag]);
+  return failures;
+}
+
+#define VERIFY_SIZE 64
+
+static unsigned verify_seed;
+
+static int
+verifyRand (void)
+{
+  verify_seed = verify_seed * 1103515245 + 12345;
+  return (verify_seed >> 16) & 0x7fff;
+}
+
+// Textured test frame, shifted by (dx, dy) so that motion search has
+// something to find.  Pixel values are integers like those of loadImage.
+static Image *
+verifyImage (int dx, int dy)
+{
+  Image *img = new Image (VERIFY_SIZE, VERIFY_SIZE, FULLSIZE);
+  Channel *c[] = { img->rc, img->gc, img->bc };
+  for (int ch = 0; ch < 3; ++ch)
+    for (int row = 0; row < VERIFY_SIZE; ++row)
+      for (int col = 0; col < VERIFY_SIZE; ++col)
+        {
+          int x = col + dx;
+          int y = row + dy;
+          float v = 128 + 60 * sinf (x * 0.21f + ch) * cosf (y * 0.17f)
+                    + verifyRand () % 9 - 4;
+          c[ch]->data[row * VERIFY_SIZE + col]
+              = min (255.f, max (0.f, floorf (v)));
+        }
+  return img;
+}
+
+int
+verifyBackends (const Backends *b, FILE *log)
+{
+  CheckState state;
+  initCheck (&state, b, NULL);
+
+  verify_seed = 1;
+  Image *first = verifyImage (0, 0);
+  Image *second = verifyImage (3, -2);
+  int failures = checkFrame (&state, b, first, -1, 0, log)
+                 + checkFrame (&state, b, second, -1, 1, log);
+
+  delete first;
+  delete second;
+  freeCheck (&state);
+  return failures;
+}
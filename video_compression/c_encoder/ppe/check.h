@@ -0,0 +1,49 @@
+#ifndef check_h
+#define check_h
+
+#include "backend.h"
+#include "custom_types.h"
+#include <stdio.h>
+
+// Equivalence of the selected backends with the reference, stage by stage.
+// Every stage of the selected implementation is run on exactly the input
+// the reference stage gets, so a difference is pinned to one stage, and
+// the first 8x8 block (macroblock for motion vectors) that differs by more
+// than the tolerance is reported.
+
+typedef struct CheckState
+{
+  // Reference frame for the next P frame, as encode() keeps it
+  Frame *previous;
+  float tolerance[N_STAGES];
+} CheckState;
+
+// Tolerances from the selected backends, then from spec, a comma separated
+// list of stage=tolerance; exits on a bad spec
+void initCheck (CheckState *state, const Backends *b, const char *spec);
+
+void freeCheck (CheckState *state);
+
+// Encode frame rgb with the reference and compare every intermediate of b
+// with it: YCbCr, low-pass, motion vectors, delta, downsampled chroma, DCT,
+// quantised and zig-zag ordered coefficients and the run-length code.
+// Frames must be checked in order.  Returns the number of stages that
+// differ.
+int checkFrame (CheckState *state, const Backends *b, Image *rgb,
+                int frame_number, int is_p_frame, FILE *log);
+
+// Compare what the --cl-pipeline device path gave for frame rgb, its
+// motion vectors (NULL for an I frame) and zigzag, the quantised
+// coefficients in zig-zag order, with the reference.  The reference takes
+// the device's vectors once they pass, so that the coefficients of both
+// come from the same residual.  Frames must be checked in order.  Returns
+// the number of stages that differ.
+int checkDeviceFrame (CheckState *state, Image *rgb, int frame_number,
+                      std::vector<mVector> *motion_vectors, Frame *zigzag,
+                      FILE *log);
+
+// checkFrame on a synthetic I and P frame pair.  Returns the number of
+// stages that differ.
+int verifyBackends (const Backends *b, FILE *log);
+
+#endif
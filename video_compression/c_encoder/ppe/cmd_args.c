@@ -7,14 +7,94 @@
 const char *argp_program_version = "cencoder 0.1";
 static const char doc[] = "cencoder -- a JPEG video encoder";
 
-#define OPT_CL_NUM_THD 1
+#define OPT_CL_PER_ITEM 1
+#define OPT_ISA 2
+#define OPT_BACKEND 3
+#define OPT_LIST_BACKENDS 4
+#define OPT_AUTOTUNE 5
+#define OPT_PERF 6
+#define OPT_TRACE 7
+#define OPT_CHECK 8
+#define OPT_TOLERANCE 9
+#define OPT_SYNTH 10
+#define OPT_ROOFLINE 11
+#define OPT_SKIP 12
+#define OPT_PAD 13
+#define OPT_CL_PIPELINE 14
+#define OPT_CL_DEVICE 15
+#define OPT_CL_CACHE 16
+
+Args args;
 
 static const struct argp_option argp_options[]
-    = { { "cl", 'c', 0, 0, "Use OpenCL optimisation" },
-        { "cl_num_thd", OPT_CL_NUM_THD, "NUM", 0,
-          "Use NUM threads for OpenCL" },
+    = { { "cache", 'k', 0, 0, "Use cache friendly loop orders" },
+        { "simd", 's', 0, 0, "Use SIMD optimisation" },
+        { "cl", 'c', 0, 0, "Use OpenCL optimisation" },
+        { "cl-per-item", OPT_CL_PER_ITEM, "NUM", 0,
+          "Convert NUM pixels (4), rounded up to a multiple of 4, in each "
+          "work-item of the OpenCL colour conversion" },
+        { "cl_num_thd", 0, 0, OPTION_ALIAS },
+        { "cl-device", OPT_CL_DEVICE, "DEVICE", 0,
+          "Use OpenCL DEVICE: its number in the device list logged at "
+          "start-up, gpu, cpu or accelerator, or part of its or its "
+          "platform's name.  By default the first GPU, or the first CPU "
+          "device without one" },
+        { "cl-cache", OPT_CL_CACHE, "DIR", 0,
+          "Keep the OpenCL kernels built for each device in DIR "
+          "($XDG_CACHE_HOME/ppe or ~/.cache/ppe) and load them from there "
+          "instead of building them.  An empty DIR turns the cache off" },
+        { "cl-pipeline", OPT_CL_PIPELINE, 0, 0,
+          "Run every stage up to the zig-zag order on the OpenCL device, "
+          "uploading each frame once and reading back only the quantised "
+          "coefficients and motion vectors.  With --check they are "
+          "compared with those of the host stages" },
         { "omp", 'm', 0, 0, "Use OpenMP optimisation" },
 	{ "acc", 'a', 0, 0, "Use OpenACC optimisation" },
+        { "isa", OPT_ISA, "ISA", 0,
+          "Use the ISA variant of the SIMD kernels (scalar, sse4.1, avx2, "
+          "avx512) instead of the best one the CPU supports" },
+        { "backend", OPT_BACKEND, "STAGE=NAME,...", 0,
+          "Use backend NAME for STAGE, overriding the optimisation flags. "
+          "STAGE all sets every stage that has a backend NAME" },
+        { "list-backends", OPT_LIST_BACKENDS, 0, 0,
+          "List the stages and their backends and exit" },
+        { "autotune", OPT_AUTOTUNE, "CACHE", OPTION_ARG_OPTIONAL,
+          "Time every backend and thread count of each stage on the first "
+          "frames and use the fastest.  Plans are kept in CACHE "
+          "(autotune.cache) for the CPU and resolution" },
+        { "perf", OPT_PERF, 0, 0,
+          "Count cycles, instructions, branch and LLC misses and memory "
+          "traffic of each stage and add them to the stats" },
+        { "trace", OPT_TRACE, "FILE", OPTION_ARG_OPTIONAL,
+          "Record a timeline of frames, stages and threads and write it "
+          "as Chrome trace JSON to FILE (../../outputs/trace.json) at "
+          "exit" },
+        { "check", OPT_CHECK, 0, 0,
+          "Instead of encoding, compare every intermediate of the selected "
+          "backends with the reference on the input frames and report the "
+          "first block that differs" },
+        { "tolerance", OPT_TOLERANCE, "STAGE=TOL,...", 0,
+          "Largest difference --check accepts for STAGE, instead of the "
+          "backend's own" },
+        { "synth", OPT_SYNTH, "KIND,KEY=VALUE,...", 0,
+          "Encode a generated sequence instead of the input frames: KIND "
+          "static, pan, noise or objects, with size=WxH or 720p, 1080p, "
+          "4k, 8k, frames=N, dx=N, dy=N (pan per frame), objects=N, "
+          "noise=N and seed=N.  Motion vectors are checked against the "
+          "known motion" },
+        { "roofline", OPT_ROOFLINE, "FILE", OPTION_ARG_OPTIONAL,
+          "Add the bytes moved and operations done by each stage to the "
+          "stats, as GB/s, GFLOP/s and arithmetic intensity against the "
+          "machine ceilings in FILE (roofline.conf)" },
+        { "skip", OPT_SKIP, "MV,ENERGY", OPTION_ARG_OPTIONAL,
+          "Code macroblocks of P frames whose motion vector is at most MV "
+          "(0) pixels in both directions and whose mean squared residual "
+          "is at most ENERGY (1) as their prediction alone, without "
+          "transform or coefficients" },
+        { "pad", OPT_PAD, 0, 0,
+          "Search and compensate motion against frames padded by "
+          "replicating their edges, so that macroblocks cover the whole "
+          "frame instead of leaving a border uncoded by motion" },
         { 0 } };
 
 static error_t
@@ -24,11 +104,19 @@ ParseOpt (int key, char *arg, struct argp_state *state)
 
   switch (key)
     {
+    case 'k':
+      args->optimization_mode |= Cache;
+      break;
+    case 's':
+      args->optimization_mode |= SIMD;
+      break;
     case 'c':
       args->optimization_mode |= OpenCL;
       break;
-    case OPT_CL_NUM_THD:
-      args->opencl_num_threads = strtol (arg, 0, 10);
+    case OPT_CL_PER_ITEM:
+      args->cl_per_item = strtol (arg, 0, 10);
+      if (args->cl_per_item < 1)
+        error (EXIT_FAILURE, 0, "--cl-per-item must be at least 1");
       break;
     case 'm':
       args->optimization_mode |= OpenMP;
@@ -36,6 +124,55 @@ ParseOpt (int key, char *arg, struct argp_state *state)
     case 'a':
       args->optimization_mode |= OpenACC;
       break;
+    case OPT_ISA:
+      args->simd_isa = arg;
+      break;
+    case OPT_BACKEND:
+      args->backend_spec = arg;
+      break;
+    case OPT_LIST_BACKENDS:
+      args->list_backends = 1;
+      break;
+    case OPT_AUTOTUNE:
+      args->autotune = 1;
+      if (arg)
+        args->autotune_cache = arg;
+      break;
+    case OPT_PERF:
+      args->perf = 1;
+      break;
+    case OPT_TRACE:
+      args->trace_path = arg ? arg : "../../outputs/trace.json";
+      break;
+    case OPT_CHECK:
+      args->check = 1;
+      break;
+    case OPT_TOLERANCE:
+      args->tolerance_spec = arg;
+      break;
+    case OPT_SYNTH:
+      args->synth_spec = arg;
+      break;
+    case OPT_ROOFLINE:
+      args->roofline_path = arg ? arg : "roofline.conf";
+      break;
+    case OPT_SKIP:
+      args->skip = 1;
+      args->skip_spec = arg;
+      break;
+    case OPT_PAD:
+      args->pad = 1;
+      break;
+    case OPT_CL_DEVICE:
+      args->cl_device = arg;
+      break;
+    case OPT_CL_CACHE:
+      args->cl_cache = arg;
+      break;
+    case OPT_CL_PIPELINE:
+      args->cl_pipeline = 1;
+      args->optimization_mode |= OpenCL;
+      break;
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -47,8 +184,33 @@ static struct argp argp = { argp_options, ParseOpt, 0, doc };
 Args
 parseArgs (int argc, char *argv[])
 {
-  Args args = { .optimization_mode = 0, .opencl_num_threads = 0 };
+  Args args = { .optimization_mode = 0,
+                .cl_per_item = 0,
+                .simd_isa = 0,
+                .backend_spec = 0,
+                .list_backends = 0,
+                .autotune = 0,
+                .autotune_cache = "autotune.cache",
+                .perf = 0,
+                .trace_path = 0,
+                .check = 0,
+                .tolerance_spec = 0,
+                .synth_spec = 0,
+                .roofline_path = 0,
+                .skip = 0,
+                .skip_spec = 0,
+                .pad = 0,
+                .cl_pipeline = 0,
+                .cl_device = 0,
+                .cl_cache = 0 };
 
   argp_parse (&argp, argc, argv, 0, 0, &args);
+  if (args.cl_pipeline && (args.skip || args.pad))
+    error (EXIT_FAILURE, 0, "--cl-pipeline does not work with --skip or --pad");
+
+  // Without any CPU optimisation flag keep the SIMD and OpenMP stages the
+  // encoder has always used; --backend all=ref gives the reference one.
+  if (!(args.optimization_mode & (Cache | SIMD | OpenMP)))
+    args.optimization_mode |= SIMD | OpenMP;
   return args;
 }
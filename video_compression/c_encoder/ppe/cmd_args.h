@@ -20,9 +20,45 @@ extern "C"
   typedef struct Args
   {
     uint8_t optimization_mode;
-    int opencl_num_threads;
+    // Pixels each work-item of the OpenCL convert kernel converts, or 0
+    // for the default
+    int cl_per_item;
+    const char *simd_isa;
+    // stage=backend list from --backend, see selectBackends
+    const char *backend_spec;
+    int list_backends;
+    // Time the backends on the first frames and use the fastest, with the
+    // plans cached in autotune_cache
+    int autotune;
+    const char *autotune_cache;
+    // Count hardware events per stage into the stats file
+    int perf;
+    // Chrome trace file to write, or 0 for no tracing
+    const char *trace_path;
+    // Compare the backends with the reference instead of encoding, with
+    // the stage=tolerance overrides in tolerance_spec
+    int check;
+    const char *tolerance_spec;
+    // Generated input sequence, see initSynth, or 0 for the TIFF frames
+    const char *synth_spec;
+    // Machine ceilings for the roofline stats, or 0 for none
+    const char *roofline_path;
+    // Skip macroblocks of P frames with small motion and residual, with
+    // the limits in skip_spec (see initSkip)
+    int skip;
+    const char *skip_spec;
+    // Pad the motion and delta frames by WINDOW_SIZE, see padFrame
+    int pad;
+    // Stages 0 to 8 on the OpenCL device, see submitTransformCL
+    int cl_pipeline;
+    // OpenCL device to use, see initCL, or 0 for the default
+    const char *cl_device;
+    // Directory of the OpenCL program cache, see initCL
+    const char *cl_cache;
   } Args;
 
+  extern Args args;
+
   Args parseArgs (int argc, char *argv[]);
 
 #ifdef __cplusplus
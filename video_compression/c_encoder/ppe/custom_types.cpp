@@ -3,6 +3,7 @@
 #include "config.h"
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
 
 float
@@ -20,11 +21,25 @@ float round(float number){
 }
 */
 
+// Planes are page aligned and padded to whole cache lines, so that OpenCL
+// devices that share memory with the host can use them in place (see
+// zero_copy in opt_opencl.c)
+static float *
+allocPlane (int npixels)
+{
+  size_t size = (npixels * sizeof (float) + 63) & ~(size_t)63;
+  void *plane;
+  if (posix_memalign (&plane, 4096, size ? size : 64))
+    abort ();
+  return (float *)plane;
+}
+
 Channel::Channel (int _width, int _height)
 {
   width = _width;
   height = _height;
-  data = new float[_width * _height];
+  data = allocPlane (_width * _height);
+  nonzero = NULL;
 }
 
 Channel::Channel (Channel *in)
@@ -33,13 +48,22 @@ Channel::Channel (Channel *in)
   height = in->height;
 
   int npixels = in->width * in->height;
-  data = new float[npixels];
+  data = allocPlane (npixels);
 
   for (int i = 0; i < npixels; i++)
     data[i] = in->data[i];
+
+  nonzero = NULL;
+  if (in->nonzero)
+    memcpy (allocNonzero (npixels / 64), in->nonzero,
+            npixels / 64 * sizeof (uint64_t));
 }
 
-Channel::~Channel () { delete data; }
+Channel::~Channel ()
+{
+  free (data);
+  delete[] nonzero;
+}
 /*
 void Channel::operator=(Channel* ch){
         int npixels = ch->width * ch->height;
@@ -62,6 +86,20 @@ Channel::copy (Channel *ch)
 
   for (int i = 0; i < npixels; i++)
     this->data[i] = ch->data[i];
+
+  delete[] nonzero;
+  nonzero = NULL;
+  if (ch->nonzero)
+    memcpy (allocNonzero (npixels / 64), ch->nonzero,
+            npixels / 64 * sizeof (uint64_t));
+}
+
+uint64_t *
+Channel::allocNonzero (int n_blocks)
+{
+  delete[] nonzero;
+  nonzero = new uint64_t[n_blocks];
+  return nonzero;
 }
 
 Image::Image (int _w, int _h, int _type)
@@ -127,6 +165,17 @@ Frame::Frame (Frame *in)
   Cr = new Channel (in->Cr);
 }
 
+Frame::Frame (Channel *_Y, Channel *_Cb, Channel *_Cr)
+{
+  width = _Y->width;
+  height = _Y->height;
+  type = FULLSIZE;
+
+  Y = _Y;
+  Cb = _Cb;
+  Cr = _Cr;
+}
+
 Frame::~Frame ()
 {
   delete Y;
@@ -165,6 +214,16 @@ FrameEncode::FrameEncode (int _w, int _h, int _mpg)
   Cr = new SMatrix ((_w / 2) * (_h / 2) / MPEG_CONSTANT, MPEG_CONSTANT);
 }
 
+FrameEncode::FrameEncode (SMatrix *_Y, SMatrix *_Cb, SMatrix *_Cr)
+{
+  width = _Y->width;
+  height = MPEG_CONSTANT;
+
+  Y = _Y;
+  Cb = _Cb;
+  Cr = _Cr;
+}
+
 FrameEncode::~FrameEncode ()
 {
   delete Y;
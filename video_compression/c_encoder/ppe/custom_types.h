@@ -1,6 +1,7 @@
 #ifndef custom_types_h
 #define custom_types_h
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -15,6 +16,12 @@ public:
   // std::vector<float> *data;
   int width;
   int height;
+  // Bit i of nonzero[b] is set when coefficient i of 8x8 block b is not
+  // zero, or NULL when unknown.  Blocks are in raster order and their
+  // coefficients row by row; a channel of ordered blocks (one per row of 64)
+  // has them in zig-zag order.  Either way there are width * height / 64.
+  // Set by the stages that produce it for free.
+  uint64_t *nonzero;
 
   Channel (int _width, int _height);
 
@@ -23,6 +30,8 @@ public:
   ~Channel ();
   // void operator=(Channel* c);
   void copy (Channel *c);
+  // Replace nonzero with an array for n_blocks blocks
+  uint64_t *allocNonzero (int n_blocks);
 };
 
 class Image
@@ -54,6 +63,8 @@ public:
 
   Frame (int _w, int _h, int _type);
   Frame (Frame *in);
+  // A frame that owns the given channels, of the size of _Y
+  Frame (Channel *_Y, Channel *_Cb, Channel *_Cr);
 
   ~Frame ();
 };
@@ -83,6 +94,8 @@ public:
   int type;
 
   FrameEncode (int _w, int _h, int _mpg);
+  // Owns the given matrices, one row of MPEG_CONSTANT symbols per block
+  FrameEncode (SMatrix *_Y, SMatrix *_Cb, SMatrix *_Cr);
 
   ~FrameEncode ();
 };
@@ -1,5 +1,8 @@
 #include "dct8x8_block.h"
 
+#include <math.h>
+#include <stdint.h>
+
 void
 dct8x8_block (float *in_8x8, float *out, int stride)
 {
@@ -141,3 +144,112 @@ dct8x8_block (float *in_8x8, float *out, int stride)
       out[7 * stride + column_number] = (float)F7;
     }
 }
+
+float
+dct8x8_block_dc (const float *in_8x8, int stride)
+{
+  double c4 = 0.707107;
+
+  // F0 of each row, then F0 of that column
+  double F0[8];
+  for (int row_number = 0; row_number < 8; row_number++)
+    {
+      const float *f = &in_8x8[row_number * stride];
+      double j0 = ((double)f[0] + f[7]) + ((double)f[3] + f[4]);
+      double j1 = ((double)f[1] + f[6]) + ((double)f[2] + f[5]);
+      F0[row_number] = (j0 + j1) * c4 / 2;
+    }
+
+  double j0 = (F0[0] + F0[7]) + (F0[3] + F0[4]);
+  double j1 = (F0[1] + F0[6]) + (F0[2] + F0[5]);
+  return (float)((j0 + j1) * c4 / 2);
+}
+
+static inline int32_t
+fixMul (int32_t a, int32_t c)
+{
+  return (int32_t)(((int64_t)a * c + (1 << (DCT_FIXED_BITS - 1)))
+                   >> DCT_FIXED_BITS);
+}
+
+static inline int32_t
+fixHalf (int32_t a)
+{
+  return (a + 1) >> 1;
+}
+
+#define FIX(c) ((int32_t)((c) * (1 << DCT_FIXED_BITS) + 0.5))
+
+// One 1-D pass of the Chen, Fralick and Smith flowgraph
+static inline void
+fdct8_fixed (const int32_t f[8], int32_t F[8])
+{
+  const int32_t c1 = FIX (0.980785);
+  const int32_t c2 = FIX (0.923880);
+  const int32_t c3 = FIX (0.831470);
+  const int32_t c4 = FIX (0.707107);
+  const int32_t c5 = FIX (0.555570);
+  const int32_t c6 = FIX (0.382683);
+  const int32_t c7 = FIX (0.195090);
+
+  int32_t i0 = f[0] + f[7];
+  int32_t i1 = f[1] + f[6];
+  int32_t i2 = f[2] + f[5];
+  int32_t i3 = f[3] + f[4];
+  int32_t i4 = f[3] - f[4];
+  int32_t i5 = f[2] - f[5];
+  int32_t i6 = f[1] - f[6];
+  int32_t i7 = f[0] - f[7];
+
+  int32_t j0 = i0 + i3;
+  int32_t j1 = i1 + i2;
+  int32_t j2 = i1 - i2;
+  int32_t j3 = i0 - i3;
+  int32_t j4 = i4;
+  int32_t j5 = fixMul (i6 - i5, c4);
+  int32_t j6 = fixMul (i6 + i5, c4);
+  int32_t j7 = i7;
+
+  int32_t k0 = fixMul (j0 + j1, c4);
+  int32_t k1 = fixMul (j0 - j1, c4);
+  int32_t k2 = fixMul (j2, c6) + fixMul (j3, c2);
+  int32_t k3 = fixMul (j3, c6) - fixMul (j2, c2);
+  int32_t k4 = j4 + j5;
+  int32_t k5 = j4 - j5;
+  int32_t k6 = j7 - j6;
+  int32_t k7 = j7 + j6;
+
+  F[0] = fixHalf (k0);
+  F[1] = fixHalf (fixMul (k4, c7) + fixMul (k7, c1));
+  F[2] = fixHalf (k2);
+  F[3] = fixHalf (fixMul (k6, c3) - fixMul (k5, c5));
+  F[4] = fixHalf (k1);
+  F[5] = fixHalf (fixMul (k5, c3) + fixMul (k6, c5));
+  F[6] = fixHalf (k3);
+  F[7] = fixHalf (fixMul (k7, c7) - fixMul (k4, c1));
+}
+
+void
+dct8x8_block_fixed (float *in_8x8, float *out, int stride)
+{
+  int32_t rows[8][8];
+  int32_t f[8], F[8];
+
+  for (int row_number = 0; row_number < 8; row_number++)
+    {
+      for (int i = 0; i < 8; i++)
+        f[i] = (int32_t)lrintf (in_8x8[row_number * stride + i]
+                                * (1 << DCT_FIXED_IN_BITS));
+      fdct8_fixed (f, rows[row_number]);
+    }
+
+  for (int column_number = 0; column_number < 8; column_number++)
+    {
+      for (int i = 0; i < 8; i++)
+        f[i] = rows[i][column_number];
+      fdct8_fixed (f, F);
+      for (int i = 0; i < 8; i++)
+        out[i * stride + column_number]
+            = (float)F[i] / (1 << DCT_FIXED_IN_BITS);
+    }
+}
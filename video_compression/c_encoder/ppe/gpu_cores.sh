@@ -1,9 +1,11 @@
 #!/bin/bash
 
-for num_thd in 16 32 64 128 256 512 1024
+# Sweep the pixels each work-item of the OpenCL colour conversion handles
+for per_item in 4 8 16 32 64 128 256
 do
-  echo "========== Work per GPU Core: $num_thd ==============="
-  ./cencoder -c --cl_num_thd=$num_thd > outputs
+  echo "========== Pixels per work-item: $per_item ==============="
+  ./cencoder --backend=convert=cl --cl-per-item=$per_item 2>&1 > outputs \
+    | grep "CL kernel execution time"
   cat ../../outputs/execution_stats.txt
   echo "================================================"
 done
@@ -1,13 +1,53 @@
+/* Round every operation as the host code does */
+#pragma OPENCL FP_CONTRACT OFF
+
+/* n pixels of R, G and B into Y, Cb and Cr, which may be the same
+ * buffers.  Each work-item converts per_item runs of four pixels, the k-th
+ * at run get_global_id (0) + k * get_global_size (0), so that neighbouring
+ * work-items read neighbouring runs; the pixels after the last whole run
+ * are converted one by one. */
+kernel void
+convert (global const float *R, global const float *G,
+         global const float *B, global float *Y, global float *Cb,
+         global float *Cr, int n, int per_item)
+{
+  size_t stride = get_global_size (0);
+  for (int k = 0; k < per_item; ++k)
+    {
+      size_t run = get_global_id (0) + k * stride;
+      size_t i = run * 4;
+      if (i + 4 <= n)
+        {
+          float4 r = vload4 (run, R);
+          float4 g = vload4 (run, G);
+          float4 b = vload4 (run, B);
+          vstore4 (0.299f * r + 0.587f * g + 0.113f * b, run, Y);
+          vstore4 (128 - 0.168736f * r - 0.331264f * g + 0.5f * b, run, Cb);
+          vstore4 (128 + 0.5f * r - 0.418688f * g - 0.081312f * b, run, Cr);
+        }
+      else
+        for (; i < n; ++i)
+          {
+            float r = R[i];
+            float g = G[i];
+            float b = B[i];
+            Y[i] = 0.299f * r + 0.587f * g + 0.113f * b;
+            Cb[i] = 128 - 0.168736f * r - 0.331264f * g + 0.5f * b;
+            Cr[i] = 128 + 0.5f * r - 0.418688f * g - 0.081312f * b;
+          }
+    }
+}
+
+/* convert into separate planes, leaving the RGB planes as they are */
 kernel void
-convert (global float *R, global float *G, global float *B)
+convertPlanes (global const float *R, global const float *G,
+               global const float *B, global float *Y, global float *Cb,
+               global float *Cr)
 {
   int i = get_global_id (0);
-  float y = 0.299f * R[i] + 0.587f * G[i] + 0.113f * B[i];
-  float cb = 128 - 0.168736f * R[i] - 0.331264f * G[i] + 0.5f * B[i];
-  float cr = 128 + 0.5f * R[i] - 0.418688f * G[i] - 0.081312f * B[i];
-  R[i] = y;
-  G[i] = cb;
-  B[i] = cr;
+  Y[i] = 0.299f * R[i] + 0.587f * G[i] + 0.113f * B[i];
+  Cb[i] = 128 - 0.168736f * R[i] - 0.331264f * G[i] + 0.5f * B[i];
+  Cr[i] = 128 + 0.5f * R[i] - 0.418688f * G[i] - 0.081312f * B[i];
 }
 
 #define BLKSIZE 16
@@ -32,7 +72,7 @@ motionVectorSearch (global const float *sy, global const float *scb,
   /* Load match block to local memory */
   {
     size_t global_index
-        = get_global_id (0) * get_global_size (0) + get_global_id (1);
+        = get_global_id (0) * get_global_size (1) + get_global_id (1);
     match[get_local_id (0)][get_local_id (1)]
         = (float3)(my[global_index], mcb[global_index], mcr[global_index]);
   }
@@ -46,7 +86,7 @@ motionVectorSearch (global const float *sy, global const float *scb,
         size_t scol = (local_index * 9 + i) - srow * 3 * BLKSIZE;
         size_t global_srow = (get_group_id (0) - 1) * BLKSIZE + srow;
         size_t global_scol = (get_group_id (1) - 1) * BLKSIZE + scol;
-        size_t global_index = global_srow * get_global_size (0) + global_scol;
+        size_t global_index = global_srow * get_global_size (1) + global_scol;
         search[srow][scol]
             = (float3)(sy[global_index], scb[global_index], scr[global_index]);
       }
@@ -112,8 +152,194 @@ motionVectorSearch (global const float *sy, global const float *scb,
             }
         }
       vstore2 (motion[group_best_match.x][group_best_match.y], 0,
-               &out[((get_group_id (1) - 1) * (get_num_groups (1) - 2)
+               &out[((get_group_id (1) - 1) * (get_num_groups (0) - 2)
                      + get_group_id (0) - 1)
                     * 2]);
     }
 }
+
+/* The residual of the match (my, mcb, mcr) against the source displaced by
+ * the motion vectors in out, written over the match.  Pixels outside the
+ * macroblocks keep the match, as in computeDelta. */
+kernel void
+computeDelta (global const float *sy, global const float *scb,
+              global const float *scr, global float *my, global float *mcb,
+              global float *mcr, global const int *motion)
+{
+  int x = get_global_id (0);
+  int y = get_global_id (1);
+  int width = get_global_size (1);
+  int bx = x / BLKSIZE - 1;
+  int by = y / BLKSIZE - 1;
+  int n_x = get_global_size (0) / BLKSIZE - 2;
+  int n_y = width / BLKSIZE - 2;
+  if (bx < 0 || by < 0 || bx >= n_x || by >= n_y)
+    return;
+
+  int2 v = vload2 (by * n_x + bx, motion);
+  size_t index = x * width + y;
+  size_t s = (x + v.x) * width + y + v.y;
+  my[index] -= sy[s];
+  mcb[index] -= scb[s];
+  mcr[index] -= scr[s];
+}
+
+/* The vertical pass of lowPass, from in to out, with the edges copied */
+kernel void
+lowPassV (global const float *in, global float *out)
+{
+  int row = get_global_id (0);
+  int col = get_global_id (1);
+  int height = get_global_size (0);
+  int width = get_global_size (1);
+  size_t index = row * width + col;
+  if (row == 0 || row == height - 1 || col == 0 || col == width - 1)
+    out[index] = in[index];
+  else
+    out[index] = 0.25f * in[index - width] + 0.5f * in[index]
+                 + 0.25f * in[index + width];
+}
+
+/* The horizontal pass of lowPass, in place.  Each pixel takes the one to
+ * its left already filtered, so a row is one work-item. */
+kernel void
+lowPassH (global float *out, int width)
+{
+  global float *line = &out[(get_global_id (0) + 1) * width];
+  for (int col = 1; col < width - 1; col++)
+    line[col] = 0.25f * line[col - 1] + 0.5f * line[col]
+                + 0.25f * line[col + 1];
+}
+
+/* Every other pixel of every other row of in, as downSample */
+kernel void
+downSample (global const float *in, global float *out)
+{
+  int x2 = get_global_id (0);
+  int y2 = get_global_id (1);
+  int w2 = get_global_size (1);
+  out[x2 * w2 + y2] = in[(2 * x2) * (2 * w2) + 2 * y2];
+}
+
+/* The DCT is done in double, as dct8x8_block does, where the device has it.
+ * In float the result can be a quantiser step off (see
+ * transformToleranceCL). */
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double dct_real;
+#define DCT_CONSTANT(c) c
+/* The float quotient rounded as the host rounds it: the quotient of two
+ * floats in double, rounded to float, is the correctly rounded one */
+#define QUOTIENT(a, b) ((float)((double)(a) / (b)))
+#else
+typedef float dct_real;
+#define DCT_CONSTANT(c) c##f
+#define QUOTIENT(a, b) ((a) / (b))
+#endif
+
+/* Coefficient u of the 1-D DCT of f, through the flowgraph of Chen, Fralick
+ * and Smith with the operations of dct8x8_block in the same order */
+dct_real
+chenDCT (const dct_real *f, int u)
+{
+  const dct_real c1 = DCT_CONSTANT (0.980785);
+  const dct_real c2 = DCT_CONSTANT (0.923880);
+  const dct_real c3 = DCT_CONSTANT (0.831470);
+  const dct_real c4 = DCT_CONSTANT (0.707107);
+  const dct_real c5 = DCT_CONSTANT (0.555570);
+  const dct_real c6 = DCT_CONSTANT (0.382683);
+  const dct_real c7 = DCT_CONSTANT (0.195090);
+
+  dct_real i0 = f[0] + f[7];
+  dct_real i1 = f[1] + f[6];
+  dct_real i2 = f[2] + f[5];
+  dct_real i3 = f[3] + f[4];
+  dct_real i4 = f[3] - f[4];
+  dct_real i5 = f[2] - f[5];
+  dct_real i6 = f[1] - f[6];
+  dct_real i7 = f[0] - f[7];
+
+  dct_real j0 = i0 + i3;
+  dct_real j1 = i1 + i2;
+  dct_real j2 = i1 - i2;
+  dct_real j3 = i0 - i3;
+  dct_real j4 = i4;
+  dct_real j5 = (i6 - i5) * c4;
+  dct_real j6 = (i6 + i5) * c4;
+  dct_real j7 = i7;
+
+  dct_real k4 = j4 + j5;
+  dct_real k5 = j4 - j5;
+  dct_real k6 = j7 - j6;
+  dct_real k7 = j7 + j6;
+
+  switch (u)
+    {
+    case 0:
+      return (j0 + j1) * c4 / 2;
+    case 1:
+      return (k4 * c7 + k7 * c1) / 2;
+    case 2:
+      return ((j2 * c6) + (j3 * c2)) / 2;
+    case 3:
+      return (k6 * c3 - k5 * c5) / 2;
+    case 4:
+      return (j0 - j1) * c4 / 2;
+    case 5:
+      return (k5 * c3 + k6 * c5) / 2;
+    case 6:
+      return ((j3 * c6) - (j2 * c2)) / 2;
+    default:
+      return (k7 * c7 - k4 * c1) / 2;
+    }
+}
+
+/* Zig-zag position of each coefficient of a block in raster order */
+constant int zigzag_position[64]
+    = { 0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+        3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+        10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+        21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63 };
+
+/* dct8x8, quant8x8 and zigZagOrderMask of a channel in one pass: a work-group
+ * per 8x8 block transforms it in local memory and writes its quantised
+ * coefficients in zig-zag order, with their nonzero positions, at the
+ * block's raster number. */
+kernel void
+transformBlocks (global const float *in, constant float *steps,
+                 global short *coeffs, global ulong *nonzero)
+{
+  local float block[8][8];
+  local dct_real rows[8][8];
+  local uint bits[2];
+  int i = get_local_id (0);
+  int j = get_local_id (1);
+  int width = get_global_size (1);
+  dct_real f[8];
+
+  block[i][j] = in[get_global_id (0) * width + get_global_id (1)] - 128;
+  if (i == 0 && j < 2)
+    bits[j] = 0;
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  /* Coefficient j of row i, then coefficient i of column j */
+  for (int k = 0; k < 8; k++)
+    f[k] = block[i][k];
+  rows[i][j] = chenDCT (f, j);
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  for (int k = 0; k < 8; k++)
+    f[k] = rows[k][j];
+  float coefficient = (float)chenDCT (f, i);
+  float q = round (QUOTIENT (coefficient, steps[i * 8 + j]));
+
+  int z = zigzag_position[i * 8 + j];
+  size_t n = get_group_id (0) * get_num_groups (1) + get_group_id (1);
+  coeffs[n * 64 + z] = (short)q;
+  if (q != 0)
+    atomic_or (&bits[z >> 5], 1u << (z & 31));
+  barrier (CLK_LOCAL_MEM_FENCE);
+
+  if (i == 0 && j == 0)
+    nonzero[n] = bits[0] | (ulong)bits[1] << 32;
+}
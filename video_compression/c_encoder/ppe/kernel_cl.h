@@ -0,0 +1,347 @@
+static const char kernel_source[] =
+  "/* Round every operation as the host code does */\n"
+  "#pragma OPENCL FP_CONTRACT OFF\n"
+  "\n"
+  "/* n pixels of R, G and B into Y, Cb and Cr, which may be the same\n"
+  " * buffers.  Each work-item converts per_item runs of four pixels, the k-th\n"
+  " * at run get_global_id (0) + k * get_global_size (0), so that neighbouring\n"
+  " * work-items read neighbouring runs; the pixels after the last whole run\n"
+  " * are converted one by one. */\n"
+  "kernel void\n"
+  "convert (global const float *R, global const float *G,\n"
+  "         global const float *B, global float *Y, global float *Cb,\n"
+  "         global float *Cr, int n, int per_item)\n"
+  "{\n"
+  "  size_t stride = get_global_size (0);\n"
+  "  for (int k = 0; k < per_item; ++k)\n"
+  "    {\n"
+  "      size_t run = get_global_id (0) + k * stride;\n"
+  "      size_t i = run * 4;\n"
+  "      if (i + 4 <= n)\n"
+  "        {\n"
+  "          float4 r = vload4 (run, R);\n"
+  "          float4 g = vload4 (run, G);\n"
+  "          float4 b = vload4 (run, B);\n"
+  "          vstore4 (0.299f * r + 0.587f * g + 0.113f * b, run, Y);\n"
+  "          vstore4 (128 - 0.168736f * r - 0.331264f * g + 0.5f * b, run, Cb);\n"
+  "          vstore4 (128 + 0.5f * r - 0.418688f * g - 0.081312f * b, run, Cr);\n"
+  "        }\n"
+  "      else\n"
+  "        for (; i < n; ++i)\n"
+  "          {\n"
+  "            float r = R[i];\n"
+  "            float g = G[i];\n"
+  "            float b = B[i];\n"
+  "            Y[i] = 0.299f * r + 0.587f * g + 0.113f * b;\n"
+  "            Cb[i] = 128 - 0.168736f * r - 0.331264f * g + 0.5f * b;\n"
+  "            Cr[i] = 128 + 0.5f * r - 0.418688f * g - 0.081312f * b;\n"
+  "          }\n"
+  "    }\n"
+  "}\n"
+  "\n"
+  "/* convert into separate planes, leaving the RGB planes as they are */\n"
+  "kernel void\n"
+  "convertPlanes (global const float *R, global const float *G,\n"
+  "               global const float *B, global float *Y, global float *Cb,\n"
+  "               global float *Cr)\n"
+  "{\n"
+  "  int i = get_global_id (0);\n"
+  "  Y[i] = 0.299f * R[i] + 0.587f * G[i] + 0.113f * B[i];\n"
+  "  Cb[i] = 128 - 0.168736f * R[i] - 0.331264f * G[i] + 0.5f * B[i];\n"
+  "  Cr[i] = 128 + 0.5f * R[i] - 0.418688f * G[i] - 0.081312f * B[i];\n"
+  "}\n"
+  "\n"
+  "#define BLKSIZE 16\n"
+  "\n"
+  "kernel void\n"
+  "motionVectorSearch (global const float *sy, global const float *scb,\n"
+  "                    global const float *scr, global const float *my,\n"
+  "                    global const float *mcb, global const float *mcr,\n"
+  "                    global int *out)\n"
+  "{\n"
+  "  if (get_group_id (0) == 0 || get_group_id (0) == get_num_groups (0) - 1\n"
+  "      || get_group_id (1) == 0 || get_group_id (1) == get_num_groups (1) - 1)\n"
+  "    {\n"
+  "      return;\n"
+  "    }\n"
+  "\n"
+  "  local float3 search[BLKSIZE * 3][BLKSIZE * 3];\n"
+  "  local float3 match[BLKSIZE][BLKSIZE];\n"
+  "  local float sad[BLKSIZE][BLKSIZE];\n"
+  "  local int2 motion[BLKSIZE][BLKSIZE];\n"
+  "\n"
+  "  /* Load match block to local memory */\n"
+  "  {\n"
+  "    size_t global_index\n"
+  "        = get_global_id (0) * get_global_size (1) + get_global_id (1);\n"
+  "    match[get_local_id (0)][get_local_id (1)]\n"
+  "        = (float3)(my[global_index], mcb[global_index], mcr[global_index]);\n"
+  "  }\n"
+  "\n"
+  "  /* Load search blocks to local memory */\n"
+  "  {\n"
+  "    size_t local_index = get_local_id (0) * BLKSIZE + get_local_id (1);\n"
+  "    for (size_t i = 0; i < 9; ++i)\n"
+  "      {\n"
+  "        size_t srow = (local_index * 9 + i) / (3 * BLKSIZE);\n"
+  "        size_t scol = (local_index * 9 + i) - srow * 3 * BLKSIZE;\n"
+  "        size_t global_srow = (get_group_id (0) - 1) * BLKSIZE + srow;\n"
+  "        size_t global_scol = (get_group_id (1) - 1) * BLKSIZE + scol;\n"
+  "        size_t global_index = global_srow * get_global_size (1) + global_scol;\n"
+  "        search[srow][scol]\n"
+  "            = (float3)(sy[global_index], scb[global_index], scr[global_index]);\n"
+  "      }\n"
+  "  }\n"
+  "\n"
+  "  work_group_barrier (CLK_LOCAL_MEM_FENCE);\n"
+  "\n"
+  "  /* Compute sad for different search blocks */\n"
+  "  {\n"
+  "    size_t search_size = BLKSIZE * 2 + 1;\n"
+  "    size_t n_blocks\n"
+  "        = ceil (search_size * search_size\n"
+  "                / (float)(get_local_size (0) * get_local_size (1)));\n"
+  "    float thread_best_match_sad = 1E10;\n"
+  "    int2 thread_best_match_location;\n"
+  "    size_t local_index = get_local_id (0) * BLKSIZE + get_local_id (1);\n"
+  "    for (size_t i = local_index * n_blocks;\n"
+  "         i < (local_index + 1) * n_blocks && i < search_size * search_size;\n"
+  "         ++i)\n"
+  "      {\n"
+  "        float3 current_match_sad = (float3)(0, 0, 0);\n"
+  "        size_t srow0 = i / search_size;\n"
+  "        size_t scol0 = i - srow0 * search_size;\n"
+  "        for (size_t mrow = 0; mrow < BLKSIZE; ++mrow)\n"
+  "          {\n"
+  "            for (size_t mcol = 0; mcol < BLKSIZE; ++mcol)\n"
+  "              {\n"
+  "                size_t srow = srow0 + mrow;\n"
+  "                size_t scol = scol0 + mcol;\n"
+  "                float3 diff = fabs (match[mrow][mcol] - search[srow][scol]);\n"
+  "                /* no need to compute every iteration:\n"
+  "                 * 0.5f * diff.r + 0.25f * diff.g + 0.25f * diff.b; */\n"
+  "                current_match_sad += diff;\n"
+  "              }\n"
+  "          }\n"
+  "        float current_match_sad_weighted = 0.5f * current_match_sad.r\n"
+  "                                           + 0.25f * current_match_sad.g\n"
+  "                                           + 0.25f * current_match_sad.b;\n"
+  "        if (current_match_sad_weighted < thread_best_match_sad)\n"
+  "          {\n"
+  "            thread_best_match_sad = current_match_sad_weighted;\n"
+  "            thread_best_match_location\n"
+  "                = (int2)(-BLKSIZE + srow0, -BLKSIZE + scol0);\n"
+  "          }\n"
+  "      }\n"
+  "    sad[get_local_id (0)][get_local_id (1)] = thread_best_match_sad;\n"
+  "    motion[get_local_id (0)][get_local_id (1)] = thread_best_match_location;\n"
+  "  }\n"
+  "\n"
+  "  work_group_barrier (CLK_LOCAL_MEM_FENCE);\n"
+  "\n"
+  "  if (get_local_id (0) == 0 && get_local_id (1) == 0)\n"
+  "    {\n"
+  "      uint2 group_best_match = (uint2)(0, 0);\n"
+  "      for (size_t i = 0; i < get_local_size (0); ++i)\n"
+  "        {\n"
+  "          for (size_t j = 0; j < get_local_size (1); ++j)\n"
+  "            {\n"
+  "              if (sad[i][j] < sad[group_best_match.x][group_best_match.y])\n"
+  "                {\n"
+  "                  group_best_match = (uint2)(i, j);\n"
+  "                }\n"
+  "            }\n"
+  "        }\n"
+  "      vstore2 (motion[group_best_match.x][group_best_match.y], 0,\n"
+  "               &out[((get_group_id (1) - 1) * (get_num_groups (0) - 2)\n"
+  "                     + get_group_id (0) - 1)\n"
+  "                    * 2]);\n"
+  "    }\n"
+  "}\n"
+  "\n"
+  "/* The residual of the match (my, mcb, mcr) against the source displaced by\n"
+  " * the motion vectors in out, written over the match.  Pixels outside the\n"
+  " * macroblocks keep the match, as in computeDelta. */\n"
+  "kernel void\n"
+  "computeDelta (global const float *sy, global const float *scb,\n"
+  "              global const float *scr, global float *my, global float *mcb,\n"
+  "              global float *mcr, global const int *motion)\n"
+  "{\n"
+  "  int x = get_global_id (0);\n"
+  "  int y = get_global_id (1);\n"
+  "  int width = get_global_size (1);\n"
+  "  int bx = x / BLKSIZE - 1;\n"
+  "  int by = y / BLKSIZE - 1;\n"
+  "  int n_x = get_global_size (0) / BLKSIZE - 2;\n"
+  "  int n_y = width / BLKSIZE - 2;\n"
+  "  if (bx < 0 || by < 0 || bx >= n_x || by >= n_y)\n"
+  "    return;\n"
+  "\n"
+  "  int2 v = vload2 (by * n_x + bx, motion);\n"
+  "  size_t index = x * width + y;\n"
+  "  size_t s = (x + v.x) * width + y + v.y;\n"
+  "  my[index] -= sy[s];\n"
+  "  mcb[index] -= scb[s];\n"
+  "  mcr[index] -= scr[s];\n"
+  "}\n"
+  "\n"
+  "/* The vertical pass of lowPass, from in to out, with the edges copied */\n"
+  "kernel void\n"
+  "lowPassV (global const float *in, global float *out)\n"
+  "{\n"
+  "  int row = get_global_id (0);\n"
+  "  int col = get_global_id (1);\n"
+  "  int height = get_global_size (0);\n"
+  "  int width = get_global_size (1);\n"
+  "  size_t index = row * width + col;\n"
+  "  if (row == 0 || row == height - 1 || col == 0 || col == width - 1)\n"
+  "    out[index] = in[index];\n"
+  "  else\n"
+  "    out[index] = 0.25f * in[index - width] + 0.5f * in[index]\n"
+  "                 + 0.25f * in[index + width];\n"
+  "}\n"
+  "\n"
+  "/* The horizontal pass of lowPass, in place.  Each pixel takes the one to\n"
+  " * its left already filtered, so a row is one work-item. */\n"
+  "kernel void\n"
+  "lowPassH (global float *out, int width)\n"
+  "{\n"
+  "  global float *line = &out[(get_global_id (0) + 1) * width];\n"
+  "  for (int col = 1; col < width - 1; col++)\n"
+  "    line[col] = 0.25f * line[col - 1] + 0.5f * line[col]\n"
+  "                + 0.25f * line[col + 1];\n"
+  "}\n"
+  "\n"
+  "/* Every other pixel of every other row of in, as downSample */\n"
+  "kernel void\n"
+  "downSample (global const float *in, global float *out)\n"
+  "{\n"
+  "  int x2 = get_global_id (0);\n"
+  "  int y2 = get_global_id (1);\n"
+  "  int w2 = get_global_size (1);\n"
+  "  out[x2 * w2 + y2] = in[(2 * x2) * (2 * w2) + 2 * y2];\n"
+  "}\n"
+  "\n"
+  "/* The DCT is done in double, as dct8x8_block does, where the device has it.\n"
+  " * In float the result can be a quantiser step off (see\n"
+  " * transformToleranceCL). */\n"
+  "#ifdef cl_khr_fp64\n"
+  "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+  "typedef double dct_real;\n"
+  "#define DCT_CONSTANT(c) c\n"
+  "/* The float quotient rounded as the host rounds it: the quotient of two\n"
+  " * floats in double, rounded to float, is the correctly rounded one */\n"
+  "#define QUOTIENT(a, b) ((float)((double)(a) / (b)))\n"
+  "#else\n"
+  "typedef float dct_real;\n"
+  "#define DCT_CONSTANT(c) c##f\n"
+  "#define QUOTIENT(a, b) ((a) / (b))\n"
+  "#endif\n"
+  "\n"
+  "/* Coefficient u of the 1-D DCT of f, through the flowgraph of Chen, Fralick\n"
+  " * and Smith with the operations of dct8x8_block in the same order */\n"
+  "dct_real\n"
+  "chenDCT (const dct_real *f, int u)\n"
+  "{\n"
+  "  const dct_real c1 = DCT_CONSTANT (0.980785);\n"
+  "  const dct_real c2 = DCT_CONSTANT (0.923880);\n"
+  "  const dct_real c3 = DCT_CONSTANT (0.831470);\n"
+  "  const dct_real c4 = DCT_CONSTANT (0.707107);\n"
+  "  const dct_real c5 = DCT_CONSTANT (0.555570);\n"
+  "  const dct_real c6 = DCT_CONSTANT (0.382683);\n"
+  "  const dct_real c7 = DCT_CONSTANT (0.195090);\n"
+  "\n"
+  "  dct_real i0 = f[0] + f[7];\n"
+  "  dct_real i1 = f[1] + f[6];\n"
+  "  dct_real i2 = f[2] + f[5];\n"
+  "  dct_real i3 = f[3] + f[4];\n"
+  "  dct_real i4 = f[3] - f[4];\n"
+  "  dct_real i5 = f[2] - f[5];\n"
+  "  dct_real i6 = f[1] - f[6];\n"
+  "  dct_real i7 = f[0] - f[7];\n"
+  "\n"
+  "  dct_real j0 = i0 + i3;\n"
+  "  dct_real j1 = i1 + i2;\n"
+  "  dct_real j2 = i1 - i2;\n"
+  "  dct_real j3 = i0 - i3;\n"
+  "  dct_real j4 = i4;\n"
+  "  dct_real j5 = (i6 - i5) * c4;\n"
+  "  dct_real j6 = (i6 + i5) * c4;\n"
+  "  dct_real j7 = i7;\n"
+  "\n"
+  "  dct_real k4 = j4 + j5;\n"
+  "  dct_real k5 = j4 - j5;\n"
+  "  dct_real k6 = j7 - j6;\n"
+  "  dct_real k7 = j7 + j6;\n"
+  "\n"
+  "  switch (u)\n"
+  "    {\n"
+  "    case 0:\n"
+  "      return (j0 + j1) * c4 / 2;\n"
+  "    case 1:\n"
+  "      return (k4 * c7 + k7 * c1) / 2;\n"
+  "    case 2:\n"
+  "      return ((j2 * c6) + (j3 * c2)) / 2;\n"
+  "    case 3:\n"
+  "      return (k6 * c3 - k5 * c5) / 2;\n"
+  "    case 4:\n"
+  "      return (j0 - j1) * c4 / 2;\n"
+  "    case 5:\n"
+  "      return (k5 * c3 + k6 * c5) / 2;\n"
+  "    case 6:\n"
+  "      return ((j3 * c6) - (j2 * c2)) / 2;\n"
+  "    default:\n"
+  "      return (k7 * c7 - k4 * c1) / 2;\n"
+  "    }\n"
+  "}\n"
+  "\n"
+  "/* Zig-zag position of each coefficient of a block in raster order */\n"
+  "constant int zigzag_position[64]\n"
+  "    = { 0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,\n"
+  "        3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,\n"
+  "        10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,\n"
+  "        21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63 };\n"
+  "\n"
+  "/* dct8x8, quant8x8 and zigZagOrderMask of a channel in one pass: a work-group\n"
+  " * per 8x8 block transforms it in local memory and writes its quantised\n"
+  " * coefficients in zig-zag order, with their nonzero positions, at the\n"
+  " * block's raster number. */\n"
+  "kernel void\n"
+  "transformBlocks (global const float *in, constant float *steps,\n"
+  "                 global short *coeffs, global ulong *nonzero)\n"
+  "{\n"
+  "  local float block[8][8];\n"
+  "  local dct_real rows[8][8];\n"
+  "  local uint bits[2];\n"
+  "  int i = get_local_id (0);\n"
+  "  int j = get_local_id (1);\n"
+  "  int width = get_global_size (1);\n"
+  "  dct_real f[8];\n"
+  "\n"
+  "  block[i][j] = in[get_global_id (0) * width + get_global_id (1)] - 128;\n"
+  "  if (i == 0 && j < 2)\n"
+  "    bits[j] = 0;\n"
+  "  barrier (CLK_LOCAL_MEM_FENCE);\n"
+  "\n"
+  "  /* Coefficient j of row i, then coefficient i of column j */\n"
+  "  for (int k = 0; k < 8; k++)\n"
+  "    f[k] = block[i][k];\n"
+  "  rows[i][j] = chenDCT (f, j);\n"
+  "  barrier (CLK_LOCAL_MEM_FENCE);\n"
+  "\n"
+  "  for (int k = 0; k < 8; k++)\n"
+  "    f[k] = rows[k][j];\n"
+  "  float coefficient = (float)chenDCT (f, i);\n"
+  "  float q = round (QUOTIENT (coefficient, steps[i * 8 + j]));\n"
+  "\n"
+  "  int z = zigzag_position[i * 8 + j];\n"
+  "  size_t n = get_group_id (0) * get_num_groups (1) + get_group_id (1);\n"
+  "  coeffs[n * 64 + z] = (short)q;\n"
+  "  if (q != 0)\n"
+  "    atomic_or (&bits[z >> 5], 1u << (z & 31));\n"
+  "  barrier (CLK_LOCAL_MEM_FENCE);\n"
+  "\n"
+  "  if (i == 0 && j == 0)\n"
+  "    nonzero[n] = bits[0] | (ulong)bits[1] << 32;\n"
+  "}\n"
+  ;
@@ -1,17 +1,24 @@
+#include "autotune.h"
+#include "backend.h"
+#include "check.h"
 #include "cmd_args.h"
 #include "config.h"
 #include "custom_types.h"
-#include "dct8x8_block.h"
-#include "opt_openacc.h"
 #include "opt_opencl.h"
+#include "opt_simd.h"
+#include "perf_counters.h"
+#include "roofline.h"
+#include "skip.h"
+#include "stages.h"
+#include "synth.h"
 #include "test_setup.h"
 #include "timer.h"
+#include "trace.h"
 #include "xml_aux.h"
 #include <cstddef>
 #include <cstdio>
 #include <iostream>
-#include <math.h>
-#include <omp.h>
+#include <error.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,11 +31,52 @@
 using namespace std;
 
 #define MAX_SOURCE_SIZE (0x100000)
-Args args;
+Backends backends;
+// The generated sequence with --synth
+static Synth synth;
+// Thresholds for skipped macroblocks with --skip
+static SkipParams skip_params;
+
+static const char *stage_trace_name[10]
+    = { "convert", "lowPass", "motionVectorSearch", "computeDelta",
+        "downSample", "dct8x8", "quant8x8", "dcDiff", "zigZagOrder",
+        "encode8x8" };
+
+// Time stage i of encode() into runtime[i] and, with --perf, count its
+// hardware events into perf[i].  The counters are read and the trace span
+// recorded outside the timed region.
+#define BEGIN_STAGE(i)                                                        \
+  do                                                                          \
+    {                                                                         \
+      if (args.perf)                                                          \
+        readPerfCounters (&perf_begin);                                       \
+      TRACE_BEGIN (stage_trace_name[i], frame_number);                        \
+      gettimeofday (&starttime, NULL);                                        \
+    }                                                                         \
+  while (0)
+
+#define END_STAGE(i)                                                          \
+  do                                                                          \
+    {                                                                         \
+      gettimeofday (&endtime, NULL);                                          \
+      runtime[i] = double (endtime.tv_sec) * 1000.0f                          \
+                   + double (endtime.tv_usec) / 1000.0f                       \
+                   - double (starttime.tv_sec) * 1000.0f                      \
+                   - double (starttime.tv_usec) / 1000.0f; /* in ms */        \
+      TRACE_END ();                                                           \
+      if (args.perf)                                                          \
+        {                                                                     \
+          PerfCounts perf_end;                                                \
+          readPerfCounters (&perf_end);                                       \
+          perfCountsDiff (&perf[i], &perf_begin, &perf_end);                  \
+        }                                                                     \
+    }                                                                         \
+  while (0)
 
 void
 loadImage (int number, string path, Image **photo)
 {
+  TraceSpan span ("loadImage", number);
   string filename;
   TIFFRGBAImage img;
   char emsg[1024];
@@ -77,513 +125,48 @@ loadImage (int number, string path, Image **photo)
   TIFFClose (tif);
 }
 
-void
-convertOMP (size_t size, const float *R, const float *G, const float *B,
-            float *Y, float *Cb, float *Cr)
-{
-#pragma omp parallel for
-  for (int i = 0; i < size; ++i)
-    {
-      float r = R[i];
-      float g = G[i];
-      float b = B[i];
-      float y = 0 + (0.299f * r) + (0.587f * g) + (0.113f * b);
-      float cb = 128 - (0.168736f * r) - (0.331264f * g) + (0.5f * b);
-      float cr = 128 + (0.5f * r) - (0.418688f * g) - (0.081312f * b);
-      Y[i] = y;
-      Cb[i] = cb;
-      Cr[i] = cr;
-    }
-}
-
-void
-convertRGBtoYCbCr (Image *in, Image *out)
-{
-  int size = in->width * in->height;
-  const float *R = in->rc->data;
-  const float *G = in->gc->data;
-  const float *B = in->bc->data;
-  float *Y = out->rc->data;
-  float *Cb = out->gc->data;
-  float *Cr = out->bc->data;
-
-  convertOMP (size, R, G, B, Y, Cb, Cr);
-}
-
-Channel *
-lowPass (Channel *in, Channel *out)
-{
-  // Applies a simple 3-tap low-pass filter in the X- and Y- dimensions.
-  // E.g., blur
-  // weights for neighboring pixels
-  const float a = 0.25;
-  const float b = 0.5;
-  const float c = 0.25;
-
-  int width = in->width;
-  int height = in->height;
-
-  int edge_rows[] = { 0, height - 1 };
-  int edge_cols[] = { 0, width - 1 };
-
-  for (int i = 0; i < 2; ++i)
-    {
-      int row = edge_rows[i];
-      for (int col = 0; col < width; ++col)
-        {
-          out->data[row * width + col] = in->data[row * width + col];
-        }
-    }
-
-  for (int i = 0; i < 2; ++i)
-    {
-      int col = edge_cols[i];
-      for (int row = 1; row < height - 1; ++row)
-        {
-          out->data[row * width + col] = in->data[row * width + col];
-        }
-    }
-
-#pragma omp parallel
-  {
-    int columns_per_thread
-        = (width + omp_get_num_threads () - 1) / omp_get_num_threads ();
-    int col_begin = 1 + omp_get_thread_num () * columns_per_thread;
-    int col_end = col_begin + columns_per_thread;
-
-    for (int row = 1; row < height - 1; row++)
-      for (int col = col_begin; col < std::min (col_end, width - 1); col++)
-        {
-          out->data[row * width + col]
-              = a * in->data[(row - 1) * width + col]
-                + b * in->data[row * width + col]
-                + c * in->data[(row + 1) * width + col];
-        }
-  }
-
-#pragma omp parallel for
-  for (int row = 1; row < (height - 1); row++)
-    for (int col = 1; col < (width - 1); col++)
-      {
-        out->data[row * width + col]
-            = a * out->data[row * width + (col - 1)]
-              + b * out->data[row * width + col]
-              + c * out->data[row * width + (col + 1)];
-      }
-
-  return out;
-}
-
-std::vector<mVector> *
-motionVectorSearchCL (Frame *source, Frame *match, int width, int height)
-{
-  const float *s[] = { source->Y->data, source->Cb->data, source->Cr->data };
-  const float *m[] = { match->Y->data, match->Cb->data, match->Cr->data };
-  size_t size[] = { (size_t)width, (size_t)height };
-  int block_size = 16;
-  size_t motion_vector_size
-      = (width / block_size - 2) * (height / block_size - 2);
-  std::vector<mVector> *motion_vectors
-      = new std::vector<mVector> (motion_vector_size);
-  motionCL (size, block_size, s, m, (int *)motion_vectors->data ());
-  return motion_vectors;
-}
-
-std::vector<mVector> *
-motionVectorSearch (Frame *source, Frame *match, int width, int height)
+// Frame number of the input: the TIFF at path, or the generated one with
+// --synth
+static void
+loadFrame (int number, const string &path, Image **photo)
 {
-  std::vector<mVector> *motion_vectors
-      = new std::vector<mVector> (); // empty list of ints
-
-  float Y_weight = 0.5;
-  float Cr_weight = 0.25;
-  float Cb_weight = 0.25;
-
-  // Window size is how much on each side of the block we search
-  int window_size = 16;
-  int block_size = 16;
-
-  // How far from the edge we can go since we don't special case the edges
-  int inset = (int)max ((float)window_size, (float)block_size);
-  int iter = 0;
-
-  for (int my = inset; my < height - (inset + window_size) + 1;
-       my += block_size)
+  if (!args.synth_spec)
     {
-      for (int mx = inset; mx < width - (inset + window_size) + 1;
-           mx += block_size)
-        {
-          float best_match_sad = 1e10;
-          int best_match_location[2] = { 0, 0 };
-
-          for (int sy = my - window_size; sy < my + window_size; sy++)
-            {
-              for (int sx = mx - window_size; sx < mx + window_size; sx++)
-                {
-                  float current_match_sad = 0;
-                  // Do the SAD
-                  for (int y = 0; y < block_size; y++)
-                    {
-                      for (int x = 0; x < block_size; x++)
-                        {
-                          int match_x = mx + x;
-                          int match_y = my + y;
-                          int search_x = sx + x;
-                          int search_y = sy + y;
-                          float diff_Y = abs (
-                              match->Y->data[match_x * width + match_y]
-                              - source->Y->data[search_x * width + search_y]);
-                          float diff_Cb = abs (
-                              match->Cb->data[match_x * width + match_y]
-                              - source->Cb->data[search_x * width + search_y]);
-                          float diff_Cr = abs (
-                              match->Cr->data[match_x * width + match_y]
-                              - source->Cr->data[search_x * width + search_y]);
-
-                          float diff_total = Y_weight * diff_Y
-                                             + Cb_weight * diff_Cb
-                                             + Cr_weight * diff_Cr;
-                          current_match_sad = current_match_sad + diff_total;
-                        }
-                    } // end SAD
-
-                  if (current_match_sad < best_match_sad)
-                    {
-                      best_match_sad = current_match_sad;
-                      best_match_location[0] = sx - mx;
-                      best_match_location[1] = sy - my;
-                    }
-                }
-            }
-
-          mVector v;
-          v.a = best_match_location[0];
-          v.b = best_match_location[1];
-          motion_vectors->push_back (v);
-        }
+      loadImage (number, path, photo);
+      return;
     }
-  return motion_vectors;
+  TraceSpan span ("synthImage", number);
+  synthImage (&synth, number, photo);
 }
 
-Frame *
-computeDelta (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
-              std::vector<mVector> *motion_vectors)
+// A frame with channels of the same size as those of f
+static Frame *
+newFrameLike (Frame *f)
 {
-  Frame *delta = new Frame (p_frame_ycbcr);
-
-  int width = i_frame_ycbcr->width;
-  int height = i_frame_ycbcr->height;
-  int window_size = 16;
-  int block_size = 16;
-  // How far from the edge we can go since we don't special case the edges
-  int inset = (int)max ((float)window_size, (float)block_size);
-
-  int current_block = 0;
-  for (int my = inset; my < width - (inset + window_size) + 1;
-       my += block_size)
-    {
-      for (int mx = inset; mx < height - (inset + window_size) + 1;
-           mx += block_size)
-        {
-          int vector[2];
-          vector[0] = (int)motion_vectors->at (current_block).a;
-          vector[1] = (int)motion_vectors->at (current_block).b;
-
-          // copy the block
-          for (int y = 0; y < block_size; y++)
-            {
-              for (int x = 0; x < block_size; x++)
-                {
-
-                  int src_x = mx + vector[0] + x;
-                  int src_y = my + vector[1] + y;
-                  int dst_x = mx + x;
-                  int dst_y = my + y;
-                  delta->Y->data[dst_x * width + dst_y]
-                      = delta->Y->data[dst_x * width + dst_y]
-                        - i_frame_ycbcr->Y->data[src_x * width + src_y];
-                  delta->Cb->data[dst_x * width + dst_y]
-                      = delta->Cb->data[dst_x * width + dst_y]
-                        - i_frame_ycbcr->Cb->data[src_x * width + src_y];
-                  delta->Cr->data[dst_x * width + dst_y]
-                      = delta->Cr->data[dst_x * width + dst_y]
-                        - i_frame_ycbcr->Cr->data[src_x * width + src_y];
-                }
-            }
-
-          current_block = current_block + 1;
-        }
-    }
-  return delta;
-}
-
-Channel *
-downSample (Channel *in)
-{
-  int width = in->width;
-  int height = in->height;
-  int w2 = width / 2;
-  int h2 = height / 2;
-
-  Channel *out = new Channel ((width / 2), (height / 2));
-
-  for (int y2 = 0, y = 0; y2 < w2; y2++)
-    {
-      for (int x2 = 0, x = 0; x2 < h2; x2++)
-        {
-
-          out->data[x2 * w2 + y2] = in->data[x * width + y];
-          x += 2;
-        }
-      y += 2;
-    }
-
-  return out;
-}
-
-void
-dct8x8 (Channel *in, Channel *out)
-{
-  int width = in->width;
-  int height = in->height;
-
-  // 8x8 block dct on each block
-  for (int i = 0; i < width * height; i++)
-    {
-      in->data[i] -= 128;
-      out->data[i] = 0; // zeros
-    }
-
-  for (int y = 0; y < width; y += 8)
-    {
-      for (int x = 0; x < height; x += 8)
-        {
-          dct8x8_block (&(in->data[x * width + y]),
-                        &(out->data[x * width + y]), width);
-        }
-    }
-}
-
-void
-round_block (float *in, float *out, int stride)
-{
-  float quantMatrix[8][8] = {
-    { 16, 11, 10, 16, 24, 40, 51, 61 },
-    { 12, 12, 14, 19, 26, 58, 60, 55 },
-    { 14, 13, 16, 24, 40, 57, 69, 56 },
-    { 14, 17, 22, 29, 51, 87, 80, 62 },
-    { 18, 22, 37, 56, 68, 109, 103, 77 },
-    { 24, 35, 55, 64, 81, 104, 113, 92 },
-    { 49, 64, 78, 87, 103, 121, 120, 101 },
-    { 72, 92, 95, 98, 112, 100, 103, 99 },
-  };
-
-  for (int y = 0; y < 8; y++)
-    {
-      for (int x = 0; x < 8; x++)
-        {
-          quantMatrix[x][y] = ceil (quantMatrix[x][y] / QUALITY);
-          out[x * stride + y]
-              = (float)round (in[x * stride + y] / quantMatrix[x][y]);
-        }
-    }
-}
-
-void
-quant8x8 (Channel *in, Channel *out)
-{
-  int width = in->width;
-  int height = in->height;
-
-  for (int i = 0; i < width * height; i++)
-    {
-      out->data[i] = 0; // zeros
-    }
-
-  for (int y = 0; y < width; y += 8)
-    {
-      for (int x = 0; x < height; x += 8)
-        {
-          round_block (&(in->data[x * width + y]), &(out->data[x * width + y]),
-                       width);
-        }
-    }
-}
-
-void
-dcDiff (Channel *in, Channel *out)
-{
-  int width = in->width;
-  int height = in->height;
-
-  int number_of_dc = width * height / 64;
-  double *dc_values_transposed = new double[number_of_dc];
-  double *dc_values = new double[number_of_dc];
-
-  int iter = 0;
-  for (int j = 0; j < width; j += 8)
-    {
-      for (int i = 0; i < height; i += 8)
-        {
-          dc_values_transposed[iter] = in->data[i * width + j];
-          dc_values[iter] = in->data[i * width + j];
-          iter++;
-        }
-    }
-
-  int new_w = std::max (width / 8, 1);
-  int new_h = std::max (height / 8, 1);
-
-  out->data[0] = (float)dc_values[0];
-
-  double prev = 0.;
-  iter = 0;
-  for (int j = 0; j < new_w; j++)
-    {
-      for (int i = 0; i < new_h; i++)
-        {
-          out->data[iter] = (float)(dc_values[i * new_w + j] - prev);
-          prev = dc_values[i * new_w + j];
-          iter++;
-        }
-    }
-  delete[] dc_values_transposed;
-  delete[] dc_values;
-}
-
-void
-cpyBlock (float *in, float *out, int blocksize, int stride)
-{
-  for (int j = 0; j < blocksize; j++)
-    {
-      for (int i = 0; i < blocksize; i++)
-        {
-          out[i * blocksize + j] = in[i * stride + j];
-        }
-    }
-}
-
-void
-zigZagOrder (Channel *in, Channel *ordered)
-{
-  int width = in->width;
-  int height = in->height;
-  int zigZagIndex[64]
-      = { 0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
-          12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
-          35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
-          58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
-
-  int blockNumber = 0;
-  float _block[MPEG_CONSTANT];
-
-  for (int x = 0; x < height; x += 8)
-    {
-      for (int y = 0; y < width; y += 8)
-        {
-          cpyBlock (&(in->data[x * width + y]), _block, 8,
-                    width); // block = in(x:x+7,y:y+7);
-          // Put the coefficients in zig-zag order
-          float zigZagOrdered[MPEG_CONSTANT] = { 0 };
-          for (int index = 0; index < MPEG_CONSTANT; index++)
-            {
-              zigZagOrdered[index] = _block[zigZagIndex[index]];
-            }
-          for (int i = 0; i < MPEG_CONSTANT; i++)
-            ordered->data[blockNumber * MPEG_CONSTANT + i] = zigZagOrdered[i];
-          blockNumber++;
-        }
-    }
-}
-
-void
-encode8x8 (Channel *ordered, SMatrix *encoded)
-{
-  int width = encoded->height;
-  int height = encoded->width;
-  int num_blocks = height;
-
-  for (int i = 0; i < num_blocks; i++)
-    {
-      std::string block_encode[MPEG_CONSTANT];
-      for (int j = 0; j < MPEG_CONSTANT; j++)
-        {
-          block_encode[j] = "\0"; // necessary to initialize every string
-                                  // position to empty string
-        }
-
-      double *block = new double[width];
-      for (int y = 0; y < width; y++)
-        block[y] = ordered->data[i * width + y];
-      int num_coeff = MPEG_CONSTANT; // width
-      int encoded_index = 0;
-      int in_zero_run = 0;
-      int zero_count = 0;
-
-      // Skip DC coefficient
-      for (int c = 1; c < num_coeff; c++)
-        {
-          double coeff = block[c];
-          if (coeff == 0)
-            {
-              if (in_zero_run == 0)
-                {
-                  zero_count = 0;
-                  in_zero_run = 1;
-                }
-              zero_count = zero_count + 1;
-            }
-          else
-            {
-              if (in_zero_run == 1)
-                {
-                  in_zero_run = 0;
-                  block_encode[encoded_index]
-                      = "Z" + std::to_string (zero_count);
-                  encoded_index = encoded_index + 1;
-                }
-              block_encode[encoded_index] = std::to_string ((int)coeff);
-              encoded_index = encoded_index + 1;
-            }
-        }
-
-      // If we were in a zero run at the end attach it as well.
-      if (in_zero_run == 1)
-        {
-          if (zero_count > 1)
-            {
-              block_encode[encoded_index] = "Z" + std::to_string (zero_count);
-            }
-          else
-            {
-              block_encode[encoded_index] = "0";
-            }
-        }
-
-      for (int it = 0; it < MPEG_CONSTANT; it++)
-        {
-          if (block_encode[it].length () > 0)
-            encoded->data[i * width + it] = new std::string (block_encode[it]);
-          else
-            it = MPEG_CONSTANT;
-        }
-      delete[] block;
-    }
+  return new Frame (new Channel (f->Y->width, f->Y->height),
+                    new Channel (f->Cb->width, f->Cb->height),
+                    new Channel (f->Cr->width, f->Cr->height));
 }
 
 int
 encode ()
 {
-  int end_frame = int (N_FRAMES);
+  int end_frame = args.synth_spec ? synth.frames : int (N_FRAMES);
   int i_frame_frequency = int (I_FRAME_FREQ);
+  // Border of the motion and delta frames, see padFrame
+  int pad = args.pad ? WINDOW_SIZE : 0;
   struct timeval starttime, endtime;
   double runtime[10] = { 0 };
+  PerfCounts perf_begin, perf[10];
+  StageWork work[10];
+  DCOnlyCount dc_only = { 0, 0 };
 
   // Hardcoded paths
   string image_path
       = "../../inputs/" + string (image_name) + "/" + image_name + ".";
   string stream_path
-      = "../../outputs/stream_c_" + string (image_name) + ".xml";
+      = "../../outputs/stream_c_"
+        + string (args.synth_spec ? "synth" : image_name) + ".xml";
 
   xmlDocPtr stream = NULL;
 
@@ -591,7 +174,7 @@ encode ()
   Image *previous_frame_rgb = NULL;
   Frame *previous_frame_lowpassed = NULL;
 
-  loadImage (0, image_path, &frame_rgb);
+  loadFrame (0, image_path, &frame_rgb);
 
   int width = frame_rgb->width;
   int height = frame_rgb->height;
@@ -599,19 +182,42 @@ encode ()
 
   printf ("Image width=%d height=%d\n", width, height);
 
-  if (args.optimization_mode & OpenCL)
+  if (backendsUse (&backends, OpenCL))
     {
-      initCL (width, height, stderr);
+      // Large enough for the padded motion and delta frames
+      initCL (width + 2 * pad, height + 2 * pad, args.cl_device,
+              args.cl_cache, stderr);
     }
 
+  if (args.autotune)
+    {
+      Image *second_frame_rgb = NULL;
+      loadFrame (end_frame > 1 ? 1 : 0, image_path, &second_frame_rgb);
+      autotuneBackends (&backends, args.optimization_mode, frame_rgb,
+                        second_frame_rgb, args.autotune_cache, stdout);
+      applyBackendSpec (&backends, args.backend_spec);
+      delete second_frame_rgb;
+    }
+
+  printBackends (&backends, stdout);
+  if (verifyBackends (&backends, stdout))
+    error (EXIT_FAILURE, 0, "backends disagree with the reference");
+
   createStatsFile ();
-  stream = create_xml_stream (width, height, QUALITY, WINDOW_SIZE, BLOCK_SIZE);
+  stream = create_xml_stream (width, height, QUALITY, WINDOW_SIZE, BLOCK_SIZE,
+                              pad);
   vector<mVector> *motion_vectors = NULL;
+  SkipMap skip_map;
+  CodedBlocks coded;
+  if (args.skip)
+    coded.skipped_dc = skippedDC (backends.dct, backends.quant);
 
   for (int frame_number = 0; frame_number < end_frame; frame_number++)
     {
+      TraceSpan frame_span ("frame", frame_number);
+
       START_TIMER (load_image_timer);
-      loadImage (frame_number, image_path, &frame_rgb);
+      loadFrame (frame_number, image_path, &frame_rgb);
       END_TIMER (load_image_timer);
       printf ("loadImage %d takes %g seconds\n", frame_number,
               load_image_timer);
@@ -621,35 +227,29 @@ encode ()
 
       Image *frame_ycbcr = new Image (width, height, FULLSIZE);
 
-      gettimeofday (&starttime, NULL);
-      convertRGBtoYCbCr (frame_rgb, frame_ycbcr);
-      gettimeofday (&endtime, NULL);
-      runtime[0] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      stageThreads (&backends, StageConvert);
+      BEGIN_STAGE (0);
+      backends.convert (frame_rgb, frame_ycbcr);
+      END_STAGE (0);
 
       dump_image (frame_ycbcr, "frame_ycbcr", frame_number);
 
       // We low pass filter Cb and Cr channesl
       print ("Low pass filter...");
 
-      gettimeofday (&starttime, NULL);
+      stageThreads (&backends, StageLowPass);
+      BEGIN_STAGE (1);
       Channel *frame_blur_cb = new Channel (width, height);
       Channel *frame_blur_cr = new Channel (width, height);
       Frame *frame_lowpassed = new Frame (width, height, FULLSIZE);
 
-      lowPass (frame_ycbcr->gc, frame_blur_cb);
-      lowPass (frame_ycbcr->bc, frame_blur_cr);
+      backends.lowpass (frame_ycbcr->gc, frame_blur_cb);
+      backends.lowpass (frame_ycbcr->bc, frame_blur_cr);
 
       frame_lowpassed->Y->copy (frame_ycbcr->rc);
       frame_lowpassed->Cb->copy (frame_blur_cb);
       frame_lowpassed->Cr->copy (frame_blur_cr);
-      gettimeofday (&endtime, NULL);
-      runtime[1] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      END_STAGE (1);
 
       dump_frame (frame_lowpassed, "frame_ycbcr_lowpass", frame_number);
       delete frame_ycbcr;
@@ -657,6 +257,8 @@ encode ()
       delete frame_blur_cr;
 
       Frame *frame_lowpassed_final = NULL;
+      // Only P frames skip macroblocks
+      bool skipping = false;
 
       if (frame_number % i_frame_frequency != 0)
         {
@@ -666,34 +268,46 @@ encode ()
           // Compute the motion vectors
           print ("Motion Vector Search...");
 
-          gettimeofday (&starttime, NULL);
-          if (args.optimization_mode & OpenCL)
+          stageThreads (&backends, StageMotion);
+          BEGIN_STAGE (2);
+          // The reference was padded when it was kept; the frame is padded
+          // to the same layout
+          Frame *frame_match = frame_lowpassed;
+          if (pad)
+            frame_match = padFrame (frame_lowpassed, pad);
+          motion_vectors
+              = backends.motion (previous_frame_lowpassed, frame_match,
+                                 frame_match->width, frame_match->height);
+          END_STAGE (2);
+
+          // Later P frames are searched against the previous delta, not
+          // the previous picture, so only the first one has known motion
+          if (args.synth_spec && (frame_number - 1) % i_frame_frequency == 0)
+            checkSynthMotion (&synth, frame_number, motion_vectors, pad,
+                              stdout);
+
+          print ("Compute Delta...");
+          stageThreads (&backends, StageDelta);
+          BEGIN_STAGE (3);
+          frame_lowpassed_final = backends.delta (
+              previous_frame_lowpassed, frame_match, motion_vectors);
+          if (pad)
             {
-              motion_vectors = motionVectorSearchCL (
-                  previous_frame_lowpassed, frame_lowpassed,
-                  frame_lowpassed->width, frame_lowpassed->height);
+              Frame *padded = frame_lowpassed_final;
+              frame_lowpassed_final = cropFrame (padded, pad);
+              releaseDeltaFrame (padded);
+              delete frame_match;
             }
-          else
+          END_STAGE (3);
+
+          skipping = args.skip;
+          if (skipping)
             {
-              motion_vectors = motionVectorSearch (
-                  previous_frame_lowpassed, frame_lowpassed,
-                  frame_lowpassed->width, frame_lowpassed->height);
+              decideSkip (&skip_params, frame_lowpassed_final, motion_vectors,
+                          pad, &skip_map);
+              printf ("Skipped %d of %d macroblocks\n", skip_map.n_skipped,
+                      (int)skip_map.skipped.size ());
             }
-          gettimeofday (&endtime, NULL);
-          runtime[2] = double (endtime.tv_sec) * 1000.0f
-                       + double (endtime.tv_usec) / 1000.0f
-                       - double (starttime.tv_sec) * 1000.0f
-                       - double (starttime.tv_usec) / 1000.0f; // in ms
-
-          print ("Compute Delta...");
-          gettimeofday (&starttime, NULL);
-          frame_lowpassed_final = computeDelta (
-              previous_frame_lowpassed, frame_lowpassed, motion_vectors);
-          gettimeofday (&endtime, NULL);
-          runtime[3] = double (endtime.tv_sec) * 1000.0f
-                       + double (endtime.tv_usec) / 1000.0f
-                       - double (starttime.tv_sec) * 1000.0f
-                       - double (starttime.tv_usec) / 1000.0f; // in ms
         }
       else
         {
@@ -706,100 +320,123 @@ encode ()
 
       if (frame_number > 0)
         delete previous_frame_lowpassed;
-      previous_frame_lowpassed = new Frame (frame_lowpassed_final);
+      // Skipping zeroes part of the residual, which the device copy keeps
+      bool on_device = motion_vectors && backends.delta == computeDeltaCL
+                       && !skipping;
+      previous_frame_lowpassed
+          = keepReference (frame_lowpassed_final, pad, on_device);
 
       // Downsample the difference
       print ("Downsample...");
 
-      gettimeofday (&starttime, NULL);
+      stageThreads (&backends, StageDownSample);
+      BEGIN_STAGE (4);
       Frame *frame_downsampled = new Frame (width, height, DOWNSAMPLE);
 
       // We don't touch the Y frame
       frame_downsampled->Y->copy (frame_lowpassed_final->Y);
-      Channel *frame_downsampled_cb = downSample (frame_lowpassed_final->Cb);
+      Channel *frame_downsampled_cb = backends.downsample (frame_lowpassed_final->Cb);
       frame_downsampled->Cb->copy (frame_downsampled_cb);
-      Channel *frame_downsampled_cr = downSample (frame_lowpassed_final->Cr);
+      Channel *frame_downsampled_cr = backends.downsample (frame_lowpassed_final->Cr);
       frame_downsampled->Cr->copy (frame_downsampled_cr);
-      gettimeofday (&endtime, NULL);
-      runtime[4] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      END_STAGE (4);
 
       dump_frame (frame_downsampled, "frame_downsampled", frame_number);
-      delete frame_lowpassed_final;
+      // A padded residual went back to the pool when it was cropped
+      if (pad)
+        delete frame_lowpassed_final;
+      else
+        releaseDeltaFrame (frame_lowpassed_final);
       delete frame_downsampled_cb;
       delete frame_downsampled_cr;
 
       // Convert to frequency domain
       print ("Convert to frequency domain...");
 
-      gettimeofday (&starttime, NULL);
-      Frame *frame_dct = new Frame (width, height, DOWNSAMPLE);
-
-      dct8x8 (frame_downsampled->Y, frame_dct->Y);
-      dct8x8 (frame_downsampled->Cb, frame_dct->Cb);
-      dct8x8 (frame_downsampled->Cr, frame_dct->Cr);
-      gettimeofday (&endtime, NULL);
-      runtime[5] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      stageThreads (&backends, StageDCT);
+      BEGIN_STAGE (5);
+      // The blocks of skipped macroblocks leave the transform path here:
+      // up to the entropy coding only the coded blocks are worked on,
+      // packed into channels 8 wide
+      Frame *frame_coded = frame_downsampled;
+      if (skipping)
+        frame_coded = packCodedBlocks (frame_downsampled, &skip_map, &coded);
+      Frame *frame_dct = newFrameLike (frame_coded);
+
+      dct_flat_blocks = 0;
+      backends.dct (frame_coded->Y, frame_dct->Y);
+      backends.dct (frame_coded->Cb, frame_dct->Cb);
+      backends.dct (frame_coded->Cr, frame_dct->Cr);
+      END_STAGE (5);
+
+      dc_only.dc_only = dct_flat_blocks;
+      dc_only.blocks = (frame_dct->Y->width * frame_dct->Y->height
+                        + frame_dct->Cb->width * frame_dct->Cb->height
+                        + frame_dct->Cr->width * frame_dct->Cr->height)
+                       / 64;
 
       dump_frame (frame_dct, "frame_dct", frame_number);
+      if (frame_coded != frame_downsampled)
+        delete frame_coded;
       delete frame_downsampled;
 
       // Quantize the data
       print ("Quantize...");
 
-      gettimeofday (&starttime, NULL);
-      Frame *frame_quant = new Frame (width, height, DOWNSAMPLE);
+      stageThreads (&backends, StageQuant);
+      BEGIN_STAGE (6);
+      Frame *frame_quant = newFrameLike (frame_dct);
 
-      quant8x8 (frame_dct->Y, frame_quant->Y);
-      quant8x8 (frame_dct->Cb, frame_quant->Cb);
-      quant8x8 (frame_dct->Cr, frame_quant->Cr);
-      gettimeofday (&endtime, NULL);
-      runtime[6] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      backends.quant (frame_dct->Y, frame_quant->Y);
+      backends.quant (frame_dct->Cb, frame_quant->Cb);
+      backends.quant (frame_dct->Cr, frame_quant->Cr);
 
-      dump_frame (frame_quant, "frame_quant", frame_number);
+      // The DC differences run over every block, skipped or not
+      Frame *frame_quant_full = frame_quant;
+      if (skipping)
+        {
+          frame_quant_full = new Frame (width, height, DOWNSAMPLE);
+          unpackCodedBlocks (frame_quant, &coded, frame_quant_full);
+        }
+      END_STAGE (6);
+
+      dump_frame (frame_quant_full, "frame_quant", frame_number);
       delete frame_dct;
 
       // Extract the DC components and compute the differences
       print ("Compute DC differences...");
 
-      gettimeofday (&starttime, NULL);
+      BEGIN_STAGE (7);
       Frame *frame_dc_diff = new Frame (1, (width / 8) * (height / 8),
                                         DCDIFF); // dealocate later
 
-      dcDiff (frame_quant->Y, frame_dc_diff->Y);
-      dcDiff (frame_quant->Cb, frame_dc_diff->Cb);
-      dcDiff (frame_quant->Cr, frame_dc_diff->Cr);
-      gettimeofday (&endtime, NULL);
-      runtime[7] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      dcDiff (frame_quant_full->Y, frame_dc_diff->Y);
+      dcDiff (frame_quant_full->Cb, frame_dc_diff->Cb);
+      dcDiff (frame_quant_full->Cr, frame_dc_diff->Cr);
+      END_STAGE (7);
+
+      if (frame_quant_full != frame_quant)
+        delete frame_quant_full;
 
       dump_dc_diff (frame_dc_diff, "frame_dc_diff", frame_number);
 
       // Zig-zag order for zero-counting
       print ("Zig-zag order...");
-      gettimeofday (&starttime, NULL);
-
-      Frame *frame_zigzag
-          = new Frame (MPEG_CONSTANT, width * height / MPEG_CONSTANT, ZIGZAG);
-
-      zigZagOrder (frame_quant->Y, frame_zigzag->Y);
-      zigZagOrder (frame_quant->Cb, frame_zigzag->Cb);
-      zigZagOrder (frame_quant->Cr, frame_zigzag->Cr);
-      gettimeofday (&endtime, NULL);
-      runtime[8] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      stageThreads (&backends, StageZigZag);
+      BEGIN_STAGE (8);
+
+      Frame *frame_zigzag = new Frame (
+          new Channel (MPEG_CONSTANT, frame_quant->Y->height / 8
+                                          * (frame_quant->Y->width / 8)),
+          new Channel (MPEG_CONSTANT, frame_quant->Cb->height / 8
+                                          * (frame_quant->Cb->width / 8)),
+          new Channel (MPEG_CONSTANT, frame_quant->Cr->height / 8
+                                          * (frame_quant->Cr->width / 8)));
+
+      backends.zigzag (frame_quant->Y, frame_zigzag->Y);
+      backends.zigzag (frame_quant->Cb, frame_zigzag->Cb);
+      backends.zigzag (frame_quant->Cr, frame_zigzag->Cr);
+      END_STAGE (8);
 
       dump_zigzag (frame_zigzag, "frame_zigzag", frame_number);
       delete frame_quant;
@@ -807,24 +444,28 @@ encode ()
       // Encode coefficients
       print ("Encode coefficients...");
 
-      gettimeofday (&starttime, NULL);
-      FrameEncode *frame_encode
-          = new FrameEncode (width, height, MPEG_CONSTANT);
+      stageThreads (&backends, StageEncode);
+      BEGIN_STAGE (9);
+      FrameEncode *frame_encode = new FrameEncode (
+          new SMatrix (frame_zigzag->Y->height, MPEG_CONSTANT),
+          new SMatrix (frame_zigzag->Cb->height, MPEG_CONSTANT),
+          new SMatrix (frame_zigzag->Cr->height, MPEG_CONSTANT));
 
-      encode8x8 (frame_zigzag->Y, frame_encode->Y);
-      encode8x8 (frame_zigzag->Cb, frame_encode->Cb);
-      encode8x8 (frame_zigzag->Cr, frame_encode->Cr);
-      gettimeofday (&endtime, NULL);
-      runtime[9] = double (endtime.tv_sec) * 1000.0f
-                   + double (endtime.tv_usec) / 1000.0f
-                   - double (starttime.tv_sec) * 1000.0f
-                   - double (starttime.tv_usec) / 1000.0f; // in ms
+      backends.encode (frame_zigzag->Y, frame_encode->Y);
+      backends.encode (frame_zigzag->Cb, frame_encode->Cb);
+      backends.encode (frame_zigzag->Cr, frame_encode->Cr);
+      END_STAGE (9);
 
       delete frame_zigzag;
 
+      TRACE_BEGIN ("stream_frame", frame_number);
       stream_frame (stream, frame_number, motion_vectors, frame_number - 1,
-                    frame_dc_diff, frame_encode);
+                    frame_dc_diff, frame_encode, skipping ? &skip_map : NULL,
+                    skipping ? &coded : NULL);
+      TRACE_END ();
+      TRACE_BEGIN ("write_stream", frame_number);
       write_stream (stream_path, stream);
+      TRACE_END ();
 
       delete frame_dc_diff;
       delete frame_encode;
@@ -835,7 +476,11 @@ encode ()
           motion_vectors = NULL;
         }
 
-      writestats (frame_number, frame_number % i_frame_frequency, runtime);
+      frameWork (width, height, frame_number % i_frame_frequency, pad, work);
+      writestats (frame_number, frame_number % i_frame_frequency, runtime,
+                  args.perf ? perf : NULL,
+                  args.roofline_path ? work : NULL,
+                  backends.dct == dct8x8Flat ? &dc_only : NULL);
     }
 
   closeStats ();
@@ -845,11 +490,259 @@ encode ()
   return 0;
 }
 
+// A frame of encodeOnDevice on its way through the device
+struct DeviceFrame
+{
+  Image *rgb;
+  Frame *zigzag;
+  vector<mVector> *motion_vectors;
+};
+
+static void
+submitOnDevice (int frame_number, const string &image_path,
+                DeviceFrame *frame)
+{
+  loadFrame (frame_number, image_path, &frame->rgb);
+  int width = frame->rgb->width;
+  int height = frame->rgb->height;
+  int n_blocks = width * height / 64;
+  frame->zigzag = new Frame (new Channel (MPEG_CONSTANT, n_blocks),
+                             new Channel (MPEG_CONSTANT, n_blocks / 4),
+                             new Channel (MPEG_CONSTANT, n_blocks / 4));
+  frame->motion_vectors = NULL;
+  bool is_p = frame_number % int (I_FRAME_FREQ) != 0;
+  if (is_p)
+    frame->motion_vectors
+        = new vector<mVector> ((width / 16 - 2) * (height / 16 - 2));
+  submitTransformCL (frame->rgb, is_p, frame->zigzag, frame->motion_vectors);
+}
+
+// encode () with stages 0 to 8 of every frame on the OpenCL device: the
+// host loads the frames, takes the DC differences and runs the entropy
+// coding.  The next frame is submitted before the host works on the
+// current one, so that the device and the host overlap.
+static int
+encodeOnDevice ()
+{
+  int end_frame = args.synth_spec ? synth.frames : int (N_FRAMES);
+  int i_frame_frequency = int (I_FRAME_FREQ);
+  string image_path
+      = "../../inputs/" + string (image_name) + "/" + image_name + ".";
+  string stream_path
+      = "../../outputs/stream_c_"
+        + string (args.synth_spec ? "synth" : image_name) + ".xml";
+
+  struct timeval starttime, endtime;
+  double runtime[10] = { 0 };
+  PerfCounts perf_begin, perf[10];
+  StageWork work[10];
+
+  DeviceFrame frames[2] = {};
+  loadFrame (0, image_path, &frames[0].rgb);
+  int width = frames[0].rgb->width;
+  int height = frames[0].rgb->height;
+  if (width % 16 || height % 16)
+    error (EXIT_FAILURE, 0, "--cl-pipeline needs frames of whole "
+                            "macroblocks, not %dx%d", width, height);
+
+  printf ("Image width=%d height=%d\n", width, height);
+  initCL (width, height, args.cl_device, args.cl_cache, stderr);
+  printBackends (&backends, stdout);
+  printf ("Stages 0 to 8 on the OpenCL device\n");
+
+  createStatsFile ();
+  xmlDocPtr stream = create_xml_stream (width, height, QUALITY, WINDOW_SIZE,
+                                        BLOCK_SIZE, 0);
+
+  if (end_frame > 0)
+    submitOnDevice (0, image_path, &frames[0]);
+  for (int frame_number = 0; frame_number < end_frame; frame_number++)
+    {
+      TraceSpan frame_span ("frame", frame_number);
+
+      // The slot of the next frame is free: the previous frame is done
+      if (frame_number + 1 < end_frame)
+        submitOnDevice (frame_number + 1, image_path,
+                        &frames[(frame_number + 1) % 2]);
+
+      DeviceFrame *frame = &frames[frame_number % 2];
+      finishTransformCL (runtime);
+      Frame *frame_zigzag = frame->zigzag;
+      vector<mVector> *motion_vectors = frame->motion_vectors;
+      bool is_p = frame_number % i_frame_frequency != 0;
+
+      if (args.synth_spec && is_p
+          && (frame_number - 1) % i_frame_frequency == 0)
+        checkSynthMotion (&synth, frame_number, motion_vectors, 0, stdout);
+
+      BEGIN_STAGE (7);
+      Frame *frame_dc_diff
+          = new Frame (1, (width / 8) * (height / 8), DCDIFF);
+      dcDiffOrdered (frame_zigzag->Y, width, height, frame_dc_diff->Y);
+      dcDiffOrdered (frame_zigzag->Cb, width / 2, height / 2,
+                     frame_dc_diff->Cb);
+      dcDiffOrdered (frame_zigzag->Cr, width / 2, height / 2,
+                     frame_dc_diff->Cr);
+      END_STAGE (7);
+
+      stageThreads (&backends, StageEncode);
+      BEGIN_STAGE (9);
+      FrameEncode *frame_encode = new FrameEncode (
+          new SMatrix (frame_zigzag->Y->height, MPEG_CONSTANT),
+          new SMatrix (frame_zigzag->Cb->height, MPEG_CONSTANT),
+          new SMatrix (frame_zigzag->Cr->height, MPEG_CONSTANT));
+
+      backends.encode (frame_zigzag->Y, frame_encode->Y);
+      backends.encode (frame_zigzag->Cb, frame_encode->Cb);
+      backends.encode (frame_zigzag->Cr, frame_encode->Cr);
+      END_STAGE (9);
+      delete frame_zigzag;
+
+      TRACE_BEGIN ("stream_frame", frame_number);
+      stream_frame (stream, frame_number, motion_vectors, frame_number - 1,
+                    frame_dc_diff, frame_encode, NULL, NULL);
+      TRACE_END ();
+      TRACE_BEGIN ("write_stream", frame_number);
+      write_stream (stream_path, stream);
+      TRACE_END ();
+
+      delete frame_dc_diff;
+      delete frame_encode;
+      delete motion_vectors;
+
+      frameWork (width, height, is_p, 0, work);
+      writestats (frame_number, frame_number % i_frame_frequency, runtime,
+                  args.perf ? perf : NULL,
+                  args.roofline_path ? work : NULL, NULL);
+    }
+
+  closeStats ();
+  delete frames[0].rgb;
+  delete frames[1].rgb;
+  return 0;
+}
+
+// Compare every intermediate of the selected backends with the reference
+// on the input frames instead of encoding them.  Returns the number of
+// stage and frame pairs that differ.
+int
+check ()
+{
+  int end_frame = args.synth_spec ? synth.frames : int (N_FRAMES);
+  int i_frame_frequency = int (I_FRAME_FREQ);
+  string image_path
+      = "../../inputs/" + string (image_name) + "/" + image_name + ".";
+
+  Image *frame_rgb = NULL;
+  loadFrame (0, image_path, &frame_rgb);
+  if (backendsUse (&backends, OpenCL))
+    {
+      int pad = args.pad ? WINDOW_SIZE : 0;
+      initCL (frame_rgb->width + 2 * pad, frame_rgb->height + 2 * pad,
+              args.cl_device, args.cl_cache, stderr);
+    }
+  printBackends (&backends, stdout);
+
+  CheckState state;
+  initCheck (&state, &backends, args.tolerance_spec);
+  int failures = 0;
+  for (int frame_number = 0; frame_number < end_frame; frame_number++)
+    {
+      loadFrame (frame_number, image_path, &frame_rgb);
+      failures += checkFrame (&state, &backends, frame_rgb, frame_number,
+                              frame_number % i_frame_frequency != 0, stdout);
+    }
+  freeCheck (&state);
+  delete frame_rgb;
+
+  printf ("%s: %d differences\n", failures ? "FAILED" : "Passed", failures);
+  return failures;
+}
+
+// check () for --cl-pipeline: the motion vectors and coefficients the
+// device gives for each frame are compared with the host stages'.  Returns
+// the number of stage and frame pairs that differ.
+static int
+checkOnDevice ()
+{
+  int end_frame = args.synth_spec ? synth.frames : int (N_FRAMES);
+  int i_frame_frequency = int (I_FRAME_FREQ);
+  string image_path
+      = "../../inputs/" + string (image_name) + "/" + image_name + ".";
+
+  DeviceFrame frames[2] = {};
+  loadFrame (0, image_path, &frames[0].rgb);
+  int width = frames[0].rgb->width;
+  int height = frames[0].rgb->height;
+  if (width % 16 || height % 16)
+    error (EXIT_FAILURE, 0, "--cl-pipeline needs frames of whole "
+                            "macroblocks, not %dx%d", width, height);
+  initCL (width, height, args.cl_device, args.cl_cache, stderr);
+  printf ("Stages 0 to 8 on the OpenCL device\n");
+
+  // The device searches and subtracts as motion=cl and delta=cl do
+  Backends device = backends;
+  applyBackendSpec (&device, "motion=cl,delta=cl");
+  CheckState state;
+  initCheck (&state, &device, args.tolerance_spec);
+  state.tolerance[StageZigZag]
+      = max (state.tolerance[StageZigZag], transformToleranceCL ());
+
+  int failures = 0;
+  if (end_frame > 0)
+    submitOnDevice (0, image_path, &frames[0]);
+  for (int frame_number = 0; frame_number < end_frame; frame_number++)
+    {
+      if (frame_number + 1 < end_frame)
+        submitOnDevice (frame_number + 1, image_path,
+                        &frames[(frame_number + 1) % 2]);
+
+      DeviceFrame *frame = &frames[frame_number % 2];
+      double stage_ms[10] = { 0 };
+      finishTransformCL (stage_ms);
+      failures += checkDeviceFrame (&state, frame->rgb, frame_number,
+                                    frame->motion_vectors, frame->zigzag,
+                                    stdout);
+      delete frame->zigzag;
+      delete frame->motion_vectors;
+    }
+  freeCheck (&state);
+  delete frames[0].rgb;
+  delete frames[1].rgb;
+
+  printf ("%s: %d differences\n", failures ? "FAILED" : "Passed", failures);
+  return failures;
+}
+
 int
 main (int argc, char *argv[])
 {
   args = parseArgs (argc, argv);
-
-  encode ();
+  if (args.list_backends)
+    {
+      listBackends (stdout);
+      return 0;
+    }
+  if (args.synth_spec)
+    initSynth (&synth, args.synth_spec);
+  if (args.skip)
+    initSkip (&skip_params, args.skip_spec);
+  if (args.trace_path)
+    initTrace (args.trace_path);
+  if (args.perf)
+    initPerfCounters (stdout);
+  if (args.roofline_path)
+    loadRoofline (args.roofline_path, stdout);
+  initSIMD (args.simd_isa, stdout);
+  selectBackends (&backends, args.optimization_mode, args.backend_spec);
+
+  if (args.check)
+    return (args.cl_pipeline ? checkOnDevice () : check ()) ? EXIT_FAILURE
+                                                           : 0;
+
+  if (args.cl_pipeline)
+    encodeOnDevice ();
+  else
+    encode ();
   return 0;
 }
@@ -1,7 +1,9 @@
 #define CL_TARGET_OPENCL_VERSION 300
 
 #include "opt_opencl.h"
+#include "kernel_cl.h"
 #include "timer.h"
+#include "trace.h"
 #include <CL/cl.h>
 #include <errno.h>
 #include <stdarg.h>
@@ -9,7 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 extern int errno;
 static cl_int cl_err;
@@ -81,6 +85,10 @@ const char *
 GetCLErrorStr (cl_int err)
 {
   int ind = err >= -19 ? -err : -err - 10;
+  // Loader and extension codes, such as -1001 for no platform, are beyond
+  // the table
+  if (ind < 0 || ind >= (int)(sizeof (cl_err_str) / sizeof (cl_err_str[0])))
+    return "CL error";
   return cl_err_str[ind];
 }
 
@@ -137,22 +145,147 @@ CL_Error (const char *restrict format, ...)
   exit (EXIT_FAILURE);
 }
 
-cl_context
-CreateContext (cl_device_id *device_id)
+#define MAX_CL_PLATFORMS 8
+#define MAX_CL_DEVICES 32
+
+static const char *
+DeviceTypeName (cl_device_type type)
 {
-  // Get platform and device information
-  cl_platform_id platform_id;
-  cl_err = clGetPlatformIDs (1, &platform_id, 0);
-  if (cl_err)
-    CL_Error ("Error getting platform ID");
+  if (type & CL_DEVICE_TYPE_GPU)
+    return "gpu";
+  if (type & CL_DEVICE_TYPE_CPU)
+    return "cpu";
+  if (type & CL_DEVICE_TYPE_ACCELERATOR)
+    return "accelerator";
+  return "other";
+}
 
-  cl_err = clGetDeviceIDs (platform_id, CL_DEVICE_TYPE_GPU, 1, device_id, 0);
-  if (cl_err)
-    CL_Error ("Error getting device ID");
+// Every device of every platform, in the order --cl-device numbers them
+static int
+ListDevices (cl_device_id *devices)
+{
+  cl_platform_id platforms[MAX_CL_PLATFORMS];
+  cl_uint n_platforms = 0;
+  cl_err = clGetPlatformIDs (MAX_CL_PLATFORMS, platforms, &n_platforms);
+  if (cl_err || !n_platforms)
+    CL_Error ("Error getting platform IDs: no OpenCL platform");
+
+  int n = 0;
+  for (cl_uint p = 0; p < n_platforms && n < MAX_CL_DEVICES; ++p)
+    {
+      cl_uint n_devices = 0;
+      if (clGetDeviceIDs (platforms[p], CL_DEVICE_TYPE_ALL,
+                          MAX_CL_DEVICES - n, devices + n, &n_devices))
+        continue;
+      n += n_devices;
+    }
+  if (!n)
+    Error ("No OpenCL device");
+  return n;
+}
+
+static cl_device_type
+DeviceType (cl_device_id device)
+{
+  cl_device_type type = 0;
+  clGetDeviceInfo (device, CL_DEVICE_TYPE, sizeof (type), &type, 0);
+  return type;
+}
+
+// Whether the name of device or of its platform contains name
+static int
+DeviceNameMatches (cl_device_id device, const char *name)
+{
+  char device_name[0x100] = "", platform_name[0x100] = "";
+  cl_platform_id platform;
+  clGetDeviceInfo (device, CL_DEVICE_NAME, sizeof (device_name), device_name,
+                   0);
+  if (!clGetDeviceInfo (device, CL_DEVICE_PLATFORM, sizeof (platform),
+                        &platform, 0))
+    clGetPlatformInfo (platform, CL_PLATFORM_NAME, sizeof (platform_name),
+                       platform_name, 0);
+  return strstr (device_name, name) || strstr (platform_name, name);
+}
+
+// The device spec names: a number from ListDevices, a type (gpu, cpu or
+// accelerator) or part of the device or platform name.  Without a spec
+// the first GPU, or failing that the first CPU device.
+static int
+SelectDevice (cl_device_id *devices, int n, const char *spec)
+{
+  if (!spec || !*spec)
+    {
+      for (int i = 0; i < n; ++i)
+        if (DeviceType (devices[i]) & CL_DEVICE_TYPE_GPU)
+          return i;
+      for (int i = 0; i < n; ++i)
+        if (DeviceType (devices[i]) & CL_DEVICE_TYPE_CPU)
+          return i;
+      return 0;
+    }
+
+  char *end;
+  long index = strtol (spec, &end, 10);
+  if (!*end)
+    {
+      if (index < 0 || index >= n)
+        Error ("No OpenCL device %ld; there are %d", index, n);
+      return index;
+    }
+  for (int i = 0; i < n; ++i)
+    if (!strcmp (spec, DeviceTypeName (DeviceType (devices[i]))))
+      return i;
+  for (int i = 0; i < n; ++i)
+    if (DeviceNameMatches (devices[i], spec))
+      return i;
+  Error ("No OpenCL device matches %s", spec);
+  return -1;
+}
+
+static void
+PrintDevice (FILE *file, int index, cl_device_id device, int selected)
+{
+  char name[0x100] = "", version[0x100] = "";
+  cl_uint compute_units = 0;
+  cl_ulong local_mem = 0, global_mem = 0;
+  size_t max_work_group = 0;
+  clGetDeviceInfo (device, CL_DEVICE_NAME, sizeof (name), name, 0);
+  clGetDeviceInfo (device, CL_DEVICE_VERSION, sizeof (version), version, 0);
+  clGetDeviceInfo (device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                   sizeof (compute_units), &compute_units, 0);
+  clGetDeviceInfo (device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof (local_mem),
+                   &local_mem, 0);
+  clGetDeviceInfo (device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof (global_mem),
+                   &global_mem, 0);
+  clGetDeviceInfo (device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                   sizeof (max_work_group), &max_work_group, 0);
+  fprintf (file,
+           "%c CL device %d: %s (%s, %s): %u compute units, %lu KiB local "
+           "memory, %lu MiB global memory, work-groups up to %zu\n",
+           selected ? '*' : ' ', index, name,
+           DeviceTypeName (DeviceType (device)), version, compute_units,
+           (unsigned long)(local_mem >> 10),
+           (unsigned long)(global_mem >> 20), max_work_group);
+}
+
+cl_context
+CreateContext (cl_device_id *device_id, const char *device_spec,
+               FILE *file)
+{
+  cl_device_id devices[MAX_CL_DEVICES];
+  int n = ListDevices (devices);
+  int selected = SelectDevice (devices, n, device_spec);
+  for (int i = 0; i < n; ++i)
+    PrintDevice (file, i, devices[i], i == selected);
+  *device_id = devices[selected];
 
   char device_name[0x100];
   clGetDeviceInfo (*device_id, CL_DEVICE_NAME, 0x100, device_name, 0);
-  printf ("Using GPU: %s\n", device_name);
+  cl_device_type type = DeviceType (*device_id);
+  if (!device_spec && !(type & CL_DEVICE_TYPE_GPU))
+    fprintf (file, "No OpenCL GPU, falling back to %s device\n",
+             DeviceTypeName (type));
+  fprintf (file, "Using %s: %s\n", DeviceTypeName (type), device_name);
 
   // Create an OpenCL context
   cl_context context = clCreateContext (0, 1, device_id, 0, 0, &cl_err);
@@ -162,27 +295,182 @@ CreateContext (cl_device_id *device_id)
   return context;
 }
 
-cl_program
-CreateProgram (const char *file_name, cl_context context)
+/* Compiled programs are cached on disk, one file per program, named by a
+ * hash of the device, its driver and the kernel source, so that only the
+ * first launch on a device or after a change to kernel.cl builds them. */
+
+// 64-bit FNV-1a of size bytes of data, continuing from hash
+static uint64_t
+HashBytes (uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+static uint64_t
+HashDeviceInfo (uint64_t hash, cl_device_id device, cl_device_info info)
 {
-  const size_t MAX_SOURCE_SIZE = 0x100000;
-  FILE *fp = fopen (file_name, "r");
+  char value[0x400] = "";
+  clGetDeviceInfo (device, info, sizeof (value) - 1, value, 0);
+  return HashBytes (hash, value, strlen (value) + 1);
+}
+
+// Create path and any missing parents; failures show up when the cache
+// file is written
+static void
+MakeDirs (const char *path)
+{
+  char dir[0x1000];
+  snprintf (dir, sizeof (dir), "%s", path);
+  for (char *p = dir + 1; *p; ++p)
+    if (*p == '/')
+      {
+        *p = 0;
+        mkdir (dir, 0755);
+        *p = '/';
+      }
+  mkdir (dir, 0755);
+}
+
+// The file caching the program built from source for device in cache_dir,
+// or by default in $XDG_CACHE_HOME/ppe or ~/.cache/ppe; 0 with an empty
+// cache_dir or without a home
+static char *
+ProgramCachePath (const char *cache_dir, cl_device_id device,
+                  const char *source)
+{
+  char dir[0x1000];
+  const char *base;
+  if (cache_dir)
+    snprintf (dir, sizeof (dir), "%s", cache_dir);
+  else if ((base = getenv ("XDG_CACHE_HOME")) && *base)
+    snprintf (dir, sizeof (dir), "%s/ppe", base);
+  else if ((base = getenv ("HOME")) && *base)
+    snprintf (dir, sizeof (dir), "%s/.cache/ppe", base);
+  else
+    return 0;
+  if (!*dir)
+    return 0;
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = HashDeviceInfo (hash, device, CL_DEVICE_NAME);
+  hash = HashDeviceInfo (hash, device, CL_DEVICE_VENDOR);
+  hash = HashDeviceInfo (hash, device, CL_DEVICE_VERSION);
+  hash = HashDeviceInfo (hash, device, CL_DRIVER_VERSION);
+  hash = HashBytes (hash, source, strlen (source));
+
+  MakeDirs (dir);
+  char *path = malloc (strlen (dir) + 32);
+  sprintf (path, "%s/kernel-%016llx.bin", dir, (unsigned long long)hash);
+  return path;
+}
+
+// The program in the cache file at path, built, or 0 when there is none
+// or the device no longer takes it
+static cl_program
+LoadProgramBinary (const char *path, cl_context context, cl_device_id device)
+{
+  FILE *fp = fopen (path, "rb");
   if (!fp)
-    CL_Error ("Error opening cl kernel file: %s", strerror (errno));
-  char *src = malloc (MAX_SOURCE_SIZE);
-  size_t size = fread (src, 1, MAX_SOURCE_SIZE, fp);
+    return 0;
+  fseek (fp, 0, SEEK_END);
+  long size = ftell (fp);
+  rewind (fp);
+  unsigned char *binary = malloc (size > 0 ? size : 1);
+  size_t n = fread (binary, 1, size, fp);
   fclose (fp);
 
-  cl_program prg = clCreateProgramWithSource (context, 1, (const char **)&src,
-                                              &size, &cl_err);
+  cl_program prg = 0;
+  if (size > 0 && n == (size_t)size)
+    {
+      size_t length = size;
+      cl_int status;
+      prg = clCreateProgramWithBinary (context, 1, &device, &length,
+                                       (const unsigned char **)&binary,
+                                       &status, &cl_err);
+      if (!cl_err && status == CL_SUCCESS)
+        cl_err = clBuildProgram (prg, 1, &device, 0, 0, 0);
+      else if (!cl_err)
+        cl_err = status;
+      if (cl_err && prg)
+        {
+          clReleaseProgram (prg);
+          prg = 0;
+        }
+    }
+  free (binary);
+  return prg;
+}
+
+// Write the binary of prg to path, through a temporary file so that
+// concurrent encoders never read half of one
+static void
+SaveProgramBinary (const char *path, cl_program prg, FILE *log)
+{
+  size_t size = 0;
+  if (clGetProgramInfo (prg, CL_PROGRAM_BINARY_SIZES, sizeof (size), &size,
+                        0)
+      || !size)
+    return;
+  unsigned char *binary = malloc (size);
+  if (clGetProgramInfo (prg, CL_PROGRAM_BINARIES, sizeof (binary), &binary,
+                        0))
+    {
+      free (binary);
+      return;
+    }
+
+  char *tmp = malloc (strlen (path) + 32);
+  sprintf (tmp, "%s.%ld", path, (long)getpid ());
+  FILE *fp = fopen (tmp, "wb");
+  int ok = fp && fwrite (binary, 1, size, fp) == size;
+  if (fp && fclose (fp))
+    ok = 0;
+  if (ok && !rename (tmp, path))
+    fprintf (log, "CL program cached in %s\n", path);
+  else
+    {
+      fprintf (log, "Could not cache CL program in %s\n", path);
+      remove (tmp);
+    }
+  free (tmp);
+  free (binary);
+}
+
+// The program of kernel.cl, whose source is built into the encoder, from
+// the cache in cache_dir (see ProgramCachePath) or else built for device
+cl_program
+CreateProgram (cl_context context, cl_device_id device,
+               const char *cache_dir, FILE *log)
+{
+  char *path = ProgramCachePath (cache_dir, device, kernel_source);
+  if (path)
+    {
+      cl_program prg = LoadProgramBinary (path, context, device);
+      if (prg)
+        {
+          fprintf (log, "CL program from %s\n", path);
+          free (path);
+          return prg;
+        }
+    }
+
+  const char *src = kernel_source;
+  size_t size = strlen (kernel_source);
+  cl_program prg
+      = clCreateProgramWithSource (context, 1, &src, &size, &cl_err);
   if (cl_err)
     CL_Error ("Error creating cl program");
-  free (src);
 
-  cl_err = clBuildProgram (prg, 0, 0, 0, 0, 0);
+  cl_err = clBuildProgram (prg, 1, &device, 0, 0, 0);
   if (cl_err)
     CL_Error ("Error building cl program");
 
+  if (path)
+    SaveProgramBinary (path, prg, log);
+  free (path);
   return prg;
 }
 
@@ -198,8 +486,11 @@ CreateKernel (cl_program prg, const char *kernel_name)
 cl_command_queue
 CreateCommandQueue (cl_context context, cl_device_id device)
 {
-  cl_command_queue command_queue
-      = clCreateCommandQueueWithProperties (context, device, 0, &cl_err);
+  // Profiling times the stages of submitFrameCL
+  cl_queue_properties properties[]
+      = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+  cl_command_queue command_queue = clCreateCommandQueueWithProperties (
+      context, device, properties, &cl_err);
   if (cl_err)
     CL_Error ("Error creating command queue");
   return command_queue;
@@ -245,20 +536,158 @@ static FILE *output_file;
 static cl_device_id device_id;
 static cl_context context;
 static cl_program program;
+/* Kernels run on cmd_queue and transfers on their own queues, so that the
+ * upload of a frame and the readback of another overlap the kernels.
+ * Commands wait on the events of the ones they depend on, and the host
+ * waits only on the readbacks it needs. */
 static cl_command_queue cmd_queue;
+static cl_command_queue upload_queue;
+static cl_command_queue readback_queue;
 
 /* CL objects for convert kernel */
 static cl_kernel convert_kernel;
 static cl_mem buf[3];
 
-/* CL objects for motion kernel */
+/* CL objects for motion and delta kernels.  Two sets of Y, Cb and Cr
+ * planes: one holds the source the search runs against and the other the
+ * frame being matched, which deltaCL turns into the residual in place.  The
+ * residual is the source of the next search, so the sets swap roles and
+ * only the new frame is uploaded. */
 static cl_kernel motion_kernel;
-static cl_mem sbuf[3];
-static cl_mem mbuf[3];
+static cl_kernel delta_kernel;
+static cl_mem frame_buf[2][3];
+static int source_set;
 static cl_mem motion_buf;
 
+/* On devices that share memory with the host (see SharesHostMemory)
+ * convertCL wraps the caller's planes in buffers instead of copying them,
+ * and the frame sets and motion vectors live in host memory, which the
+ * host writes and reads through maps rather than transfers */
+static int zero_copy;
+
+/* CL objects for the whole transform path of submitFrameCL: the YCbCr
+ * planes convertPlanes writes before the chroma is filtered, and the
+ * downsampled chroma */
+static cl_kernel convert_planes_kernel;
+static cl_kernel lowpass_v_kernel;
+static cl_kernel lowpass_h_kernel;
+static cl_kernel downsample_kernel;
+static cl_kernel transform_kernel;
+static cl_mem ycbcr_buf[2];
+static cl_mem chroma_buf[2];
+static cl_mem steps_buf;
+static int pipeline_ready;
+
+/* transformBlocks runs the DCT in double, exactly as dct8x8_block, when the
+ * device has cl_khr_fp64; in float a coefficient may be this many
+ * quantiser steps off the host's */
+#define TRANSFORM_FLOAT_TOLERANCE 1
+static int device_fp64;
+
+// Whether the device does double precision, which OpenCL 1.2 and later
+// report as a nonzero CL_DEVICE_DOUBLE_FP_CONFIG
+static int
+HasDouble (cl_device_id device)
+{
+  cl_device_fp_config config = 0;
+  if (clGetDeviceInfo (device, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof (config),
+                       &config, 0))
+    return 0;
+  return config != 0;
+}
+
+static cl_ulong
+EventTime (cl_event event, cl_profiling_info info)
+{
+  cl_ulong time = 0;
+  CL_CHECK (
+      clGetEventProfilingInfo (event, info, sizeof (time), &time, 0));
+  return time;
+}
+
+// Device time from the start of the first of events to the end of the
+// last, in microseconds
+static uint32_t
+EventsSpan (int n, const cl_event *events)
+{
+  cl_ulong start = EventTime (events[0], CL_PROFILING_COMMAND_START);
+  cl_ulong end = EventTime (events[n - 1], CL_PROFILING_COMMAND_END);
+  return (end - start) / 1000;
+}
+
+static void
+ReleaseEvents (int n, cl_event *events)
+{
+  for (int i = 0; i < n; ++i)
+    clReleaseEvent (events[i]);
+}
+
+// CPU devices, and GPUs on the same memory as the host
+static int
+SharesHostMemory (cl_device_id device)
+{
+  if (DeviceType (device) & CL_DEVICE_TYPE_CPU)
+    return 1;
+  cl_bool unified = CL_FALSE;
+  if (clGetDeviceInfo (device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                       sizeof (unified), &unified, 0))
+    return 0;
+  return unified;
+}
+
+// A buffer of size bytes, in host memory on zero-copy devices
+static cl_mem
+CreateSharedBuffer (size_t size)
+{
+  cl_mem_flags flags = CL_MEM_READ_WRITE;
+  if (zero_copy)
+    flags |= CL_MEM_ALLOC_HOST_PTR;
+  cl_mem mem = CL_CHECK_R (clCreateBuffer (context, flags, size, 0, &cl_err));
+  return mem;
+}
+
+// Enqueue on upload_queue the write of size bytes of data to mem, through
+// a map on zero-copy devices; the write is done when event is
+static void
+WriteShared (cl_mem mem, size_t size, const void *data, cl_event *event)
+{
+  if (!zero_copy)
+    {
+      CL_CHECK (clEnqueueWriteBuffer (upload_queue, mem, 0, 0, size, data, 0,
+                                      0, event));
+      return;
+    }
+  void *mapped = CL_CHECK_R (clEnqueueMapBuffer (
+      upload_queue, mem, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size, 0,
+      0, 0, &cl_err));
+  memcpy (mapped, data, size);
+  CL_CHECK (clEnqueueUnmapMemObject (upload_queue, mem, mapped, 0, 0, event));
+}
+
+// Enqueue on readback_queue the read of size bytes of mem into data once
+// after is complete, through a map on zero-copy devices; the read is done
+// when event is
+static void
+ReadShared (cl_mem mem, size_t size, void *data, cl_event after,
+            cl_event *event)
+{
+  if (!zero_copy)
+    {
+      CL_CHECK (clEnqueueReadBuffer (readback_queue, mem, 0, 0, size, data,
+                                     1, &after, event));
+      return;
+    }
+  void *mapped = CL_CHECK_R (clEnqueueMapBuffer (readback_queue, mem,
+                                                 CL_TRUE, CL_MAP_READ, 0,
+                                                 size, 1, &after, 0, &cl_err));
+  memcpy (data, mapped, size);
+  CL_CHECK (clEnqueueUnmapMemObject (readback_queue, mem, mapped, 0, 0,
+                                     event));
+}
+
 void
-initCL (int pwidth, int pheight, FILE *fd)
+initCL (int pwidth, int pheight, const char *device_spec,
+        const char *cache_dir, FILE *fd)
 {
   struct timeval start, stop;
   gettimeofday (&start, 0);
@@ -267,80 +696,159 @@ initCL (int pwidth, int pheight, FILE *fd)
   width = pwidth;
   height = pheight;
 
-  context = CreateContext (&device_id);
-  program = CreateProgram ("kernel.cl", context);
+  context = CreateContext (&device_id, device_spec, output_file);
+  zero_copy = SharesHostMemory (device_id);
+  fprintf (output_file, "CL zero-copy buffers: %s\n",
+           zero_copy ? "yes" : "no");
+  device_fp64 = HasDouble (device_id);
+  fprintf (output_file, "CL transform: %s precision DCT, tolerance %g\n",
+           device_fp64 ? "double" : "single", transformToleranceCL ());
+  program = CreateProgram (context, device_id, cache_dir, output_file);
   convert_kernel = CreateKernel (program, "convert");
   motion_kernel = CreateKernel (program, "motionVectorSearch");
+  delta_kernel = CreateKernel (program, "computeDelta");
+  convert_planes_kernel = CreateKernel (program, "convertPlanes");
+  lowpass_v_kernel = CreateKernel (program, "lowPassV");
+  lowpass_h_kernel = CreateKernel (program, "lowPassH");
+  downsample_kernel = CreateKernel (program, "downSample");
+  transform_kernel = CreateKernel (program, "transformBlocks");
   cmd_queue = CreateCommandQueue (context, device_id);
+  upload_queue = CreateCommandQueue (context, device_id);
+  readback_queue = CreateCommandQueue (context, device_id);
 
   // Create memory buffers on the device for each channel
-  /* for (int i = 0; i < 3; ++i) */
-  /*   { */
-  /*     size_t size = width * height * sizeof (float); */
-  /*     buf[i] = CreateBuffer (context, size); */
-  /*   } */
+  for (int i = 0; i < 3; ++i)
+    {
+      size_t size = width * height * sizeof (float);
+      buf[i] = CreateBuffer (context, size);
+    }
   initMotionKernel ();
 
-  clFinish (cmd_queue);
-
   gettimeofday (&stop, 0);
   uint32_t t = GetTimevalMicroSeconds (&start, &stop);
   fprintf (output_file, "CL init time: %u\n", t);
 }
 
-void
-convertCL (size_t size, const float *R, const float *G, const float *B,
-           float *Y, float *Cb, float *Cr, size_t num_thd)
+// Enqueue one launch of convert over size pixels of planes (R, G, B, Y,
+// Cb and Cr) with per_item pixels, rounded up to whole runs of four, for
+// each work-item, after the n_wait events in wait
+static cl_event
+EnqueueConvert (cl_mem planes[6], size_t size, size_t per_item, int n_wait,
+                const cl_event *wait)
 {
-  struct timeval start, stop;
-  gettimeofday (&start, 0);
+  int n = size;
+  int runs_per_item = (per_item + 3) / 4;
+  for (size_t i = 0; i < 6; ++i)
+    CL_CHECK (
+        clSetKernelArg (convert_kernel, i, sizeof (cl_mem), &planes[i]));
+  CL_CHECK (clSetKernelArg (convert_kernel, 6, sizeof (int), &n));
+  CL_CHECK (clSetKernelArg (convert_kernel, 7, sizeof (int), &runs_per_item));
 
-  const float *in[3] = { R, G, B };
-  float *out[3] = { Y, Cb, Cr };
-
-  for (size_t c = 0; c < 3; ++c)
-    EnqueueWriteBuffer (cmd_queue, buf[c], size * sizeof (float), in[c]);
+  size_t runs = (size + 3) / 4;
+  size_t global_item_size = (runs + runs_per_item - 1) / runs_per_item;
+  cl_event converted;
+  CL_CHECK (clEnqueueNDRangeKernel (cmd_queue, convert_kernel, 1, 0,
+                                    &global_item_size, 0, n_wait, wait,
+                                    &converted));
+  CL_CHECK (clFlush (cmd_queue));
+  return converted;
+}
 
+// convertCL on a zero-copy device: the kernel reads in and writes out
+// where they are, and the maps of out only make its writes visible to the
+// host
+static void
+convertShared (size_t size, const float *in[3], float *out[3],
+               size_t per_item)
+{
+  size_t bytes = size * sizeof (float);
+  cl_mem planes[6];
   for (size_t c = 0; c < 3; ++c)
     {
-      cl_err = clSetKernelArg (convert_kernel, c, sizeof (cl_mem), &buf[c]);
-      if (cl_err)
-        CL_Error ("Error setting kernel arg");
+      planes[c] = CL_CHECK_R (
+          clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+                          bytes, (void *)in[c], &cl_err));
+      planes[3 + c] = CL_CHECK_R (
+          clCreateBuffer (context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
+                          bytes, out[c], &cl_err));
     }
-  clFinish (cmd_queue);
-  gettimeofday (&stop, 0);
-  fprintf (output_file, "CL copy h2d time: %u\n",
-           GetTimevalMicroSeconds (&start, &stop));
 
-  gettimeofday (&start, 0);
-  size_t global_item_size = num_thd;
-  for (size_t offset = 0; offset < size; offset += num_thd)
-    {
-      cl_err = clEnqueueNDRangeKernel (cmd_queue, convert_kernel, 1, &offset,
-                                       &global_item_size, 0, 0, 0, 0);
-      if (cl_err)
-        CL_Error ("Error enqueueing range kernel");
+  TRACE_BEGIN ("convertCL kernel", -1);
+  cl_event converted = EnqueueConvert (planes, size, per_item, 0, 0);
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (1, &converted));
+  TRACE_END ();
 
-      clFinish (cmd_queue);
+  TRACE_BEGIN ("convertCL map", -1);
+  cl_event mapped[3], unmapped[3];
+  for (size_t c = 0; c < 3; ++c)
+    {
+      void *p = CL_CHECK_R (clEnqueueMapBuffer (
+          readback_queue, planes[3 + c], CL_FALSE, CL_MAP_READ, 0, bytes, 1,
+          &converted, &mapped[c], &cl_err));
+      CL_CHECK (clEnqueueUnmapMemObject (readback_queue, planes[3 + c], p, 1,
+                                         &mapped[c], &unmapped[c]));
     }
+  CL_CHECK (clWaitForEvents (3, unmapped));
+  TRACE_END ();
 
-  gettimeofday (&stop, 0);
+  fprintf (output_file, "CL copy h2d time: 0\n");
   fprintf (output_file, "CL kernel execution time: %u\n",
-           GetTimevalMicroSeconds (&start, &stop));
+           EventsSpan (1, &converted));
+  fprintf (output_file, "CL copy d2h time: %u\n", EventsSpan (3, mapped));
+  clReleaseEvent (converted);
+  ReleaseEvents (3, mapped);
+  ReleaseEvents (3, unmapped);
+  for (size_t i = 0; i < 6; ++i)
+    clReleaseMemObject (planes[i]);
+}
 
-  gettimeofday (&start, 0);
-  for (size_t c = 0; c < 3; ++c)
+void
+convertCL (size_t size, const float *R, const float *G, const float *B,
+           float *Y, float *Cb, float *Cr, size_t per_item)
+{
+  const float *in[3] = { R, G, B };
+  float *out[3] = { Y, Cb, Cr };
+  if (zero_copy)
     {
-      EnqueueReadBuffer (cmd_queue, buf[c], size * sizeof (float), out[c]);
+      convertShared (size, in, out, per_item);
+      return;
     }
+  cl_event uploaded[3], converted, read[3];
 
-  cl_err = clFinish (cmd_queue);
-  if (cl_err)
-    CL_Error ("Error finishing convert command queue");
+  TRACE_BEGIN ("convertCL upload", -1);
+  for (size_t c = 0; c < 3; ++c)
+    CL_CHECK (clEnqueueWriteBuffer (upload_queue, buf[c], CL_FALSE, 0,
+                                    size * sizeof (float), in[c], 0, 0,
+                                    &uploaded[c]));
+  CL_CHECK (clFlush (upload_queue));
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (3, uploaded));
+  TRACE_END ();
 
-  gettimeofday (&stop, 0);
-  fprintf (output_file, "CL copy d2h time: %u\n",
-           GetTimevalMicroSeconds (&start, &stop));
+  // In place: buf holds R, G and B and then Y, Cb and Cr
+  TRACE_BEGIN ("convertCL kernel", -1);
+  cl_mem planes[6] = { buf[0], buf[1], buf[2], buf[0], buf[1], buf[2] };
+  converted = EnqueueConvert (planes, size, per_item, 3, uploaded);
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (1, &converted));
+  TRACE_END ();
+
+  TRACE_BEGIN ("convertCL readback", -1);
+  for (size_t c = 0; c < 3; ++c)
+    CL_CHECK (clEnqueueReadBuffer (readback_queue, buf[c], CL_FALSE, 0,
+                                   size * sizeof (float), out[c], 1,
+                                   &converted, &read[c]));
+  CL_CHECK (clWaitForEvents (3, read));
+  TRACE_END ();
+
+  fprintf (output_file, "CL copy h2d time: %u\n", EventsSpan (3, uploaded));
+  fprintf (output_file, "CL kernel execution time: %u\n",
+           EventsSpan (1, &converted));
+  fprintf (output_file, "CL copy d2h time: %u\n", EventsSpan (3, read));
+  ReleaseEvents (3, uploaded);
+  clReleaseEvent (converted);
+  ReleaseEvents (3, read);
 }
 
 void
@@ -348,48 +856,421 @@ initMotionKernel ()
 {
   size_t size[] = { width, height };
   size_t block_size = 16;
+  for (size_t set = 0; set < 2; ++set)
+    for (size_t c = 0; c < 3; ++c)
+      {
+        size_t buff_size = size[0] * size[1] * sizeof (float);
+        frame_buf[set][c] = CreateSharedBuffer (buff_size);
+      }
+  source_set = 0;
+
+  size_t motion_buf_size = (size[0] / block_size - 2)
+                           * (size[1] / block_size - 2) * sizeof (int) * 2;
+  motion_buf = CreateSharedBuffer (motion_buf_size);
+}
+
+// Enqueue the upload of planes into set; returns the number of events
+// added to uploaded
+static int
+uploadFrame (int set, size_t size[2], const float *planes[3],
+             cl_event *uploaded)
+{
+  size_t buff_size = size[0] * size[1] * sizeof (float);
+  for (size_t c = 0; c < 3; ++c)
+    WriteShared (frame_buf[set][c], buff_size, planes[c], &uploaded[c]);
+  return 3;
+}
+
+// Bind the source and match sets to arguments 0-5 and the motion vectors
+// to argument 6
+static void
+setFrameArgs (cl_kernel kernel, cl_mem *motion)
+{
   for (size_t c = 0; c < 3; ++c)
     {
-      size_t buff_size = size[0] * size[1] * sizeof (float);
-      sbuf[c] = CL_CHECK_R (
-          clCreateBuffer (context, CL_MEM_READ_ONLY, buff_size, 0, &cl_err));
-      mbuf[c] = CL_CHECK_R (
-          clCreateBuffer (context, CL_MEM_READ_ONLY, buff_size, 0, &cl_err));
+      CL_CHECK (clSetKernelArg (kernel, c, sizeof (cl_mem),
+                                &frame_buf[source_set][c]));
+      CL_CHECK (clSetKernelArg (kernel, 3 + c, sizeof (cl_mem),
+                                &frame_buf[1 - source_set][c]));
     }
+  CL_CHECK (clSetKernelArg (kernel, 6, sizeof (cl_mem), motion));
+}
 
+void
+motionCL (size_t size[2], size_t block_size, const float *s[3],
+          const float *m[3], int s_resident, int *out_motion_vector)
+{
+  size_t local_work_size[2] = { block_size, block_size };
+  // Rows along dimension 0
+  size_t global_work_size[2] = { size[1], size[0] };
+  cl_event uploaded[6], searched, read;
+  int n_uploaded = 0;
+
+  // When tracing, wait for each step so that the spans cover the transfers
+  // and the kernel rather than just enqueueing them
+  TRACE_BEGIN ("motionCL upload", -1);
+  if (!s_resident)
+    n_uploaded += uploadFrame (source_set, size, s, uploaded);
+  n_uploaded += uploadFrame (1 - source_set, size, m, uploaded + n_uploaded);
+  CL_CHECK (clFlush (upload_queue));
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (n_uploaded, uploaded));
+  TRACE_END ();
+
+  TRACE_BEGIN ("motionCL kernel", -1);
+  setFrameArgs (motion_kernel, &motion_buf);
+  CL_CHECK (clEnqueueNDRangeKernel (cmd_queue, motion_kernel, 2, 0,
+                                    global_work_size, local_work_size,
+                                    n_uploaded, uploaded, &searched));
+  CL_CHECK (clFlush (cmd_queue));
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (1, &searched));
+  TRACE_END ();
+
+  TRACE_BEGIN ("motionCL readback", -1);
+  size_t motion_buf_size = (size[0] / block_size - 2)
+                           * (size[1] / block_size - 2) * sizeof (int) * 2;
+  ReadShared (motion_buf, motion_buf_size, out_motion_vector, searched,
+              &read);
+  CL_CHECK (clWaitForEvents (1, &read));
+  TRACE_END ();
+
+  ReleaseEvents (n_uploaded, uploaded);
+  clReleaseEvent (searched);
+  clReleaseEvent (read);
+}
+
+void
+deltaCL (size_t size[2], size_t block_size, const float *s[3],
+         const float *m[3], int frames_resident, const int *motion_vector,
+         float *out[3])
+{
+  // The residual is written over the match, rows of width along dimension 1
+  size_t global_work_size[2] = { size[1], size[0] };
+  cl_event uploaded[7], computed, read[3];
+  int n_uploaded = 0;
+
+  TRACE_BEGIN ("deltaCL upload", -1);
+  if (!frames_resident)
+    {
+      n_uploaded += uploadFrame (source_set, size, s, uploaded);
+      n_uploaded += uploadFrame (1 - source_set, size, m, uploaded + 3);
+    }
   size_t motion_buf_size = (size[0] / block_size - 2)
                            * (size[1] / block_size - 2) * sizeof (int) * 2;
-  motion_buf = CL_CHECK_R (clCreateBuffer (context, CL_MEM_WRITE_ONLY,
-                                           motion_buf_size, 0, &cl_err));
+  WriteShared (motion_buf, motion_buf_size, motion_vector,
+               &uploaded[n_uploaded++]);
+  CL_CHECK (clFlush (upload_queue));
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (n_uploaded, uploaded));
+  TRACE_END ();
 
+  TRACE_BEGIN ("deltaCL kernel", -1);
+  setFrameArgs (delta_kernel, &motion_buf);
+  CL_CHECK (clEnqueueNDRangeKernel (cmd_queue, delta_kernel, 2, 0,
+                                    global_work_size, 0, n_uploaded, uploaded,
+                                    &computed));
+  CL_CHECK (clFlush (cmd_queue));
+  if (trace_enabled)
+    CL_CHECK (clWaitForEvents (1, &computed));
+  TRACE_END ();
+
+  // The residual stays on the device as the source of the next search
+  source_set = 1 - source_set;
+
+  TRACE_BEGIN ("deltaCL readback", -1);
+  size_t buff_size = size[0] * size[1] * sizeof (float);
   for (size_t c = 0; c < 3; ++c)
+    ReadShared (frame_buf[source_set][c], buff_size, out[c], computed,
+                &read[c]);
+  CL_CHECK (clWaitForEvents (3, read));
+  TRACE_END ();
+
+  ReleaseEvents (n_uploaded, uploaded);
+  clReleaseEvent (computed);
+  ReleaseEvents (3, read);
+}
+
+/* A frame of submitFrameCL: the RGB planes it uploads, the motion vectors,
+ * coefficients and bitmaps it reads back, and its commands, each with the
+ * stage its device time counts towards.  Frames alternate between two
+ * slots, so that one can be uploaded while the other is transformed. */
+#define MAX_FRAME_EVENTS 32
+typedef struct FrameSlot
+{
+  cl_mem rgb[3];
+  cl_mem motion;
+  cl_mem coeffs[3];
+  cl_mem nonzero[3];
+  // The readbacks the host waits for
+  cl_event read[7];
+  int n_read;
+  cl_event events[MAX_FRAME_EVENTS];
+  int event_stages[MAX_FRAME_EVENTS];
+  int n_events;
+} FrameSlot;
+
+static FrameSlot slots[2];
+// Frames submitted and waited for
+static int n_submitted, n_waited;
+
+static void
+initPipeline (const float steps[64])
+{
+  size_t n_pixels = (size_t)width * height;
+  size_t chroma_size = width / 2 * (height / 2);
+  size_t motion_buf_size
+      = (width / 16 - 2) * (height / 16 - 2) * sizeof (int) * 2;
+  for (size_t c = 0; c < 2; ++c)
+    {
+      ycbcr_buf[c] = CreateBuffer (context, n_pixels * sizeof (float));
+      chroma_buf[c] = CreateBuffer (context, chroma_size * sizeof (float));
+    }
+  steps_buf = CreateBuffer (context, 64 * sizeof (float));
+  CL_CHECK (clEnqueueWriteBuffer (upload_queue, steps_buf, 1, 0,
+                                  64 * sizeof (float), steps, 0, 0, 0));
+  for (int s = 0; s < 2; ++s)
+    {
+      FrameSlot *slot = &slots[s];
+      slot->motion = CreateBuffer (context, motion_buf_size);
+      for (size_t c = 0; c < 3; ++c)
+        {
+          size_t n = c ? chroma_size : n_pixels;
+          slot->rgb[c] = CreateBuffer (context, n_pixels * sizeof (float));
+          slot->coeffs[c] = CreateBuffer (context, n * sizeof (int16_t));
+          slot->nonzero[c] = CreateBuffer (context, n / 64 * sizeof (cl_ulong));
+        }
+    }
+  pipeline_ready = 1;
+}
+
+static cl_event *
+stageEvent (FrameSlot *slot, int stage)
+{
+  slot->event_stages[slot->n_events] = stage;
+  return &slot->events[slot->n_events++];
+}
+
+// Enqueue kernel on cmd_queue after the n_wait events in wait; the event
+// of the kernel is returned
+static cl_event
+enqueueKernel (FrameSlot *slot, cl_kernel kernel, int stage, size_t n_dims,
+               const size_t *global, const size_t *local, int n_wait,
+               const cl_event *wait)
+{
+  cl_event *event = stageEvent (slot, stage);
+  CL_CHECK (clEnqueueNDRangeKernel (cmd_queue, kernel, n_dims, 0, global,
+                                    local, n_wait, wait, event));
+  return *event;
+}
+
+static void
+setArgs (cl_kernel kernel, int n, ...)
+{
+  va_list ap;
+  va_start (ap, n);
+  for (int i = 0; i < n; ++i)
     {
-      CL_CHECK (clSetKernelArg (motion_kernel, c, sizeof (cl_mem), &sbuf[c]));
-      CL_CHECK (
-          clSetKernelArg (motion_kernel, 3 + c, sizeof (cl_mem), &mbuf[c]));
+      cl_mem *mem = va_arg (ap, cl_mem *);
+      CL_CHECK (clSetKernelArg (kernel, i, sizeof (cl_mem), mem));
     }
+  va_end (ap);
+}
 
-  CL_CHECK (clSetKernelArg (motion_kernel, 6, sizeof (cl_mem), &motion_buf));
+// Enqueue the readback of n bytes of mem into out after event
+static void
+readBack (FrameSlot *slot, int stage, cl_mem mem, size_t n, void *out,
+          cl_event event)
+{
+  cl_event *read = stageEvent (slot, stage);
+  CL_CHECK (clEnqueueReadBuffer (readback_queue, mem, 0, 0, n, out, 1,
+                                 &event, read));
+  slot->read[slot->n_read++] = *read;
 }
 
 void
-motionCL (size_t size[2], size_t block_size, const float *s[3],
-          const float *m[3], int *out_motion_vector)
+submitFrameCL (const float *rgb[3], const float steps[64], int p_frame,
+               int *out_motion_vector, int16_t *coeffs[3],
+               uint64_t *nonzero[3])
 {
-  size_t local_work_size[2] = { block_size, block_size };
+  if (!pipeline_ready)
+    initPipeline (steps);
+  if (n_submitted - n_waited == 2)
+    Error ("submitFrameCL: two frames are already in flight");
+
+  FrameSlot *slot = &slots[n_submitted++ % 2];
+  slot->n_events = 0;
+  slot->n_read = 0;
+
+  size_t plane[2] = { height, width };
+  size_t chroma[2] = { height / 2, width / 2 };
+  size_t n_pixels = (size_t)width * height;
+  size_t n_chroma = chroma[0] * chroma[1];
+  int match_set = 1 - source_set;
+  cl_mem *match = frame_buf[match_set];
+
+  // The frame goes up once, as RGB, into its slot, which the frame before
+  // last has finished with: the host waited for its readbacks
+  TRACE_BEGIN ("submitFrameCL", -1);
+  cl_event uploaded[3];
   for (size_t c = 0; c < 3; ++c)
     {
-      size_t buff_size = size[0] * size[1] * sizeof (float);
-      CL_CHECK (clEnqueueWriteBuffer (cmd_queue, sbuf[c], 0, 0, buff_size,
-                                      s[c], 0, 0, 0));
-      CL_CHECK (clEnqueueWriteBuffer (cmd_queue, mbuf[c], 0, 0, buff_size,
-                                      m[c], 0, 0, 0));
+      CL_CHECK (clEnqueueWriteBuffer (upload_queue, slot->rgb[c], 0, 0,
+                                      n_pixels * sizeof (float), rgb[c], 0,
+                                      0, stageEvent (slot, 0)));
+      uploaded[c] = slot->events[slot->n_events - 1];
     }
-  CL_CHECK (clEnqueueNDRangeKernel (cmd_queue, motion_kernel, 2, 0, size,
-                                    local_work_size, 0, 0, 0));
-  size_t motion_buf_size = (size[0] / block_size - 2)
-                           * (size[1] / block_size - 2) * sizeof (int) * 2;
-  CL_CHECK (clEnqueueReadBuffer (cmd_queue, motion_buf, 0, 0, motion_buf_size,
-                                 out_motion_vector, 0, 0, 0));
+  CL_CHECK (clFlush (upload_queue));
+
+  // From here on every kernel runs on the in-order cmd_queue after the one
+  // before it, including those of the previous frame, whose result is the
+  // source of this one
+  setArgs (convert_planes_kernel, 6, &slot->rgb[0], &slot->rgb[1],
+           &slot->rgb[2], &match[0], &ycbcr_buf[0], &ycbcr_buf[1]);
+  enqueueKernel (slot, convert_planes_kernel, 0, 1, &n_pixels, 0, 3,
+                 uploaded);
+
+  size_t n_rows = height - 2;
+  for (size_t c = 1; c < 3; ++c)
+    {
+      setArgs (lowpass_v_kernel, 2, &ycbcr_buf[c - 1], &match[c]);
+      enqueueKernel (slot, lowpass_v_kernel, 1, 2, plane, 0, 0, 0);
+      setArgs (lowpass_h_kernel, 1, &match[c]);
+      CL_CHECK (clSetKernelArg (lowpass_h_kernel, 1, sizeof (int), &width));
+      enqueueKernel (slot, lowpass_h_kernel, 1, 1, &n_rows, 0, 0, 0);
+    }
+
+  // P frames are searched against the previous frame's result, which is
+  // still on the device, and become their residual in place
+  if (p_frame)
+    {
+      size_t block[2] = { 16, 16 };
+      size_t motion_buf_size
+          = (width / 16 - 2) * (height / 16 - 2) * sizeof (int) * 2;
+      setFrameArgs (motion_kernel, &slot->motion);
+      cl_event searched = enqueueKernel (slot, motion_kernel, 2, 2, plane,
+                                         block, 0, 0);
+      readBack (slot, 2, slot->motion, motion_buf_size, out_motion_vector,
+                searched);
+      setFrameArgs (delta_kernel, &slot->motion);
+      enqueueKernel (slot, delta_kernel, 3, 2, plane, 0, 0, 0);
+    }
+  source_set = match_set;
+
+  cl_mem *in[3] = { &match[0], &chroma_buf[0], &chroma_buf[1] };
+  for (size_t c = 1; c < 3; ++c)
+    {
+      setArgs (downsample_kernel, 2, &match[c], &chroma_buf[c - 1]);
+      enqueueKernel (slot, downsample_kernel, 4, 2, chroma, 0, 0, 0);
+    }
+
+  // Only the quantised coefficients, as shorts, and their bitmaps come back
+  size_t local[2] = { 8, 8 };
+  for (size_t c = 0; c < 3; ++c)
+    {
+      size_t n = c ? n_chroma : n_pixels;
+      setArgs (transform_kernel, 4, in[c], &steps_buf, &slot->coeffs[c],
+               &slot->nonzero[c]);
+      cl_event transformed
+          = enqueueKernel (slot, transform_kernel, 5, 2, c ? chroma : plane,
+                           local, 0, 0);
+      readBack (slot, 8, slot->coeffs[c], n * sizeof (int16_t), coeffs[c],
+                transformed);
+      readBack (slot, 8, slot->nonzero[c], n / 64 * sizeof (cl_ulong),
+                nonzero[c], transformed);
+    }
+  CL_CHECK (clFlush (cmd_queue));
+  CL_CHECK (clFlush (readback_queue));
+  TRACE_END ();
+}
+
+void
+waitFrameCL (double stage_ms[9])
+{
+  if (n_waited == n_submitted)
+    Error ("waitFrameCL: no frame in flight");
+  FrameSlot *slot = &slots[n_waited++ % 2];
+
+  TRACE_BEGIN ("waitFrameCL", -1);
+  CL_CHECK (clWaitForEvents (slot->n_read, slot->read));
+  TRACE_END ();
+
+  for (int i = 0; i < 9; ++i)
+    stage_ms[i] = 0;
+  for (int i = 0; i < slot->n_events; ++i)
+    {
+      // Everything the readbacks depend on is complete, and so is every
+      // command of the frame
+      cl_event event = slot->events[i];
+      stage_ms[slot->event_stages[i]]
+          += (EventTime (event, CL_PROFILING_COMMAND_END)
+              - EventTime (event, CL_PROFILING_COMMAND_START))
+             * 1e-6;
+    }
+  ReleaseEvents (slot->n_events, slot->events);
+  slot->n_events = 0;
+}
+
+float
+transformToleranceCL ()
+{
+  return device_fp64 ? 0 : TRANSFORM_FLOAT_TOLERANCE;
+}
+
+void
+releaseCL ()
+{
+  CL_CHECK (clFinish (upload_queue));
   CL_CHECK (clFinish (cmd_queue));
+  CL_CHECK (clFinish (readback_queue));
+
+  // Frames submitted but never waited for
+  for (; n_waited < n_submitted; ++n_waited)
+    {
+      FrameSlot *slot = &slots[n_waited % 2];
+      ReleaseEvents (slot->n_events, slot->events);
+      slot->n_events = 0;
+    }
+  n_submitted = n_waited = 0;
+
+  if (pipeline_ready)
+    {
+      for (int s = 0; s < 2; ++s)
+        {
+          clReleaseMemObject (slots[s].motion);
+          for (size_t c = 0; c < 3; ++c)
+            {
+              clReleaseMemObject (slots[s].rgb[c]);
+              clReleaseMemObject (slots[s].coeffs[c]);
+              clReleaseMemObject (slots[s].nonzero[c]);
+            }
+        }
+      for (size_t c = 0; c < 2; ++c)
+        {
+          clReleaseMemObject (ycbcr_buf[c]);
+          clReleaseMemObject (chroma_buf[c]);
+        }
+      clReleaseMemObject (steps_buf);
+      pipeline_ready = 0;
+    }
+
+  for (size_t c = 0; c < 3; ++c)
+    {
+      clReleaseMemObject (buf[c]);
+      clReleaseMemObject (frame_buf[0][c]);
+      clReleaseMemObject (frame_buf[1][c]);
+    }
+  clReleaseMemObject (motion_buf);
+
+  cl_kernel kernels[]
+      = { convert_kernel,        motion_kernel,    delta_kernel,
+          convert_planes_kernel, lowpass_v_kernel, lowpass_h_kernel,
+          downsample_kernel,     transform_kernel };
+  for (size_t i = 0; i < sizeof (kernels) / sizeof (kernels[0]); ++i)
+    clReleaseKernel (kernels[i]);
+  clReleaseProgram (program);
+  clReleaseCommandQueue (upload_queue);
+  clReleaseCommandQueue (cmd_queue);
+  clReleaseCommandQueue (readback_queue);
+  clReleaseContext (context);
 }
@@ -2,6 +2,7 @@
 #define OPT_OPENCL_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef __cplusplus
@@ -10,11 +11,51 @@ extern "C"
 {
 #endif
 
-  void initCL (int width, int height, FILE *file);
+  // Set up the device device_spec selects (see SelectDevice in
+  // opt_opencl.c: an index, gpu, cpu or accelerator, or part of a name; 0
+  // for the first GPU or else CPU device) for frames of width x height,
+  // logging the devices and timings to file.  The built kernels are cached
+  // in cache_dir, 0 for $XDG_CACHE_HOME/ppe or ~/.cache/ppe, or "" for no
+  // cache.
+  void initCL (int width, int height, const char *device_spec,
+               const char *cache_dir, FILE *file);
+  // Release everything initCL and the frames since set up on the device,
+  // so that initCL can be called again
+  void releaseCL ();
+  // RGB to YCbCr in one launch, with per_item pixels (rounded up to a
+  // multiple of 4) converted by each work-item
   void convertCL (size_t size, const float *R, const float *G, const float *B,
-                  float *Y, float *Cb, float *Cr, size_t num_thd);
+                  float *Y, float *Cb, float *Cr, size_t per_item);
+  // Motion vectors of m searched against s.  Both stay on the device for
+  // deltaCL; with s_resident, s is the residual deltaCL last left there and
+  // is not uploaded again.
   void motionCL (size_t size[2], size_t block_size, const float *s[3],
-                 const float *m[3], int *out_motion_vector);
+                 const float *m[3], int s_resident, int *out_motion_vector);
+  // The residual of m against s displaced by the motion vectors, into out,
+  // as computeDelta.  With frames_resident, s and m are the frames motionCL
+  // last searched and are already on the device.  The residual stays there
+  // as the next source.
+  void deltaCL (size_t size[2], size_t block_size, const float *s[3],
+                const float *m[3], int frames_resident,
+                const int *motion_vector, float *out[3]);
+  // The whole transform path of a frame on the device: the RGB planes go
+  // up, and only the motion vectors of a P frame and, for Y, Cb and Cr,
+  // the quantised coefficients of every 8x8 block in zig-zag order with
+  // their nonzero bitmaps come back.  The frame's result stays on the
+  // device as the reference of the next P frame.  steps are the quantiser
+  // steps of a block in raster order.  The frame is only enqueued: up to
+  // two frames are in flight, and out_motion_vector, coeffs and nonzero
+  // are written once waitFrameCL has returned for it.
+  void submitFrameCL (const float *rgb[3], const float steps[64],
+                      int p_frame, int *out_motion_vector, int16_t *coeffs[3],
+                      uint64_t *nonzero[3]);
+  // Wait for the oldest frame submitted, with the device time of its
+  // stages 0 to 8 into stage_ms
+  void waitFrameCL (double stage_ms[9]);
+  // Largest difference, in quantiser steps, of the coefficients of
+  // submitFrameCL from those of the host stages: 0, unless the device has
+  // no double precision for the DCT
+  float transformToleranceCL ();
 
 #ifdef __cplusplus
 }
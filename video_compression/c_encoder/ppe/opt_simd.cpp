@@ -0,0 +1,431 @@
+#include "opt_simd.h"
+
+#include "config.h"
+#include <error.h>
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The kernels are written once, as always-inline generic code laid out so
+// that the loop the vectoriser sees is elementwise.  They are then
+// instantiated for each instruction set with the target attribute, and the
+// variant is picked at run time with cpuid.  No kernel reassociates a sum,
+// and the Makefile turns off FMA contraction, so the variants agree bit for
+// bit with the reference stages in stages.cpp (convertRGBtoYCbCr, lowPass,
+// motionVectorSearch, dct8x8, quant8x8 and zigZagOrder) and with
+// dct8x8_block in dct8x8_block.cpp.
+
+#define GENERIC static inline __attribute__ ((always_inline))
+
+GENERIC void
+convertGeneric (size_t size, const float *R, const float *G, const float *B,
+                float *Y, float *Cb, float *Cr)
+{
+  for (size_t i = 0; i < size; ++i)
+    {
+      float r = R[i];
+      float g = G[i];
+      float b = B[i];
+      Y[i] = 0 + (0.299f * r) + (0.587f * g) + (0.113f * b);
+      Cb[i] = 128 - (0.168736f * r) - (0.331264f * g) + (0.5f * b);
+      Cr[i] = 128 + (0.5f * r) - (0.418688f * g) - (0.081312f * b);
+    }
+}
+
+static const float lp_a = 0.25;
+static const float lp_b = 0.5;
+static const float lp_c = 0.25;
+
+GENERIC void
+lowPassVGeneric (const float *in, float *out, int width, int row_begin,
+                 int row_end)
+{
+  for (int row = row_begin; row < row_end; row++)
+    {
+      const float *up = in + (row - 1) * width;
+      const float *mid = in + row * width;
+      const float *down = in + (row + 1) * width;
+      float *o = out + row * width;
+      for (int col = 1; col < width - 1; col++)
+        o[col] = lp_a * up[col] + lp_b * mid[col] + lp_c * down[col];
+    }
+}
+
+// The horizontal pass is a recurrence along each row, since it reads the
+// already filtered left neighbour.  Run LP_LANES rows side by side on a
+// transposed tile so that the rows, not the columns, fill the vector.
+#define LP_LANES 16
+#define LP_TILE 64
+
+GENERIC void
+lowPassHGeneric (float *data, int width, int row_begin, int row_end)
+{
+  int row = row_begin;
+  for (; row + LP_LANES <= row_end; row += LP_LANES)
+    {
+      float prev[LP_LANES];
+      float tile[LP_TILE + 1][LP_LANES];
+
+      for (int k = 0; k < LP_LANES; ++k)
+        prev[k] = data[(row + k) * width];
+
+      for (int col0 = 1; col0 < width - 1; col0 += LP_TILE)
+        {
+          int ncols = width - 1 - col0 < LP_TILE ? width - 1 - col0 : LP_TILE;
+          for (int k = 0; k < LP_LANES; ++k)
+            for (int j = 0; j <= ncols; ++j)
+              tile[j][k] = data[(row + k) * width + col0 + j];
+
+          for (int j = 0; j < ncols; ++j)
+            for (int k = 0; k < LP_LANES; ++k)
+              {
+                float v = lp_a * prev[k] + lp_b * tile[j][k]
+                          + lp_c * tile[j + 1][k];
+                tile[j][k] = v;
+                prev[k] = v;
+              }
+
+          for (int k = 0; k < LP_LANES; ++k)
+            for (int j = 0; j < ncols; ++j)
+              data[(row + k) * width + col0 + j] = tile[j][k];
+        }
+    }
+
+  for (; row < row_end; ++row)
+    {
+      float *d = data + row * width;
+      for (int col = 1; col < width - 1; col++)
+        d[col] = lp_a * d[col - 1] + lp_b * d[col] + lp_c * d[col + 1];
+    }
+}
+
+// Each candidate accumulates its SAD in the same (y, x) order as
+// motionVectorSearch, but 2 * window candidates that differ in sy are
+// accumulated side by side; their source pixels are contiguous.
+GENERIC void
+sadGeneric (const float *const match[3], int match_stride,
+            const float *const source[3], int source_stride, int window,
+            int block, float *sad)
+{
+  const float Y_weight = 0.5;
+  const float Cr_weight = 0.25;
+  const float Cb_weight = 0.25;
+  const int n = 2 * window;
+
+  for (int a = 0; a < n; a++)
+    {
+      float acc[2 * SIMD_MAX_WINDOW];
+      for (int k = 0; k < n; ++k)
+        acc[k] = 0;
+
+      for (int y = 0; y < block; y++)
+        for (int x = 0; x < block; x++)
+          {
+            int m_index = x * match_stride + y;
+            int s_index = (a + x) * source_stride + y;
+            float m_Y = match[0][m_index];
+            float m_Cb = match[1][m_index];
+            float m_Cr = match[2][m_index];
+            const float *s_Y = source[0] + s_index;
+            const float *s_Cb = source[1] + s_index;
+            const float *s_Cr = source[2] + s_index;
+            for (int k = 0; k < n; ++k)
+              acc[k] = acc[k]
+                       + (Y_weight * fabsf (m_Y - s_Y[k])
+                          + Cb_weight * fabsf (m_Cb - s_Cb[k])
+                          + Cr_weight * fabsf (m_Cr - s_Cr[k]));
+          }
+
+      for (int k = 0; k < n; ++k)
+        sad[k * n + a] = acc[k];
+    }
+}
+
+// 1-D DCT of eight vectors of eight lanes; the flowgraph of dct8x8_block.cpp
+GENERIC void
+dct8Lanes (double f[8][8], double F[8][8])
+{
+  const double c1 = 0.980785;
+  const double c2 = 0.923880;
+  const double c3 = 0.831470;
+  const double c4 = 0.707107;
+  const double c5 = 0.555570;
+  const double c6 = 0.382683;
+  const double c7 = 0.195090;
+
+  for (int l = 0; l < 8; l++)
+    {
+      double i0 = f[0][l] + f[7][l];
+      double i1 = f[1][l] + f[6][l];
+      double i2 = f[2][l] + f[5][l];
+      double i3 = f[3][l] + f[4][l];
+      double i4 = f[3][l] - f[4][l];
+      double i5 = f[2][l] - f[5][l];
+      double i6 = f[1][l] - f[6][l];
+      double i7 = f[0][l] - f[7][l];
+
+      double j0 = i0 + i3;
+      double j1 = i1 + i2;
+      double j2 = i1 - i2;
+      double j3 = i0 - i3;
+      double j4 = i4;
+      double j5 = (i6 - i5) * c4;
+      double j6 = (i6 + i5) * c4;
+      double j7 = i7;
+
+      double k0 = (j0 + j1) * c4;
+      double k1 = (j0 - j1) * c4;
+      double k2 = (j2 * c6) + (j3 * c2);
+      double k3 = (j3 * c6) - (j2 * c2);
+      double k4 = j4 + j5;
+      double k5 = j4 - j5;
+      double k6 = j7 - j6;
+      double k7 = j7 + j6;
+
+      F[0][l] = k0 / 2;
+      F[1][l] = (k4 * c7 + k7 * c1) / 2;
+      F[2][l] = k2 / 2;
+      F[3][l] = (k6 * c3 - k5 * c5) / 2;
+      F[4][l] = k1 / 2;
+      F[5][l] = (k5 * c3 + k6 * c5) / 2;
+      F[6][l] = k3 / 2;
+      F[7][l] = (k7 * c7 - k4 * c1) / 2;
+    }
+}
+
+GENERIC void
+dct8x8Generic (float *in, float *out, int stride)
+{
+  double f[8][8], F[8][8];
+
+  // Rows as lanes: f[j][row] is sample j of the row
+  for (int row = 0; row < 8; row++)
+    for (int j = 0; j < 8; j++)
+      f[j][row] = in[row * stride + j];
+  dct8Lanes (f, F);
+
+  // Columns as lanes: f[row][col] is the row transform's coefficient col
+  for (int row = 0; row < 8; row++)
+    for (int col = 0; col < 8; col++)
+      f[row][col] = F[col][row];
+  dct8Lanes (f, F);
+
+  for (int row = 0; row < 8; row++)
+    for (int col = 0; col < 8; col++)
+      out[row * stride + col] = (float)F[row][col];
+}
+
+GENERIC float
+shiftDeviationGeneric (float *in, int stride)
+{
+  // Per column, so that the loops are elementwise
+  float sum[8] = { 0 };
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      {
+        float v = in[x * stride + y] - 128;
+        in[x * stride + y] = v;
+        sum[y] += v;
+      }
+  float mean = 0;
+  for (int y = 0; y < 8; y++)
+    mean += sum[y];
+  mean /= 64;
+
+  float deviation[8] = { 0 };
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      deviation[y] += fabsf (in[x * stride + y] - mean);
+  float total = 0;
+  for (int y = 0; y < 8; y++)
+    total += deviation[y];
+  return total;
+}
+
+static const float quant_matrix[8][8] = {
+  { 16, 11, 10, 16, 24, 40, 51, 61 },
+  { 12, 12, 14, 19, 26, 58, 60, 55 },
+  { 14, 13, 16, 24, 40, 57, 69, 56 },
+  { 14, 17, 22, 29, 51, 87, 80, 62 },
+  { 18, 22, 37, 56, 68, 109, 103, 77 },
+  { 24, 35, 55, 64, 81, 104, 113, 92 },
+  { 49, 64, 78, 87, 103, 121, 120, 101 },
+  { 72, 92, 95, 98, 112, 100, 103, 99 },
+};
+
+GENERIC void
+roundBlockGeneric (float *in, float *out, int stride)
+{
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      {
+        float v = in[x * stride + y] / ceilf (quant_matrix[x][y] / QUALITY);
+        // roundf, spelled out so that it vectorises: ties away from zero,
+        // and the sign of zero is kept
+        float t = truncf (v);
+        out[x * stride + y]
+            = t + copysignf (fabsf (v - t) >= 0.5f ? 1.0f : 0.0f, v);
+      }
+}
+
+// The vectoriser does not turn a compare into a movemask, so this one kernel
+// uses SSE directly; it is baseline on x86-64, so every variant can.
+GENERIC uint64_t
+nonzeroGeneric (const float *in, int stride)
+{
+  const __m128 zero = _mm_setzero_ps ();
+  uint64_t bits = 0;
+  for (int x = 0; x < 8; x++)
+    {
+      const float *row = &in[x * stride];
+      unsigned lo = _mm_movemask_ps (_mm_cmpneq_ps (_mm_loadu_ps (row), zero));
+      unsigned hi
+          = _mm_movemask_ps (_mm_cmpneq_ps (_mm_loadu_ps (row + 4), zero));
+      bits |= (uint64_t)(lo | hi << 4) << (8 * x);
+    }
+  return bits;
+}
+
+GENERIC uint64_t
+roundBlockMaskGeneric (float *in, float *out, int stride)
+{
+  roundBlockGeneric (in, out, stride);
+  return nonzeroGeneric (out, stride);
+}
+
+static const int zigzag_index[64]
+    = { 0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+GENERIC void
+zigzagGeneric (const float *in, float *out, int stride)
+{
+  for (int i = 0; i < 64; i++)
+    out[i] = in[(zigzag_index[i] >> 3) * stride + (zigzag_index[i] & 7)];
+}
+
+#define DEFINE_SIMD_KERNELS(suffix, attr)                                     \
+  attr static void convert_##suffix (size_t size, const float *R,            \
+                                     const float *G, const float *B,         \
+                                     float *Y, float *Cb, float *Cr)         \
+  {                                                                           \
+    convertGeneric (size, R, G, B, Y, Cb, Cr);                                \
+  }                                                                           \
+  attr static void lowPassV_##suffix (const float *in, float *out,           \
+                                      int width, int row_begin, int row_end) \
+  {                                                                           \
+    lowPassVGeneric (in, out, width, row_begin, row_end);                     \
+  }                                                                           \
+  attr static void lowPassH_##suffix (float *data, int width, int row_begin, \
+                                      int row_end)                           \
+  {                                                                           \
+    lowPassHGeneric (data, width, row_begin, row_end);                        \
+  }                                                                           \
+  attr static void sad_##suffix (                                             \
+      const float *const match[3], int match_stride,                         \
+      const float *const source[3], int source_stride, int window,           \
+      int block, float *sad)                                                  \
+  {                                                                           \
+    sadGeneric (match, match_stride, source, source_stride, window, block,    \
+                sad);                                                         \
+  }                                                                           \
+  attr static void dct8x8_##suffix (float *in, float *out, int stride)       \
+  {                                                                           \
+    dct8x8Generic (in, out, stride);                                          \
+  }                                                                           \
+  attr static float shiftDeviation_##suffix (float *in, int stride)          \
+  {                                                                           \
+    return shiftDeviationGeneric (in, stride);                                \
+  }                                                                           \
+  attr static void round_##suffix (float *in, float *out, int stride)        \
+  {                                                                           \
+    roundBlockGeneric (in, out, stride);                                      \
+  }                                                                           \
+  attr static uint64_t roundMask_##suffix (float *in, float *out,            \
+                                           int stride)                       \
+  {                                                                           \
+    return roundBlockMaskGeneric (in, out, stride);                           \
+  }                                                                           \
+  attr static uint64_t nonzero_##suffix (const float *in, int stride)        \
+  {                                                                           \
+    return nonzeroGeneric (in, stride);                                       \
+  }                                                                           \
+  attr static void zigzag_##suffix (const float *in, float *out, int stride) \
+  {                                                                           \
+    zigzagGeneric (in, out, stride);                                          \
+  }
+
+#define SIMD_KERNELS(name, suffix)                                            \
+  {                                                                           \
+    name, convert_##suffix, lowPassV_##suffix, lowPassH_##suffix,             \
+        sad_##suffix, dct8x8_##suffix, shiftDeviation_##suffix,               \
+        round_##suffix, roundMask_##suffix,                                   \
+        nonzero_##suffix, zigzag_##suffix                                     \
+  }
+
+DEFINE_SIMD_KERNELS (scalar, __attribute__ ((optimize ("no-tree-vectorize"))))
+DEFINE_SIMD_KERNELS (sse41, __attribute__ ((target ("sse4.1"))))
+DEFINE_SIMD_KERNELS (avx2, __attribute__ ((target ("avx2"))))
+DEFINE_SIMD_KERNELS (avx512, __attribute__ ((target ("avx512f"))))
+
+static const SimdKernels simd_kernels[SIMD_ISA_COUNT] = {
+  SIMD_KERNELS ("scalar", scalar),
+  SIMD_KERNELS ("sse4.1", sse41),
+  SIMD_KERNELS ("avx2", avx2),
+  SIMD_KERNELS ("avx512", avx512),
+};
+
+SimdKernels simd = simd_kernels[SimdScalar];
+
+int
+simdSupported (enum SimdIsa isa)
+{
+  __builtin_cpu_init ();
+  switch (isa)
+    {
+    case SimdScalar:
+      return 1;
+    case SimdSSE41:
+      return __builtin_cpu_supports ("sse4.1");
+    case SimdAVX2:
+      return __builtin_cpu_supports ("avx2");
+    case SimdAVX512:
+      return __builtin_cpu_supports ("avx512f");
+    default:
+      return 0;
+    }
+}
+
+const SimdKernels *
+simdKernels (enum SimdIsa isa)
+{
+  return &simd_kernels[isa];
+}
+
+void
+initSIMD (const char *isa, FILE *log)
+{
+  int chosen = SimdScalar;
+  if (isa)
+    {
+      for (chosen = 0; chosen < SIMD_ISA_COUNT; ++chosen)
+        if (!strcmp (isa, simd_kernels[chosen].name))
+          break;
+      if (chosen == SIMD_ISA_COUNT)
+        error (EXIT_FAILURE, 0, "unknown SIMD variant '%s'", isa);
+      if (!simdSupported ((enum SimdIsa)chosen))
+        error (EXIT_FAILURE, 0, "this CPU does not support %s", isa);
+    }
+  else
+    {
+      for (int i = SimdScalar; i < SIMD_ISA_COUNT; ++i)
+        if (simdSupported ((enum SimdIsa)i))
+          chosen = i;
+    }
+
+  simd = simd_kernels[chosen];
+  fprintf (log, "SIMD kernels: %s\n", simd.name);
+}
@@ -0,0 +1,76 @@
+#ifndef OPT_SIMD_H
+#define OPT_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum SimdIsa
+{
+  SimdScalar,
+  SimdSSE41,
+  SimdAVX2,
+  SimdAVX512,
+  SIMD_ISA_COUNT
+};
+
+// Largest search window the SAD kernel supports
+#define SIMD_MAX_WINDOW 64
+
+// One set of hot kernels compiled for a single instruction set.  Every
+// variant performs the same floating-point operations in the same order as
+// the reference stages in stages.cpp (convertRGBtoYCbCr, lowPass,
+// motionVectorSearch, dct8x8, quant8x8 and zigZagOrder), so all variants
+// give bit-identical results.
+typedef struct SimdKernels
+{
+  const char *name;
+
+  // RGB to YCbCr of pixels [0, size)
+  void (*convert) (size_t size, const float *R, const float *G,
+                   const float *B, float *Y, float *Cb, float *Cr);
+
+  // Vertical 3-tap pass of lowPass over rows [row_begin, row_end),
+  // columns [1, width - 1)
+  void (*lowPassV) (const float *in, float *out, int width, int row_begin,
+                    int row_end);
+
+  // Horizontal 3-tap pass of lowPass, in place and left to right like the
+  // scalar code, over rows [row_begin, row_end)
+  void (*lowPassH) (float *data, int width, int row_begin, int row_end);
+
+  // SAD of the block at match, its rows match_stride apart, against every
+  // candidate of the 2 * window square search area whose corner (-window,
+  // -window) is at source, its rows source_stride apart; sad[(b + window)
+  // * 2 * window + (a + window)] for the candidate a rows and b columns
+  // away, as motionVectorSearch sums it
+  void (*sad) (const float *const match[3], int match_stride,
+               const float *const source[3], int source_stride, int window,
+               int block, float *sad);
+
+  void (*dct8x8_block) (float *in, float *out, int stride);
+  // Level shift the 8x8 block at in by -128 in place and return the sum of
+  // the absolute deviations of its samples from their mean
+  float (*shift_deviation) (float *in, int stride);
+  void (*round_block) (float *in, float *out, int stride);
+  // round_block, returning the nonzero mask of out (see Channel::nonzero)
+  uint64_t (*round_block_mask) (float *in, float *out, int stride);
+  // Nonzero mask of the 8x8 block at in
+  uint64_t (*nonzero_block) (const float *in, int stride);
+
+  // Zig-zag scan of the 8x8 block at in into 64 contiguous coefficients
+  void (*zigzag_block) (const float *in, float *out, int stride);
+} SimdKernels;
+
+// Kernels chosen by initSIMD
+extern SimdKernels simd;
+
+// Pick the widest variant the CPU supports, or the one named by isa
+// ("scalar", "sse4.1", "avx2", "avx512"), and report the choice on log.
+void initSIMD (const char *isa, FILE *log);
+
+int simdSupported (enum SimdIsa isa);
+
+const SimdKernels *simdKernels (enum SimdIsa isa);
+
+#endif
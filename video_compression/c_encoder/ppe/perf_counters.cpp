@@ -0,0 +1,257 @@
+#include "perf_counters.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#define UNCORE_DEVICES "/sys/bus/event_source/devices/"
+
+// Bytes moved by one DRAM CAS command
+#define CAS_BYTES 64
+
+const char *perf_event_name[N_PERF_EVENTS]
+    = { "cycles",         "instructions", "branches",    "branch-misses",
+        "LLC-references", "LLC-misses",   "memory-bytes" };
+
+// One counter per core event, and one per memory controller and direction
+// for the memory traffic
+static vector<int> perf_fd[N_PERF_EVENTS];
+
+static int
+openCounter (uint32_t type, uint64_t config, pid_t pid, int cpu)
+{
+  struct perf_event_attr attr;
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format
+      = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  if (pid == 0)
+    {
+      // Count the OpenMP workers too, in user space only so that it works
+      // with the default perf_event_paranoid
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+    }
+  return syscall (__NR_perf_event_open, &attr, pid, cpu, -1, 0);
+}
+
+static string
+readLine (const string &path)
+{
+  ifstream file (path.c_str ());
+  string line;
+  getline (file, line);
+  return line;
+}
+
+// Turn an event description like "event=0x04,umask=0x03" into the config
+// value, using the bit ranges in the device's format directory
+static int
+eventConfig (const string &device, const string &event, uint64_t *config)
+{
+  string terms = readLine (device + "events/" + event);
+  if (terms.empty ())
+    return 0;
+
+  *config = 0;
+  size_t pos = 0;
+  while (pos < terms.size ())
+    {
+      size_t comma = terms.find (',', pos);
+      if (comma == string::npos)
+        comma = terms.size ();
+      string term = terms.substr (pos, comma - pos);
+      pos = comma + 1;
+
+      size_t eq = term.find ('=');
+      string name = term.substr (0, eq);
+      uint64_t value
+          = eq == string::npos ? 1 : strtoull (term.c_str () + eq + 1, 0, 0);
+
+      // "config:8-15" or "config:21"
+      string format = readLine (device + "format/" + name);
+      int lo, hi;
+      int n = sscanf (format.c_str (), "config:%d-%d", &lo, &hi);
+      if (n < 1)
+        return 0;
+      if (n == 1)
+        hi = lo;
+      uint64_t mask = hi - lo >= 63 ? ~0ull : ((1ull << (hi - lo + 1)) - 1);
+      *config |= (value & mask) << lo;
+    }
+  return 1;
+}
+
+// Memory traffic from the Intel integrated memory controllers, one
+// uncore_imc device per controller
+static void
+openMemCounters (void)
+{
+  DIR *dir = opendir (UNCORE_DEVICES);
+  if (!dir)
+    return;
+
+  struct dirent *entry;
+  while ((entry = readdir (dir)))
+    {
+      if (strncmp (entry->d_name, "uncore_imc", 10))
+        continue;
+      string device = string (UNCORE_DEVICES) + entry->d_name + "/";
+      uint32_t type = strtoul (readLine (device + "type").c_str (), 0, 10);
+      int cpu = atoi (readLine (device + "cpumask").c_str ());
+
+      const char *events[] = { "cas_count_read", "cas_count_write" };
+      for (int i = 0; i < 2; ++i)
+        {
+          uint64_t config;
+          if (!eventConfig (device, events[i], &config))
+            continue;
+          int fd = openCounter (type, config, -1, cpu);
+          if (fd >= 0)
+            perf_fd[PerfMemBytes].push_back (fd);
+        }
+    }
+  closedir (dir);
+}
+
+int
+initPerfCounters (FILE *log)
+{
+  static const uint64_t hw_config[] = {
+    PERF_COUNT_HW_CPU_CYCLES,          PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_REFERENCES,    PERF_COUNT_HW_CACHE_MISSES,
+  };
+
+  int err[N_PERF_EVENTS] = { 0 };
+  for (int e = 0; e < PerfMemBytes; ++e)
+    {
+      int fd = openCounter (PERF_TYPE_HARDWARE, hw_config[e], 0, -1);
+      if (fd >= 0)
+        perf_fd[e].push_back (fd);
+      else
+        err[e] = errno;
+    }
+  openMemCounters ();
+
+  int available = 0;
+  fprintf (log, "Perf counters:");
+  for (int e = 0; e < N_PERF_EVENTS; ++e)
+    if (perfCounterAvailable (e))
+      {
+        fprintf (log, " %s", perf_event_name[e]);
+        available = 1;
+      }
+  if (!available)
+    fprintf (log, " none");
+  fprintf (log, "\n");
+  for (int e = 0; e < N_PERF_EVENTS; ++e)
+    if (!perfCounterAvailable (e))
+      fprintf (log, "  %s unavailable%s%s\n", perf_event_name[e],
+               err[e] ? ": " : "", err[e] ? strerror (err[e]) : "");
+  return available;
+}
+
+int
+perfCounterAvailable (int event)
+{
+  return !perf_fd[event].empty ();
+}
+
+void
+readPerfCounters (PerfCounts *counts)
+{
+  for (int e = 0; e < N_PERF_EVENTS; ++e)
+    {
+      counts->count[e] = 0;
+      for (size_t i = 0; i < perf_fd[e].size (); ++i)
+        {
+          uint64_t value[3];
+          if (read (perf_fd[e][i], value, sizeof (value)) != sizeof (value)
+              || !value[2])
+            continue;
+          counts->count[e] += (double)value[0] * value[1] / value[2];
+        }
+    }
+  counts->count[PerfMemBytes] *= CAS_BYTES;
+}
+
+void
+perfCountsDiff (PerfCounts *out, const PerfCounts *begin,
+                const PerfCounts *end)
+{
+  for (int e = 0; e < N_PERF_EVENTS; ++e)
+    out->count[e] = end->count[e] - begin->count[e];
+}
+
+void
+perfCountsAdd (PerfCounts *sum, const PerfCounts *counts)
+{
+  for (int e = 0; e < N_PERF_EVENTS; ++e)
+    sum->count[e] += counts->count[e];
+}
+
+string
+formatPerfCounts (const PerfCounts *counts, double ms)
+{
+  const double *c = counts->count;
+  char buf[128];
+  string line;
+
+  for (int e = 0; e < PerfMemBytes; ++e)
+    if (perfCounterAvailable (e))
+      {
+        snprintf (buf, sizeof (buf), "%s %.4g  ", perf_event_name[e], c[e]);
+        line += buf;
+      }
+  if (perfCounterAvailable (PerfCycles)
+      && perfCounterAvailable (PerfInstructions) && c[PerfCycles] > 0)
+    {
+      snprintf (buf, sizeof (buf), "IPC %.2f  ",
+                c[PerfInstructions] / c[PerfCycles]);
+      line += buf;
+    }
+  if (perfCounterAvailable (PerfBranches)
+      && perfCounterAvailable (PerfBranchMisses) && c[PerfBranches] > 0)
+    {
+      snprintf (buf, sizeof (buf), "branch miss %.2f%%  ",
+                100 * c[PerfBranchMisses] / c[PerfBranches]);
+      line += buf;
+    }
+  if (perfCounterAvailable (PerfLLCReferences)
+      && perfCounterAvailable (PerfLLCMisses) && c[PerfLLCReferences] > 0)
+    {
+      snprintf (buf, sizeof (buf), "LLC miss %.2f%%  ",
+                100 * c[PerfLLCMisses] / c[PerfLLCReferences]);
+      line += buf;
+    }
+  if (perfCounterAvailable (PerfInstructions)
+      && perfCounterAvailable (PerfLLCMisses) && c[PerfInstructions] > 0)
+    {
+      snprintf (buf, sizeof (buf), "LLC MPKI %.2f  ",
+                1000 * c[PerfLLCMisses] / c[PerfInstructions]);
+      line += buf;
+    }
+  if (perfCounterAvailable (PerfMemBytes) && ms > 0)
+    {
+      snprintf (buf, sizeof (buf), "memory %.2f GB/s  ",
+                c[PerfMemBytes] / (ms * 1e6));
+      line += buf;
+    }
+  if (line.size () >= 2)
+    line.erase (line.size () - 2);
+  return line;
+}
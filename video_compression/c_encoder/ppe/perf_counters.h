@@ -0,0 +1,50 @@
+#ifndef perf_counters_h
+#define perf_counters_h
+
+#include <stdio.h>
+#include <string>
+
+// Hardware events counted around each encoder stage with --perf
+enum PerfEvent
+{
+  PerfCycles,
+  PerfInstructions,
+  PerfBranches,
+  PerfBranchMisses,
+  PerfLLCReferences,
+  PerfLLCMisses,
+  // DRAM traffic from the uncore memory controllers, in bytes
+  PerfMemBytes,
+  N_PERF_EVENTS
+};
+
+extern const char *perf_event_name[N_PERF_EVENTS];
+
+typedef struct PerfCounts
+{
+  double count[N_PERF_EVENTS];
+} PerfCounts;
+
+// Open the counters with perf_event_open.  The core events follow this
+// process and the threads it starts afterwards, so call it before the
+// first OpenMP region.  Memory traffic is counted system wide, which needs
+// perf_event_paranoid <= 0 or CAP_PERFMON.  Reports on log what can be
+// counted; returns nonzero if anything can.
+int initPerfCounters (FILE *log);
+
+int perfCounterAvailable (int event);
+
+// Current totals, scaled for the time a counter was multiplexed out
+void readPerfCounters (PerfCounts *counts);
+
+// out = end - begin
+void perfCountsDiff (PerfCounts *out, const PerfCounts *begin,
+                     const PerfCounts *end);
+
+void perfCountsAdd (PerfCounts *sum, const PerfCounts *counts);
+
+// One line summary of counts over ms milliseconds: the counts, IPC, branch
+// and LLC miss rates and memory bandwidth, leaving out what is unavailable
+std::string formatPerfCounts (const PerfCounts *counts, double ms);
+
+#endif
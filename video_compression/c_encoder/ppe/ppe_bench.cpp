@@ -0,0 +1,617 @@
+#include "backend.h"
+#include "cmd_args.h"
+#include "config.h"
+#include "dct8x8_block.h"
+#include "opt_opencl.h"
+#include "opt_simd.h"
+#include "stages.h"
+#include "synth.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <argp.h>
+#include <errno.h>
+#include <error.h>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const char *argp_program_version = "ppe-bench 0.1";
+static const char doc[]
+    = "ppe-bench -- time the encoder kernels and every backend of each stage "
+      "on synthetic frames";
+
+// The stages read the encoder's options; the defaults are what we want
+Args args;
+
+typedef struct BenchArgs
+{
+  const char *resolutions;
+  const char *filter;
+  int reps;
+  int warmup;
+  double max_time;
+  const char *csv;
+  const char *json;
+  const char *compare;
+  double threshold;
+  int opencl;
+  const char *isa;
+  const char *cl_device;
+} BenchArgs;
+
+#define OPT_RES 1
+#define OPT_FILTER 2
+#define OPT_REPS 3
+#define OPT_WARMUP 4
+#define OPT_MAX_TIME 5
+#define OPT_CSV 6
+#define OPT_JSON 7
+#define OPT_COMPARE 8
+#define OPT_THRESHOLD 9
+#define OPT_ISA 10
+#define OPT_CL_DEVICE 11
+
+static const struct argp_option argp_options[] = {
+  { "res", OPT_RES, "LIST", 0,
+    "Comma separated resolutions to run: 720p, 1080p, 4k, 8k (all)" },
+  { "filter", OPT_FILTER, "TEXT", 0,
+    "Only run benchmarks whose kernel/backend name contains TEXT" },
+  { "reps", OPT_REPS, "N", 0, "Time N repetitions (10)" },
+  { "warmup", OPT_WARMUP, "N", 0, "Run N untimed repetitions first (1)" },
+  { "max-time", OPT_MAX_TIME, "SEC", 0,
+    "Stop repeating a benchmark after SEC seconds, but time at least 3 "
+    "repetitions (5)" },
+  { "csv", OPT_CSV, "FILE", 0, "Write the results as CSV to FILE" },
+  { "json", OPT_JSON, "FILE", 0, "Write the results as JSON to FILE" },
+  { "compare", OPT_COMPARE, "FILE", 0,
+    "Compare the medians with those in FILE, a CSV from an earlier run, "
+    "and fail if one regressed by more than the threshold" },
+  { "threshold", OPT_THRESHOLD, "PCT", 0,
+    "Regression allowed by --compare, in percent (5)" },
+  { "cl", 'c', 0, 0, "Also run the OpenCL backends" },
+  { "cl-device", OPT_CL_DEVICE, "DEVICE", 0,
+    "Run them on OpenCL DEVICE: its number, gpu, cpu or accelerator, or "
+    "part of its name (the first GPU, else CPU device)" },
+  { "isa", OPT_ISA, "ISA", 0,
+    "Use the ISA variant of the SIMD kernels in the stage backends" },
+  { 0 }
+};
+
+static error_t
+ParseOpt (int key, char *arg, struct argp_state *state)
+{
+  BenchArgs *args = (BenchArgs *)state->input;
+
+  switch (key)
+    {
+    case OPT_RES:
+      args->resolutions = arg;
+      break;
+    case OPT_FILTER:
+      args->filter = arg;
+      break;
+    case OPT_REPS:
+      args->reps = max (1L, strtol (arg, 0, 10));
+      break;
+    case OPT_WARMUP:
+      args->warmup = max (0L, strtol (arg, 0, 10));
+      break;
+    case OPT_MAX_TIME:
+      args->max_time = strtod (arg, 0);
+      break;
+    case OPT_CSV:
+      args->csv = arg;
+      break;
+    case OPT_JSON:
+      args->json = arg;
+      break;
+    case OPT_COMPARE:
+      args->compare = arg;
+      break;
+    case OPT_THRESHOLD:
+      args->threshold = strtod (arg, 0);
+      break;
+    case 'c':
+      args->opencl = 1;
+      break;
+    case OPT_ISA:
+      args->isa = arg;
+      break;
+    case OPT_CL_DEVICE:
+      args->cl_device = arg;
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+static struct argp argp = { argp_options, ParseOpt, 0, doc };
+
+// Inputs of every kernel at one resolution, made by the reference stages
+// from a textured synthetic frame and a shifted copy
+typedef struct BenchFrames
+{
+  int n;
+  Image *rgb;
+  Image *ycbcr;
+  Frame *lowpassed[2];
+  vector<mVector> *motion_vectors;
+  Frame *delta;
+  Channel *dct;
+  Channel *quant;
+  Channel *zigzag;
+} BenchFrames;
+
+static Image *
+benchImage (int n, int dx, int dy)
+{
+  Image *img = new Image (n, n, FULLSIZE);
+  Channel *c[] = { img->rc, img->gc, img->bc };
+  unsigned seed = 1;
+  for (int ch = 0; ch < 3; ++ch)
+    for (int row = 0; row < n; ++row)
+      for (int col = 0; col < n; ++col)
+        {
+          seed = seed * 1103515245 + 12345;
+          float v = 128
+                    + 60 * sinf ((col + dx) * 0.021f + ch)
+                          * cosf ((row + dy) * 0.017f)
+                    + (seed >> 16) % 9 - 4;
+          c[ch]->data[row * n + col] = min (255.f, max (0.f, floorf (v)));
+        }
+  return img;
+}
+
+static Frame *
+benchLowPass (Image *ycbcr)
+{
+  Frame *f = new Frame (ycbcr->width, ycbcr->height, FULLSIZE);
+  f->Y->copy (ycbcr->rc);
+  lowPassSIMD (ycbcr->gc, f->Cb);
+  lowPassSIMD (ycbcr->bc, f->Cr);
+  return f;
+}
+
+static void
+initBenchFrames (BenchFrames *f, int n)
+{
+  f->n = n;
+  f->rgb = benchImage (n, 0, 0);
+  Image *shifted = benchImage (n, 5, -3);
+  Image ycbcr (n, n, FULLSIZE);
+
+  f->ycbcr = new Image (n, n, FULLSIZE);
+  convertSIMD (f->rgb, f->ycbcr);
+  convertSIMD (shifted, &ycbcr);
+  delete shifted;
+  f->lowpassed[0] = benchLowPass (f->ycbcr);
+  f->lowpassed[1] = benchLowPass (&ycbcr);
+  f->motion_vectors
+      = motionVectorSearchSIMD (f->lowpassed[0], f->lowpassed[1], n, n);
+  f->delta = computeDelta (f->lowpassed[0], f->lowpassed[1],
+                           f->motion_vectors);
+  Channel in (f->delta->Y);
+  f->dct = new Channel (n, n);
+  dct8x8SIMD (&in, f->dct);
+  f->quant = new Channel (n, n);
+  quant8x8SIMD (f->dct, f->quant);
+  f->zigzag = new Channel (MPEG_CONSTANT, n * n / MPEG_CONSTANT);
+  zigZagOrderSIMD (f->quant, f->zigzag);
+}
+
+static void
+freeBenchFrames (BenchFrames *f)
+{
+  delete f->rgb;
+  delete f->ycbcr;
+  delete f->lowpassed[0];
+  delete f->lowpassed[1];
+  delete f->motion_vectors;
+  delete f->delta;
+  delete f->dct;
+  delete f->quant;
+  delete f->zigzag;
+}
+
+typedef struct Benchmark
+{
+  string kernel;
+  string backend;
+  // Bytes each pixel of the frame moves at least, reading the inputs and
+  // writing the outputs once
+  double bytes_per_pixel;
+  // Untimed, before every repetition: reset inputs the kernel overwrites
+  function<void ()> prepare;
+  function<void ()> run;
+} Benchmark;
+
+typedef struct BenchResult
+{
+  string kernel;
+  string backend;
+  const char *resolution;
+  int width;
+  int height;
+  int reps;
+  double median_ms;
+  double p95_ms;
+  double min_ms;
+  double mpixels_per_s;
+  double gbytes_per_s;
+} BenchResult;
+
+// Every 8x8 block of an n x n channel, in the order the stages visit them
+static void
+forBlocks (int n, const function<void (int)> &body)
+{
+  for (int y = 0; y < n; y += 8)
+    for (int x = 0; x < n; x += 8)
+      body (x * n + y);
+}
+
+static vector<Benchmark>
+benchmarks (BenchFrames *f, Channel *scratch_in, Channel *scratch_out,
+            int opencl)
+{
+  vector<Benchmark> list;
+  int n = f->n;
+
+  // Every backend of every stage
+  for (int s = 0; s < N_STAGES; ++s)
+    for (int i = 0; i < stage_info[s].n_backends; ++i)
+      {
+        const Backend *backend = &stage_info[s].backends[i];
+        if ((backend->mode & OpenCL) && !opencl)
+          continue;
+
+        Backends b = Backends ();
+        setBackend (&b, s, backend);
+        Benchmark bench;
+        bench.kernel = stage_info[s].name;
+        bench.backend = backend->name;
+        switch (s)
+          {
+          case StageConvert:
+            bench.bytes_per_pixel = 6 * sizeof (float);
+            bench.run = [=] () {
+              Image out (n, n, FULLSIZE);
+              b.convert (f->rgb, &out);
+            };
+            break;
+          case StageLowPass:
+            bench.bytes_per_pixel = 2 * sizeof (float);
+            bench.run = [=] () { b.lowpass (f->ycbcr->gc, scratch_out); };
+            break;
+          case StageMotion:
+            bench.bytes_per_pixel = 6 * sizeof (float);
+            bench.run = [=] () {
+              delete b.motion (f->lowpassed[0], f->lowpassed[1], n, n);
+            };
+            break;
+          case StageDelta:
+            bench.bytes_per_pixel = 9 * sizeof (float);
+            bench.run = [=] () {
+              delete b.delta (f->lowpassed[0], f->lowpassed[1],
+                              f->motion_vectors);
+            };
+            break;
+          case StageDownSample:
+            bench.bytes_per_pixel = 1.25 * sizeof (float);
+            bench.run = [=] () { delete b.downsample (f->delta->Cb); };
+            break;
+          case StageDCT:
+            bench.bytes_per_pixel = 2 * sizeof (float);
+            bench.prepare = [=] () { scratch_in->copy (f->delta->Y); };
+            bench.run = [=] () { b.dct (scratch_in, scratch_out); };
+            break;
+          case StageQuant:
+            bench.bytes_per_pixel = 2 * sizeof (float);
+            bench.run = [=] () { b.quant (f->dct, scratch_out); };
+            break;
+          case StageZigZag:
+            bench.bytes_per_pixel = 2 * sizeof (float);
+            bench.run = [=] () { b.zigzag (f->quant, scratch_out); };
+            break;
+          case StageEncode:
+            bench.bytes_per_pixel = sizeof (float);
+            bench.run = [=] () {
+              SMatrix out (n * n / MPEG_CONSTANT, MPEG_CONSTANT);
+              b.encode (f->zigzag, &out);
+            };
+            break;
+          }
+        list.push_back (bench);
+      }
+
+  // The single-threaded block kernels, for every instruction set the CPU
+  // has.  "ref" is the plain C++ code the stages' ref backends use.
+  list.push_back ({ "dct8x8_block", "ref", 2 * sizeof (float),
+                    [=] () { scratch_in->copy (f->delta->Y); },
+                    [=] () {
+                      forBlocks (n, [=] (int i) {
+                        dct8x8_block (scratch_in->data + i,
+                                      scratch_out->data + i, n);
+                      });
+                    } });
+  list.push_back ({ "dct8x8_block", "fixed", 2 * sizeof (float), nullptr,
+                    [=] () {
+                      forBlocks (n, [=] (int i) {
+                        dct8x8_block_fixed (f->delta->Y->data + i,
+                                            scratch_out->data + i, n);
+                      });
+                    } });
+  list.push_back ({ "round_block", "ref", 2 * sizeof (float), nullptr,
+                    [=] () {
+                      forBlocks (n, [=] (int i) {
+                        round_block (f->dct->data + i, scratch_out->data + i,
+                                     n);
+                      });
+                    } });
+
+  for (int isa = 0; isa < SIMD_ISA_COUNT; ++isa)
+    {
+      if (!simdSupported ((SimdIsa)isa))
+        continue;
+      const SimdKernels *k = simdKernels ((SimdIsa)isa);
+
+      list.push_back ({ "dct8x8_block", k->name, 2 * sizeof (float),
+                        [=] () { scratch_in->copy (f->delta->Y); },
+                        [=] () {
+                          forBlocks (n, [=] (int i) {
+                            k->dct8x8_block (scratch_in->data + i,
+                                             scratch_out->data + i, n);
+                          });
+                        } });
+      list.push_back ({ "round_block", k->name, 2 * sizeof (float), nullptr,
+                        [=] () {
+                          forBlocks (n, [=] (int i) {
+                            k->round_block (f->dct->data + i,
+                                            scratch_out->data + i, n);
+                          });
+                        } });
+      list.push_back ({ "zigzag_block", k->name, 2 * sizeof (float), nullptr,
+                        [=] () {
+                          int block = 0;
+                          forBlocks (n, [&] (int i) {
+                            k->zigzag_block (f->quant->data + i,
+                                             scratch_out->data
+                                                 + MPEG_CONSTANT * block++,
+                                             n);
+                          });
+                        } });
+      list.push_back (
+          { "sad", k->name, 6 * sizeof (float), nullptr, [=] () {
+             const float *match[3]
+                 = { f->lowpassed[1]->Y->data, f->lowpassed[1]->Cb->data,
+                     f->lowpassed[1]->Cr->data };
+             const float *source[3]
+                 = { f->lowpassed[0]->Y->data, f->lowpassed[0]->Cb->data,
+                     f->lowpassed[0]->Cr->data };
+             vector<float> sad (4 * WINDOW_SIZE * WINDOW_SIZE);
+             for (int my = WINDOW_SIZE; my < n - 2 * WINDOW_SIZE + 1;
+                  my += BLOCK_SIZE)
+               for (int mx = WINDOW_SIZE; mx < n - 2 * WINDOW_SIZE + 1;
+                    mx += BLOCK_SIZE)
+                 {
+                   const float *m[3], *s[3];
+                   for (int c = 0; c < 3; c++)
+                     {
+                       m[c] = match[c] + mx * n + my;
+                       s[c] = source[c] + (mx - WINDOW_SIZE) * n + my
+                              - WINDOW_SIZE;
+                     }
+                   k->sad (m, n, s, n, WINDOW_SIZE, BLOCK_SIZE, sad.data ());
+                 }
+           } });
+    }
+
+  return list;
+}
+
+static double
+percentile (vector<double> sorted, double p)
+{
+  size_t rank = (size_t)ceil (p * sorted.size ());
+  return sorted[rank ? rank - 1 : 0];
+}
+
+static BenchResult
+runBenchmark (const Benchmark *bench, const Resolution *res, int n,
+              const BenchArgs *args)
+{
+  for (int i = 0; i < args->warmup; ++i)
+    {
+      if (bench->prepare)
+        bench->prepare ();
+      bench->run ();
+    }
+
+  vector<double> times;
+  double total = 0;
+  while ((int)times.size () < args->reps
+         && (times.size () < 3 || total < args->max_time))
+    {
+      if (bench->prepare)
+        bench->prepare ();
+      START_TIMER (timer);
+      bench->run ();
+      END_TIMER (timer);
+      times.push_back (timer);
+      total += timer;
+    }
+  sort (times.begin (), times.end ());
+
+  BenchResult r;
+  r.kernel = bench->kernel;
+  r.backend = bench->backend;
+  r.resolution = res->name;
+  r.width = n;
+  r.height = n;
+  r.reps = times.size ();
+  r.median_ms = percentile (times, 0.5) * 1e3;
+  r.p95_ms = percentile (times, 0.95) * 1e3;
+  r.min_ms = times[0] * 1e3;
+  r.mpixels_per_s = (double)n * n / (r.median_ms * 1e3);
+  r.gbytes_per_s = bench->bytes_per_pixel * n * n / (r.median_ms * 1e6);
+  return r;
+}
+
+static void
+writeCSV (const char *path, const vector<BenchResult> &results)
+{
+  FILE *fp = fopen (path, "w");
+  if (!fp)
+    error (EXIT_FAILURE, errno, "%s", path);
+  fprintf (fp, "kernel,backend,resolution,width,height,reps,median_ms,"
+               "p95_ms,min_ms,mpixels_per_s,gbytes_per_s\n");
+  for (size_t i = 0; i < results.size (); ++i)
+    {
+      const BenchResult *r = &results[i];
+      fprintf (fp, "%s,%s,%s,%d,%d,%d,%.6f,%.6f,%.6f,%.3f,%.3f\n",
+               r->kernel.c_str (), r->backend.c_str (), r->resolution,
+               r->width, r->height, r->reps, r->median_ms, r->p95_ms,
+               r->min_ms, r->mpixels_per_s, r->gbytes_per_s);
+    }
+  fclose (fp);
+}
+
+static void
+writeJSON (const char *path, const vector<BenchResult> &results)
+{
+  FILE *fp = fopen (path, "w");
+  if (!fp)
+    error (EXIT_FAILURE, errno, "%s", path);
+  fprintf (fp, "{\"simd\":\"%s\",\"benchmarks\":[", simd.name);
+  for (size_t i = 0; i < results.size (); ++i)
+    {
+      const BenchResult *r = &results[i];
+      fprintf (fp,
+               "%s\n{\"kernel\":\"%s\",\"backend\":\"%s\","
+               "\"resolution\":\"%s\",\"width\":%d,\"height\":%d,"
+               "\"reps\":%d,\"median_ms\":%.6f,\"p95_ms\":%.6f,"
+               "\"min_ms\":%.6f,\"mpixels_per_s\":%.3f,"
+               "\"gbytes_per_s\":%.3f}",
+               i ? "," : "", r->kernel.c_str (), r->backend.c_str (),
+               r->resolution, r->width, r->height, r->reps, r->median_ms,
+               r->p95_ms, r->min_ms, r->mpixels_per_s, r->gbytes_per_s);
+    }
+  fprintf (fp, "\n]}\n");
+  fclose (fp);
+}
+
+// Number of results whose median is more than threshold percent above
+// that of the same benchmark in the CSV at path
+static int
+compareResults (const char *path, const vector<BenchResult> &results,
+                double threshold)
+{
+  ifstream file (path);
+  if (!file)
+    error (EXIT_FAILURE, errno, "%s", path);
+
+  map<string, double> baseline;
+  string line;
+  getline (file, line);
+  while (getline (file, line))
+    {
+      char kernel[64], backend[64], res[16];
+      double median;
+      if (sscanf (line.c_str (), "%63[^,],%63[^,],%15[^,],%*d,%*d,%*d,%lf",
+                  kernel, backend, res, &median)
+          == 4)
+        baseline[string (kernel) + "/" + backend + "/" + res] = median;
+    }
+
+  int regressions = 0;
+  printf ("\n%-28s %10s %10s %8s\n", "benchmark", "base ms", "ms", "change");
+  for (size_t i = 0; i < results.size (); ++i)
+    {
+      const BenchResult *r = &results[i];
+      string key = r->kernel + "/" + r->backend + "/" + r->resolution;
+      if (!baseline.count (key))
+        continue;
+      double base = baseline[key];
+      double change = 100 * (r->median_ms / base - 1);
+      int regressed = change > threshold;
+      printf ("%-28s %10.3f %10.3f %+7.1f%%%s\n", key.c_str (), base,
+              r->median_ms, change, regressed ? "  REGRESSION" : "");
+      regressions += regressed;
+    }
+  return regressions;
+}
+
+int
+main (int argc, char *argv[])
+{
+  BenchArgs bench_args = { 0, 0, 10, 1, 5, 0, 0, 0, 5, 0, 0, 0 };
+  argp_parse (&argp, argc, argv, 0, 0, &bench_args);
+
+  initSIMD (bench_args.isa, stdout);
+
+  vector<BenchResult> results;
+  printf ("%-14s %-8s %-6s %6s %5s %10s %10s %10s %8s\n", "kernel",
+          "backend", "res", "side", "reps", "median ms", "p95 ms",
+          "Mpixel/s", "GB/s");
+  for (size_t r = 0; r < N_RESOLUTIONS;
+       ++r)
+    {
+      const Resolution *res = &resolutions[r];
+      if (bench_args.resolutions)
+        {
+          string list = string (",") + bench_args.resolutions + ",";
+          if (list.find (string (",") + res->name + ",") == string::npos)
+            continue;
+        }
+
+      int n = squareSide (res);
+      if (bench_args.opencl)
+        initCL (n, n, bench_args.cl_device, 0, stderr);
+
+      BenchFrames frames;
+      initBenchFrames (&frames, n);
+      Channel scratch_in (n, n);
+      Channel scratch_out (n, n);
+      vector<Benchmark> list
+          = benchmarks (&frames, &scratch_in, &scratch_out,
+                        bench_args.opencl);
+
+      for (size_t i = 0; i < list.size (); ++i)
+        {
+          string name = list[i].kernel + "/" + list[i].backend;
+          if (bench_args.filter
+              && name.find (bench_args.filter) == string::npos)
+            continue;
+          BenchResult result
+              = runBenchmark (&list[i], res, n, &bench_args);
+          printf ("%-14s %-8s %-6s %6d %5d %10.3f %10.3f %10.1f %8.2f\n",
+                  result.kernel.c_str (), result.backend.c_str (),
+                  result.resolution, n, result.reps, result.median_ms,
+                  result.p95_ms, result.mpixels_per_s, result.gbytes_per_s);
+          fflush (stdout);
+          results.push_back (result);
+        }
+
+      freeBenchFrames (&frames);
+      if (bench_args.opencl)
+        releaseCL ();
+    }
+
+  if (bench_args.csv)
+    writeCSV (bench_args.csv, results);
+  if (bench_args.json)
+    writeJSON (bench_args.json, results);
+  if (bench_args.compare
+      && compareResults (bench_args.compare, results, bench_args.threshold))
+    return 1;
+  return 0;
+}
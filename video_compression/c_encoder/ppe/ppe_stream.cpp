@@ -0,0 +1,89 @@
+#include "stream_bin.h"
+#include "timer.h"
+
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const char *argp_program_version = "ppe-stream 0.1";
+static const char doc[]
+    = "ppe-stream -- transcode cencoder XML streams to a compact binary form "
+      "and back";
+static const char args_doc[] = "IN OUT\n--parse IN";
+
+typedef struct StreamArgs
+{
+  int decode;
+  int parse;
+  const char *in;
+  const char *out;
+} StreamArgs;
+
+static const struct argp_option argp_options[]
+    = { { "decode", 'd', 0, 0, "Convert a binary stream back to XML" },
+        { "parse", 'p', 0, 0,
+          "Only read IN, binary or XML, and report how long that takes" },
+        { 0 } };
+
+static error_t
+ParseOpt (int key, char *arg, struct argp_state *state)
+{
+  StreamArgs *args = (StreamArgs *)state->input;
+
+  switch (key)
+    {
+    case 'd':
+      args->decode = 1;
+      break;
+    case 'p':
+      args->parse = 1;
+      break;
+    case ARGP_KEY_ARG:
+      if (state->arg_num == 0)
+        args->in = arg;
+      else if (state->arg_num == 1)
+        args->out = arg;
+      else
+        argp_usage (state);
+      break;
+    case ARGP_KEY_END:
+      if (state->arg_num < (args->parse ? 1u : 2u)
+          || (args->parse && state->arg_num > 1))
+        argp_usage (state);
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+static struct argp argp = { argp_options, ParseOpt, args_doc, doc };
+
+int
+main (int argc, char *argv[])
+{
+  StreamArgs args = { 0, 0, 0, 0 };
+  argp_parse (&argp, argc, argv, 0, 0, &args);
+
+  StreamBinStats stats;
+  START_TIMER (transcode_timer);
+  if (args.parse)
+    {
+      stream_parse (args.in, &stats);
+      END_TIMER (transcode_timer);
+      printf ("%zu frames, %zu blocks: %zu bytes parsed in %g seconds\n",
+              stats.frames, stats.blocks, stats.in_bytes, transcode_timer);
+      return 0;
+    }
+  if (args.decode)
+    stream_bin2xml (args.in, args.out, &stats);
+  else
+    stream_xml2bin (args.in, args.out, &stats);
+  END_TIMER (transcode_timer);
+
+  printf ("%zu frames, %zu blocks: %zu -> %zu bytes (%.1fx) in %g seconds\n",
+          stats.frames, stats.blocks, stats.in_bytes, stats.out_bytes,
+          stats.out_bytes ? (double)stats.in_bytes / stats.out_bytes : 0.0,
+          transcode_timer);
+  return 0;
+}
@@ -0,0 +1,170 @@
+#include "roofline.h"
+
+#include "config.h"
+#include <algorithm>
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Operations per element of the reference kernels
+// RGB to YCbCr: 3 multiplies and 2 adds per channel plus the two offsets
+#define CONVERT_OPS 17
+// Two passes of a 3-tap filter, 3 multiplies and 2 adds each
+#define LOWPASS_OPS 10
+// Per pixel, channel and candidate: subtract and abs; then the weighted sum
+// of the three channels and the accumulation
+#define SAD_OPS (3 * 2 + 5 + 1)
+// Level shift, then Chen's flowgraph, 50 operations for 8 samples, along
+// rows and columns
+#define DCT_OPS (1 + 2 * 50.0 / 8)
+// Divide by the quantisation step and round
+#define QUANT_OPS 2
+// Compare with zero
+#define ENCODE_OPS 1
+
+static double peak_gflops = 0;
+// Bandwidth roofs, slowest first
+static vector<pair<string, double> > bandwidth;
+
+void
+loadRoofline (const char *path, FILE *log)
+{
+  FILE *fp = fopen (path, "r");
+  if (!fp)
+    error (EXIT_FAILURE, errno, "--roofline: %s", path);
+
+  char line[256];
+  int number = 0;
+  while (fgets (line, sizeof (line), fp))
+    {
+      ++number;
+      char *hash = strchr (line, '#');
+      if (hash)
+        *hash = 0;
+      char name[64], rest[2];
+      double value;
+      int n = sscanf (line, "%63s %lf %1s", name, &value, rest);
+      if (n <= 0)
+        continue;
+      size_t len = strlen (name);
+      if (n != 2 || value <= 0)
+        error (EXIT_FAILURE, 0, "%s:%d: expected name and positive value",
+               path, number);
+      if (!strcmp (name, "peak_gflops"))
+        peak_gflops = value;
+      else if (len > 4 && !strcmp (name + len - 4, "_gbs"))
+        bandwidth.push_back (make_pair (string (name, len - 4), value));
+      else
+        error (EXIT_FAILURE, 0, "%s:%d: unknown ceiling '%s'", path, number,
+               name);
+    }
+  fclose (fp);
+
+  if (peak_gflops <= 0 || bandwidth.empty ())
+    error (EXIT_FAILURE, 0, "%s: needs peak_gflops and a LEVEL_gbs", path);
+  sort (bandwidth.begin (), bandwidth.end (),
+        [] (const pair<string, double> &a, const pair<string, double> &b) {
+          return a.second < b.second;
+        });
+
+  fprintf (log, "Roofline: peak %g GFLOP/s", peak_gflops);
+  for (size_t i = 0; i < bandwidth.size (); ++i)
+    fprintf (log, ", %s %g GB/s", bandwidth[i].first.c_str (),
+             bandwidth[i].second);
+  fprintf (log, ", ridge at %.2f flop/B\n", peak_gflops / bandwidth[0].second);
+}
+
+void
+frameWork (int width, int height, int is_p_frame, int pad,
+           StageWork work[10])
+{
+  const double f = sizeof (float);
+  double n = (double)width * height;
+  // Samples after downsampling: Y and the two quarter size chroma planes
+  double p = 1.5 * n;
+
+  // Macroblocks and candidates as motionVectorSearch visits them, in the
+  // frame padded by pad
+  int inset = max (WINDOW_SIZE, BLOCK_SIZE) - pad;
+  double blocks
+      = (double)max (0, (width - 2 * inset - WINDOW_SIZE) / BLOCK_SIZE + 1)
+        * max (0, (height - 2 * inset - WINDOW_SIZE) / BLOCK_SIZE + 1);
+  double block_pixels = blocks * BLOCK_SIZE * BLOCK_SIZE;
+  double candidates = 4.0 * WINDOW_SIZE * WINDOW_SIZE;
+
+  memset (work, 0, 10 * sizeof (StageWork));
+  // Three planes in, three out
+  work[0].bytes = 6 * n * f;
+  work[0].ops = CONVERT_OPS * n;
+  // Filter Cb and Cr, then copy Y, Cb and Cr into the frame
+  work[1].bytes = (2 * 2 + 3 * 2) * n * f;
+  work[1].ops = LOWPASS_OPS * 2 * n;
+  if (is_p_frame)
+    {
+      // Both frames read once; the search windows overlap and stay cached
+      work[2].bytes = 2 * 3 * n * f;
+      work[2].ops = SAD_OPS * block_pixels * candidates;
+      // Copy of the P frame, then the reference subtracted per block
+      work[3].bytes = (3 * 2 * n + 3 * 3 * block_pixels) * f;
+      work[3].ops = 3 * block_pixels;
+    }
+  // Copy Y; pick every other sample of every other row of Cb and Cr, then
+  // copy them into the frame
+  work[4].bytes = (2 * n + 2 * 3 * n / 4) * f;
+  work[5].bytes = 2 * p * f;
+  work[5].ops = DCT_OPS * p;
+  work[6].bytes = 2 * p * f;
+  work[6].ops = QUANT_OPS * p;
+  work[7].bytes = 2 * p / 64 * f;
+  work[7].ops = p / 64;
+  work[8].bytes = 2 * p * f;
+  // Zig-zag coefficients in, one string pointer per coefficient out at worst
+  work[9].bytes = p * f + p * sizeof (void *);
+  work[9].ops = ENCODE_OPS * p;
+}
+
+void
+stageWorkAdd (StageWork *sum, const StageWork *work)
+{
+  sum->bytes += work->bytes;
+  sum->ops += work->ops;
+}
+
+string
+formatRoofline (const StageWork *work, double ms)
+{
+  if (work->bytes <= 0 || ms <= 0 || bandwidth.empty ())
+    return "";
+
+  double gbs = work->bytes / (ms * 1e6);
+  double gflops = work->ops / (ms * 1e6);
+  double intensity = work->ops / work->bytes;
+  char buf[192];
+  int len = snprintf (buf, sizeof (buf),
+                      "%.2f GB/s  %.2f GFLOP/s  %.3f flop/B  ", gbs, gflops,
+                      intensity);
+
+  if (intensity * bandwidth[0].second < peak_gflops)
+    {
+      // Memory bound: against the slowest level that is still above the
+      // achieved bandwidth, which is where the data comes from at best
+      size_t level = 0;
+      while (level + 1 < bandwidth.size ()
+             && gbs > bandwidth[level].second)
+        ++level;
+      snprintf (buf + len, sizeof (buf) - len,
+                "memory bound, %.0f%% of the %s roof",
+                100 * gbs / bandwidth[level].second,
+                bandwidth[level].first.c_str ());
+    }
+  else
+    snprintf (buf + len, sizeof (buf) - len,
+              "compute bound, %.0f%% of the compute roof",
+              100 * gflops / peak_gflops);
+  return buf;
+}
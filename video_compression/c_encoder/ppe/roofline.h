@@ -0,0 +1,39 @@
+#ifndef roofline_h
+#define roofline_h
+
+#include <stdio.h>
+#include <string>
+
+// Roofline view of the encoder stages with --roofline: the memory traffic
+// and arithmetic of every stage, from the formulas of the reference
+// kernels, against the ceilings of the machine.
+
+// Work of one stage on one frame
+typedef struct StageWork
+{
+  // Compulsory traffic: every input element read and every output element
+  // written once, as if the caches held everything else
+  double bytes;
+  // Arithmetic operations, integer and floating-point
+  double ops;
+} StageWork;
+
+// Read the machine ceilings from path: lines of "name value", peak_gflops
+// for the compute roof and one or more LEVEL_gbs (dram_gbs, l3_gbs, ...)
+// for the bandwidth roofs, with # comments.  Exits on a bad file.
+void loadRoofline (const char *path, FILE *log);
+
+// Work of the ten stages of encode() on a width x height frame, with motion
+// search and delta on frames padded by pad; those two only have work on P
+// frames
+void frameWork (int width, int height, int is_p_frame, int pad,
+                StageWork work[10]);
+
+void stageWorkAdd (StageWork *sum, const StageWork *work);
+
+// One line summary of work done in ms milliseconds: GB/s, GFLOP/s and
+// arithmetic intensity, the roof that bounds the stage and how close to it
+// the stage runs
+std::string formatRoofline (const StageWork *work, double ms);
+
+#endif
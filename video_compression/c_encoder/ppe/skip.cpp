@@ -0,0 +1,201 @@
+#include "skip.h"
+
+#include "config.h"
+#include <error.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+void
+initSkip (SkipParams *params, const char *spec)
+{
+  params->max_motion = 0;
+  params->max_energy = 1;
+  if (!spec || !*spec)
+    return;
+
+  char *end;
+  params->max_motion = strtol (spec, &end, 10);
+  if (end == spec || params->max_motion < 0)
+    error (EXIT_FAILURE, 0, "bad motion limit in --skip=%s", spec);
+  if (*end == ',')
+    {
+      const char *energy = end + 1;
+      params->max_energy = strtof (energy, &end);
+      if (end == energy || params->max_energy < 0)
+        error (EXIT_FAILURE, 0, "bad energy limit in --skip=%s", spec);
+    }
+  if (*end)
+    error (EXIT_FAILURE, 0, "expected MV,ENERGY in --skip=%s", spec);
+}
+
+void
+decideSkip (const SkipParams *params, Frame *delta,
+            const vector<mVector> *motion_vectors, int pad, SkipMap *map)
+{
+  int width = delta->width;
+  int height = delta->height;
+  int window_size = WINDOW_SIZE;
+  int block_size = BLOCK_SIZE;
+  int inset = (int)max ((float)window_size, (float)block_size);
+
+  // The macroblocks motionVectorSearch visits in the padded frame, in the
+  // coordinates of delta
+  map->block_size = block_size;
+  map->n_rows = 0;
+  map->n_cols = 0;
+  for (int my = inset; my < height + 2 * pad - (inset + window_size) + 1;
+       my += block_size)
+    map->n_rows++;
+  for (int mx = inset; mx < width + 2 * pad - (inset + window_size) + 1;
+       mx += block_size)
+    map->n_cols++;
+  inset -= pad;
+  map->inset = inset;
+  map->skipped.assign (map->n_rows * map->n_cols, 0);
+  map->n_skipped = 0;
+
+  float *planes[] = { delta->Y->data, delta->Cb->data, delta->Cr->data };
+  for (int row = 0; row < map->n_rows; ++row)
+    for (int col = 0; col < map->n_cols; ++col)
+      {
+        int i = row * map->n_cols + col;
+        mVector v = (*motion_vectors)[i];
+        if (abs (v.a) > params->max_motion || abs (v.b) > params->max_motion)
+          continue;
+
+        int mx = inset + col * block_size;
+        int my = inset + row * block_size;
+        double energy = 0;
+        for (int c = 0; c < 3; c++)
+          for (int x = 0; x < block_size; x++)
+            {
+              const float *line = &planes[c][(mx + x) * width + my];
+              for (int y = 0; y < block_size; y++)
+                energy += line[y] * line[y];
+            }
+        if (energy > params->max_energy * 3 * block_size * block_size)
+          continue;
+
+        map->skipped[i] = 1;
+        map->n_skipped++;
+        for (int c = 0; c < 3; c++)
+          for (int x = 0; x < block_size; x++)
+            memset (&planes[c][(mx + x) * width + my], 0,
+                    block_size * sizeof (float));
+      }
+}
+
+// Whether the 8x8 block at (x, y) of a channel downsampled by scale lies in
+// a skipped macroblock
+static bool
+blockSkipped (const SkipMap *map, int scale, int x, int y)
+{
+  int fx = x * scale - map->inset;
+  int fy = y * scale - map->inset;
+  if (fx < 0 || fy < 0)
+    return false;
+  int col = fx / map->block_size;
+  int row = fy / map->block_size;
+  if (col >= map->n_cols || row >= map->n_rows)
+    return false;
+  return map->skipped[row * map->n_cols + col];
+}
+
+Frame *
+packCodedBlocks (Frame *downsampled, const SkipMap *map, CodedBlocks *coded)
+{
+  Channel *in[] = { downsampled->Y, downsampled->Cb, downsampled->Cr };
+  Channel *out[3];
+
+  for (int c = 0; c < 3; c++)
+    {
+      int width = in[c]->width;
+      int height = in[c]->height;
+      int scale = c ? 2 : 1;
+      vector<int> &ids = coded->ids[c];
+
+      // Blocks in the raster order of zigZagOrder, which numbers them
+      ids.clear ();
+      int id = 1;
+      for (int x = 0; x < height; x += 8)
+        for (int y = 0; y < width; y += 8, id++)
+          if (!blockSkipped (map, scale, x, y))
+            ids.push_back (id);
+
+      out[c] = new Channel (8, 8 * ids.size ());
+      int blocks_per_row = width / 8;
+      for (size_t k = 0; k < ids.size (); k++)
+        {
+          int x = (ids[k] - 1) / blocks_per_row * 8;
+          int y = (ids[k] - 1) % blocks_per_row * 8;
+          for (int i = 0; i < 8; i++)
+            memcpy (&out[c]->data[(8 * k + i) * 8],
+                    &in[c]->data[(x + i) * width + y], 8 * sizeof (float));
+        }
+    }
+  return new Frame (out[0], out[1], out[2]);
+}
+
+void
+unpackCodedBlocks (Frame *packed, const CodedBlocks *coded, Frame *quant)
+{
+  Channel *in[] = { packed->Y, packed->Cb, packed->Cr };
+  Channel *out[] = { quant->Y, quant->Cb, quant->Cr };
+
+  for (int c = 0; c < 3; c++)
+    {
+      int width = out[c]->width;
+      int height = out[c]->height;
+      int blocks_per_row = width / 8;
+      const vector<int> &ids = coded->ids[c];
+
+      memset (out[c]->data, 0, width * height * sizeof (float));
+      for (int x = 0; x < height; x += 8)
+        for (int y = 0; y < width; y += 8)
+          out[c]->data[x * width + y] = coded->skipped_dc;
+
+      for (size_t k = 0; k < ids.size (); k++)
+        {
+          int x = (ids[k] - 1) / blocks_per_row * 8;
+          int y = (ids[k] - 1) % blocks_per_row * 8;
+          for (int i = 0; i < 8; i++)
+            memcpy (&out[c]->data[(x + i) * width + y],
+                    &in[c]->data[(8 * k + i) * 8], 8 * sizeof (float));
+        }
+    }
+}
+
+float
+skippedDC (ChannelFn dct, ChannelFn quant)
+{
+  Channel zero (8, 8);
+  Channel transformed (8, 8);
+  Channel quantised (8, 8);
+  memset (zero.data, 0, 64 * sizeof (float));
+  dct (&zero, &transformed);
+  quant (&transformed, &quantised);
+  return quantised.data[0];
+}
+
+string
+skipRuns (const SkipMap *map)
+{
+  string runs = "[ ";
+  int run = 0;
+  uint8_t state = 0;
+  for (uint8_t s : map->skipped)
+    {
+      if (s != state)
+        {
+          runs += to_string (run) + " ";
+          state = s;
+          run = 0;
+        }
+      run++;
+    }
+  runs += to_string (run) + "]";
+  return runs;
+}
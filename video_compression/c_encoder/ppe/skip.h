@@ -0,0 +1,72 @@
+#ifndef SKIP_H
+#define SKIP_H
+
+#include "custom_types.h"
+#include "stages.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Skipped macroblocks of P frames.  A macroblock whose motion vector and
+// residual are both small is coded as its prediction alone: its residual is
+// taken as zero, its 8x8 blocks (four of Y, one each of Cb and Cr) leave
+// the transform path, and the stream carries no <B> for them.
+
+typedef struct SkipParams
+{
+  // Largest |a| and |b| of the motion vector of a skipped macroblock
+  int max_motion;
+  // Largest mean squared residual over Y, Cb and Cr
+  float max_energy;
+} SkipParams;
+
+// The decision for every macroblock of a P frame, in the order of its
+// motion vectors: n_rows runs of n_cols blocks along mx
+typedef struct SkipMap
+{
+  int inset;
+  int block_size;
+  int n_rows;
+  int n_cols;
+  std::vector<uint8_t> skipped;
+  int n_skipped;
+} SkipMap;
+
+// The 8x8 blocks of each channel that are coded: the 1-based stream id of
+// each, in order, and the quantised DC a skipped block takes
+typedef struct CodedBlocks
+{
+  std::vector<int> ids[3];
+  float skipped_dc;
+} CodedBlocks;
+
+// Parse spec, "MV,ENERGY" or "MV" or empty for the defaults 0 and 1;
+// exits on a bad spec
+void initSkip (SkipParams *params, const char *spec);
+
+// Decide which macroblocks of the P frame with residual delta and the given
+// motion vectors, searched on frames padded by pad, to skip, and zero their
+// residual in delta
+void decideSkip (const SkipParams *params, Frame *delta,
+                 const std::vector<mVector> *motion_vectors, int pad,
+                 SkipMap *map);
+
+// The coded 8x8 blocks of the downsampled frame, stacked into channels 8
+// wide in stream order, with their ids in coded
+Frame *packCodedBlocks (Frame *downsampled, const SkipMap *map,
+                        CodedBlocks *coded);
+
+// Scatter the quantised coded blocks back into a frame of the downsampled
+// layout, with skipped blocks set to coded->skipped_dc and zero AC
+void unpackCodedBlocks (Frame *packed, const CodedBlocks *coded,
+                        Frame *quant);
+
+// The quantised DC of a block of zero residual after dct and quant
+float skippedDC (ChannelFn dct, ChannelFn quant);
+
+// "[ r0 r1 ...]": runs of coded and skipped macroblocks, alternately,
+// starting with a coded run that may be 0
+std::string skipRuns (const SkipMap *map);
+
+#endif
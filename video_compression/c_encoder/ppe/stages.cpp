@@ -0,0 +1,1712 @@
+#include "stages.h"
+
+#include "cmd_args.h"
+#include "config.h"
+#include "dct8x8_block.h"
+#include "opt_openacc.h"
+#include "opt_opencl.h"
+#include "opt_simd.h"
+#include "trace.h"
+#include <algorithm>
+#include <math.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+void
+convertOMP (size_t size, const float *R, const float *G, const float *B,
+            float *Y, float *Cb, float *Cr)
+{
+#pragma omp parallel for
+  for (int i = 0; i < size; ++i)
+    {
+      float r = R[i];
+      float g = G[i];
+      float b = B[i];
+      float y = 0 + (0.299f * r) + (0.587f * g) + (0.113f * b);
+      float cb = 128 - (0.168736f * r) - (0.331264f * g) + (0.5f * b);
+      float cr = 128 + (0.5f * r) - (0.418688f * g) - (0.081312f * b);
+      Y[i] = y;
+      Cb[i] = cb;
+      Cr[i] = cr;
+    }
+}
+
+void
+convertRGBtoYCbCr (Image *in, Image *out)
+{
+  int size = in->width * in->height;
+  const float *R = in->rc->data;
+  const float *G = in->gc->data;
+  const float *B = in->bc->data;
+  float *Y = out->rc->data;
+  float *Cb = out->gc->data;
+  float *Cr = out->bc->data;
+
+  for (int i = 0; i < size; ++i)
+    {
+      float r = R[i];
+      float g = G[i];
+      float b = B[i];
+      float y = 0 + (0.299f * r) + (0.587f * g) + (0.113f * b);
+      float cb = 128 - (0.168736f * r) - (0.331264f * g) + (0.5f * b);
+      float cr = 128 + (0.5f * r) - (0.418688f * g) - (0.081312f * b);
+      Y[i] = y;
+      Cb[i] = cb;
+      Cr[i] = cr;
+    }
+}
+
+void
+convertRGBtoYCbCrOMP (Image *in, Image *out)
+{
+  convertOMP (in->width * in->height, in->rc->data, in->gc->data,
+              in->bc->data, out->rc->data, out->gc->data, out->bc->data);
+}
+
+void
+convertRGBtoYCbCrACC (Image *in, Image *out)
+{
+  convertACC (in->width * in->height, in->rc->data, in->gc->data,
+              in->bc->data, out->rc->data, out->gc->data, out->bc->data);
+}
+
+void
+convertRGBtoYCbCrCL (Image *in, Image *out)
+{
+  size_t size = in->width * in->height;
+  size_t per_item = args.cl_per_item ? args.cl_per_item : 4;
+
+  convertCL (size, in->rc->data, in->gc->data, in->bc->data, out->rc->data,
+             out->gc->data, out->bc->data, per_item);
+}
+
+// Split [0, n) evenly between the threads of the enclosing parallel region
+static void
+threadRange (int n, int *begin, int *end)
+{
+  int chunk = (n + omp_get_num_threads () - 1) / omp_get_num_threads ();
+  *begin = std::min (n, omp_get_thread_num () * chunk);
+  *end = std::min (n, *begin + chunk);
+}
+
+void
+convertSIMD (Image *in, Image *out)
+{
+  int size = in->width * in->height;
+
+#pragma omp parallel
+  {
+    TraceSpan span ("convertSIMD");
+    int begin, end;
+    threadRange (size, &begin, &end);
+    simd.convert (end - begin, in->rc->data + begin, in->gc->data + begin,
+                  in->bc->data + begin, out->rc->data + begin,
+                  out->gc->data + begin, out->bc->data + begin);
+  }
+}
+
+Channel *
+lowPass (Channel *in, Channel *out)
+{
+  // Applies a simple 3-tap low-pass filter in the X- and Y- dimensions.
+  // E.g., blur
+  // weights for neighboring pixels
+  const float a = 0.25;
+  const float b = 0.5;
+  const float c = 0.25;
+
+  int width = in->width;
+  int height = in->height;
+
+  for (int col = 0; col < width; ++col)
+    {
+      out->data[col] = in->data[col];
+      out->data[(height - 1) * width + col] = in->data[(height - 1) * width + col];
+    }
+  for (int row = 1; row < height - 1; ++row)
+    {
+      out->data[row * width] = in->data[row * width];
+      out->data[row * width + width - 1] = in->data[row * width + width - 1];
+    }
+
+  for (int row = 1; row < height - 1; row++)
+    for (int col = 1; col < width - 1; col++)
+      {
+        out->data[row * width + col]
+            = a * in->data[(row - 1) * width + col]
+              + b * in->data[row * width + col]
+              + c * in->data[(row + 1) * width + col];
+      }
+
+  for (int row = 1; row < (height - 1); row++)
+    for (int col = 1; col < (width - 1); col++)
+      {
+        out->data[row * width + col]
+            = a * out->data[row * width + (col - 1)]
+              + b * out->data[row * width + col]
+              + c * out->data[row * width + (col + 1)];
+      }
+
+  return out;
+}
+
+Channel *
+lowPassOMP (Channel *in, Channel *out)
+{
+  // Applies a simple 3-tap low-pass filter in the X- and Y- dimensions.
+  // E.g., blur
+  // weights for neighboring pixels
+  const float a = 0.25;
+  const float b = 0.5;
+  const float c = 0.25;
+
+  int width = in->width;
+  int height = in->height;
+
+  int edge_rows[] = { 0, height - 1 };
+  int edge_cols[] = { 0, width - 1 };
+
+  for (int i = 0; i < 2; ++i)
+    {
+      int row = edge_rows[i];
+      for (int col = 0; col < width; ++col)
+        {
+          out->data[row * width + col] = in->data[row * width + col];
+        }
+    }
+
+  for (int i = 0; i < 2; ++i)
+    {
+      int col = edge_cols[i];
+      for (int row = 1; row < height - 1; ++row)
+        {
+          out->data[row * width + col] = in->data[row * width + col];
+        }
+    }
+
+#pragma omp parallel
+  {
+    TraceSpan span ("lowPassOMP");
+    int columns_per_thread
+        = (width + omp_get_num_threads () - 1) / omp_get_num_threads ();
+    int col_begin = 1 + omp_get_thread_num () * columns_per_thread;
+    int col_end = col_begin + columns_per_thread;
+
+    for (int row = 1; row < height - 1; row++)
+      for (int col = col_begin; col < std::min (col_end, width - 1); col++)
+        {
+          out->data[row * width + col]
+              = a * in->data[(row - 1) * width + col]
+                + b * in->data[row * width + col]
+                + c * in->data[(row + 1) * width + col];
+        }
+  }
+
+#pragma omp parallel for
+  for (int row = 1; row < (height - 1); row++)
+    for (int col = 1; col < (width - 1); col++)
+      {
+        out->data[row * width + col]
+            = a * out->data[row * width + (col - 1)]
+              + b * out->data[row * width + col]
+              + c * out->data[row * width + (col + 1)];
+      }
+
+  return out;
+}
+
+Channel *
+lowPassSIMD (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  memcpy (out->data, in->data, width * sizeof (float));
+  memcpy (&out->data[(height - 1) * width], &in->data[(height - 1) * width],
+          width * sizeof (float));
+  for (int row = 1; row < height - 1; ++row)
+    {
+      out->data[row * width] = in->data[row * width];
+      out->data[row * width + width - 1] = in->data[row * width + width - 1];
+    }
+
+#pragma omp parallel
+  {
+    TraceSpan span ("lowPassSIMD");
+    int begin, end;
+    threadRange (height - 2, &begin, &end);
+    simd.lowPassV (in->data, out->data, width, 1 + begin, 1 + end);
+    simd.lowPassH (out->data, width, 1 + begin, 1 + end);
+  }
+
+  return out;
+}
+
+// The frames the last OpenCL search left on the device, and the kept
+// reference whose copy there is the residual computeDeltaCL left behind
+static Frame *cl_source = NULL;
+static Frame *cl_match = NULL;
+static Frame *cl_reference = NULL;
+
+std::vector<mVector> *
+motionVectorSearchCL (Frame *source, Frame *match, int width, int height)
+{
+  const float *s[] = { source->Y->data, source->Cb->data, source->Cr->data };
+  const float *m[] = { match->Y->data, match->Cb->data, match->Cr->data };
+  size_t size[] = { (size_t)width, (size_t)height };
+  int block_size = 16;
+  size_t motion_vector_size
+      = (width / block_size - 2) * (height / block_size - 2);
+  std::vector<mVector> *motion_vectors
+      = new std::vector<mVector> (motion_vector_size);
+  motionCL (size, block_size, s, m, source == cl_reference,
+            (int *)motion_vectors->data ());
+  cl_source = source;
+  cl_match = match;
+  return motion_vectors;
+}
+
+std::vector<mVector> *
+motionVectorSearch (Frame *source, Frame *match, int width, int height)
+{
+  std::vector<mVector> *motion_vectors
+      = new std::vector<mVector> (); // empty list of ints
+
+  float Y_weight = 0.5;
+  float Cr_weight = 0.25;
+  float Cb_weight = 0.25;
+
+  // Window size is how much on each side of the block we search
+  int window_size = 16;
+  int block_size = 16;
+
+  // How far from the edge we can go since we don't special case the edges
+  int inset = (int)max ((float)window_size, (float)block_size);
+  int iter = 0;
+
+  for (int my = inset; my < height - (inset + window_size) + 1;
+       my += block_size)
+    {
+      for (int mx = inset; mx < width - (inset + window_size) + 1;
+           mx += block_size)
+        {
+          float best_match_sad = 1e10;
+          int best_match_location[2] = { 0, 0 };
+
+          for (int sy = my - window_size; sy < my + window_size; sy++)
+            {
+              for (int sx = mx - window_size; sx < mx + window_size; sx++)
+                {
+                  float current_match_sad = 0;
+                  // Do the SAD
+                  for (int y = 0; y < block_size; y++)
+                    {
+                      for (int x = 0; x < block_size; x++)
+                        {
+                          int match_x = mx + x;
+                          int match_y = my + y;
+                          int search_x = sx + x;
+                          int search_y = sy + y;
+                          float diff_Y = abs (
+                              match->Y->data[match_x * width + match_y]
+                              - source->Y->data[search_x * width + search_y]);
+                          float diff_Cb = abs (
+                              match->Cb->data[match_x * width + match_y]
+                              - source->Cb->data[search_x * width + search_y]);
+                          float diff_Cr = abs (
+                              match->Cr->data[match_x * width + match_y]
+                              - source->Cr->data[search_x * width + search_y]);
+
+                          float diff_total = Y_weight * diff_Y
+                                             + Cb_weight * diff_Cb
+                                             + Cr_weight * diff_Cr;
+                          current_match_sad = current_match_sad + diff_total;
+                        }
+                    } // end SAD
+
+                  if (current_match_sad < best_match_sad)
+                    {
+                      best_match_sad = current_match_sad;
+                      best_match_location[0] = sx - mx;
+                      best_match_location[1] = sy - my;
+                    }
+                }
+            }
+
+          mVector v;
+          v.a = best_match_location[0];
+          v.b = best_match_location[1];
+          motion_vectors->push_back (v);
+        }
+    }
+  return motion_vectors;
+}
+
+// Bytes of the source and match bands of a thread; a tile of macroblocks
+// along mx is as long as keeps them in L2
+#define MOTION_BAND_BYTES (256 << 10)
+
+// The part of a frame that one run of macroblocks at my searches, for the
+// lines [x0, x0 + lines) of a tile along mx: in each line the span
+// pixels from column my - window on, three planes.  Each line is a ring of
+// two copies of span columns, frame column y kept at y % span and
+// y % span + span, so that the band of any run is the span contiguous
+// columns from offset on, and moving on by a block writes only the new
+// block columns, without shifting the others.
+typedef struct MotionBand
+{
+  int span;
+  int stride;
+  int lines;
+  // First frame line held, and the column of the band held, or -1
+  int x0;
+  int y0;
+  int offset;
+  std::vector<float> plane[3];
+  float *data[3];
+} MotionBand;
+
+static void
+initMotionBand (MotionBand *band, int lines, int span)
+{
+  band->span = span;
+  band->stride = 2 * span;
+  band->lines = lines;
+  band->x0 = -1;
+  band->y0 = -1;
+  band->offset = 0;
+  for (int c = 0; c < 3; c++)
+    {
+      band->plane[c].resize ((size_t)lines * band->stride);
+      band->data[c] = band->plane[c].data ();
+    }
+}
+
+// Copy columns [y, y + n) of lines [x0, x0 + band->lines) of the frame
+// planes into both copies of the ring
+static void
+storeMotionBand (MotionBand *band, const float *const frame[3], int width,
+                 int y, int n)
+{
+  for (int c = 0; c < 3; c++)
+    for (int x = 0; x < band->lines; x++)
+      {
+        const float *src = &frame[c][(size_t)(band->x0 + x) * width + y];
+        float *line = &band->data[c][x * band->stride];
+        for (int j = 0; j < n;)
+          {
+            int p = (y + j) % band->span;
+            int len = std::min (n - j, band->span - p);
+            memcpy (line + p, src + j, len * sizeof (float));
+            memcpy (line + p + band->span, src + j, len * sizeof (float));
+            j += len;
+          }
+      }
+}
+
+// Move band on to the span columns from y0 of lines from x0.  When it held
+// the same lines up to step columns before, only the step new columns are
+// read from the frame, so a thread walking down consecutive runs of a tile
+// reads each pixel of it once.
+static void
+slideMotionBand (MotionBand *band, const float *const frame[3], int width,
+                 int x0, int y0, int step)
+{
+  if (band->x0 == x0 && band->y0 == y0 - step)
+    storeMotionBand (band, frame, width, y0 + band->span - step, step);
+  else
+    {
+      band->x0 = x0;
+      storeMotionBand (band, frame, width, y0, band->span);
+    }
+  band->y0 = y0;
+  band->offset = y0 % band->span;
+}
+
+// The block columns from my of lines [x0, x0 + lines), block wide
+static void
+loadMatchBand (std::vector<float> plane[3], const float *const frame[3],
+               int width, int x0, int lines, int my, int block)
+{
+  for (int c = 0; c < 3; c++)
+    for (int x = 0; x < lines; x++)
+      memcpy (&plane[c][x * block], &frame[c][(size_t)(x0 + x) * width + my],
+              block * sizeof (float));
+}
+
+// A spare delta frame, handed back by releaseDeltaFrame for the next fused
+// search to fill
+static Frame *delta_pool = NULL;
+
+// The residual the last fused search wrote, and what it was searched with
+static Frame *fused_delta = NULL;
+static Frame *fused_source = NULL;
+static Frame *fused_match = NULL;
+static std::vector<mVector> fused_vectors;
+
+static Frame *
+takeDeltaFrame (int width, int height)
+{
+  Frame *f = delta_pool;
+  delta_pool = NULL;
+  if (f && (f->width != width || f->height != height || f->type != FULLSIZE))
+    {
+      delete f;
+      f = NULL;
+    }
+  return f ? f : new Frame (width, height, FULLSIZE);
+}
+
+void
+releaseDeltaFrame (Frame *frame)
+{
+  delete delta_pool;
+  delta_pool = frame;
+}
+
+// Copy the pixels of match that no macroblock covers into delta, as the
+// copy of the P frame computeDelta starts from leaves them
+static void
+copyUncovered (Frame *delta, Frame *match, int width, int x_begin,
+               int x_end, int y_begin, int y_end)
+{
+  Channel *d[] = { delta->Y, delta->Cb, delta->Cr };
+  Channel *m[] = { match->Y, match->Cb, match->Cr };
+  for (int c = 0; c < 3; c++)
+    for (int x = 0; x < width; x++)
+      {
+        float *dst = &d[c]->data[x * width];
+        const float *src = &m[c]->data[x * width];
+        if (x < x_begin || x >= x_end)
+          {
+            memcpy (dst, src, width * sizeof (float));
+            continue;
+          }
+        memcpy (dst, src, y_begin * sizeof (float));
+        memcpy (dst + y_end, src + y_end, (width - y_end) * sizeof (float));
+      }
+}
+
+// The SAD kernel searched against a band of the source frame per run of
+// macroblocks.  Runs are cut into tiles along mx, short enough for the
+// bands of a tile to stay in L2, and a thread walks down the runs of a
+// tile, sliding its band.  The match blocks of a run of the tile are
+// packed block wide.  With a delta frame, the residual of each block
+// against its best match is written as soon as the block is searched, from
+// the bands in cache, the same way computeDelta subtracts it.
+static std::vector<mVector> *
+motionSearchBand (Frame *source, Frame *match, int width, int height,
+                  Frame *delta)
+{
+  int window_size = 16;
+  int block_size = 16;
+  int inset = (int)max ((float)window_size, (float)block_size);
+
+  // Macroblocks in the order motionVectorSearch visits them: n_rows runs of
+  // n_cols blocks along mx
+  int n_rows = 0, n_cols = 0;
+  for (int my = inset; my < height - (inset + window_size) + 1;
+       my += block_size)
+    ++n_rows;
+  for (int mx = inset; mx < width - (inset + window_size) + 1;
+       mx += block_size)
+    ++n_cols;
+
+  const float *const s[] = { source->Y->data, source->Cb->data,
+                             source->Cr->data };
+  const float *const m[] = { match->Y->data, match->Cb->data,
+                             match->Cr->data };
+  int n_candidates = 2 * window_size;
+  std::vector<mVector> *motion_vectors
+      = new std::vector<mVector> (n_rows * n_cols);
+
+  // Blocks per tile, so that the source band, 2 * span wide over the tile
+  // and its window either side, and the match band fit MOTION_BAND_BYTES
+  int span = 2 * window_size + block_size;
+  size_t line_bytes = 3 * sizeof (float) * (2 * span + block_size);
+  int tile = (MOTION_BAND_BYTES / line_bytes - 2 * window_size) / block_size;
+  tile = std::max (1, std::min (tile, n_cols));
+  int n_tiles = (n_cols + tile - 1) / tile;
+
+  // Tiles alone may not give every thread work: cut their runs into
+  // chunks, which a static schedule hands out in order, so that a thread
+  // mostly goes on down the same tile
+  int n_chunks = (4 * omp_get_max_threads () + n_tiles - 1) / n_tiles;
+  n_chunks = std::max (1, std::min (n_chunks, n_rows));
+  int chunk = (n_rows + n_chunks - 1) / n_chunks;
+
+#pragma omp parallel
+  {
+    TraceSpan span_trace (delta ? "motionVectorSearchFused"
+                                : "motionVectorSearchSIMD");
+    std::vector<float> sad (n_candidates * n_candidates);
+    MotionBand source_band;
+    initMotionBand (&source_band, tile * block_size + 2 * window_size, span);
+    std::vector<float> match_band[3];
+    for (int c = 0; c < 3; c++)
+      match_band[c].resize (tile * block_size * block_size);
+
+#pragma omp for schedule(static)
+    for (int task = 0; task < n_tiles * n_chunks; ++task)
+      {
+        int col_begin = task / n_chunks * tile;
+        int col_end = std::min (n_cols, col_begin + tile);
+        int x0 = inset + col_begin * block_size;
+        int lines = (col_end - col_begin) * block_size;
+        int row_end = std::min (n_rows, (task % n_chunks + 1) * chunk);
+        source_band.lines = lines + 2 * window_size;
+
+        for (int row = task % n_chunks * chunk; row < row_end; ++row)
+          {
+            int my = inset + row * block_size;
+            slideMotionBand (&source_band, s, width, x0 - window_size,
+                             my - window_size, block_size);
+            loadMatchBand (match_band, m, width, x0, lines, my, block_size);
+
+            int stride = source_band.stride;
+            for (int col = col_begin; col < col_end; ++col)
+              {
+                int mx = inset + col * block_size;
+                // Rows from x0 in the match band, from x0 - window in the
+                // source band
+                int bx = mx - x0;
+                const float *mb[3], *sb[3];
+                for (int c = 0; c < 3; c++)
+                  {
+                    mb[c] = &match_band[c][bx * block_size];
+                    sb[c] = &source_band.data[c][bx * stride
+                                                 + source_band.offset];
+                  }
+                simd.sad (mb, block_size, sb, stride, window_size,
+                          block_size, sad.data ());
+
+                // Same scan order and strict comparison as
+                // motionVectorSearch, so ties resolve identically
+                float best_match_sad = 1e10;
+                mVector best = { 0, 0 };
+                for (int sy = 0; sy < n_candidates; sy++)
+                  for (int sx = 0; sx < n_candidates; sx++)
+                    if (sad[sy * n_candidates + sx] < best_match_sad)
+                      {
+                        best_match_sad = sad[sy * n_candidates + sx];
+                        best.a = sx - window_size;
+                        best.b = sy - window_size;
+                      }
+                (*motion_vectors)[row * n_cols + col] = best;
+
+                if (!delta)
+                  continue;
+                float *d[] = { delta->Y->data, delta->Cb->data,
+                               delta->Cr->data };
+                for (int c = 0; c < 3; c++)
+                  for (int x = 0; x < block_size; x++)
+                    {
+                      const float *p = &mb[c][x * block_size];
+                      const float *i
+                          = &sb[c][(window_size + best.a + x) * stride
+                                   + window_size + best.b];
+                      float *out = &d[c][(mx + x) * width + my];
+                      for (int y = 0; y < block_size; y++)
+                        out[y] = p[y] - i[y];
+                    }
+              }
+          }
+      }
+  }
+
+  if (delta)
+    copyUncovered (delta, match, width, inset, inset + n_cols * block_size,
+                   inset, inset + n_rows * block_size);
+  return motion_vectors;
+}
+
+std::vector<mVector> *
+motionVectorSearchSIMD (Frame *source, Frame *match, int width, int height)
+{
+  return motionSearchBand (source, match, width, height, NULL);
+}
+
+// motionVectorSearchSIMD that also leaves the residual for
+// computeDeltaFused
+std::vector<mVector> *
+motionVectorSearchFused (Frame *source, Frame *match, int width, int height)
+{
+  if (!fused_delta)
+    fused_delta = takeDeltaFrame (width, height);
+  std::vector<mVector> *motion_vectors
+      = motionSearchBand (source, match, width, height, fused_delta);
+  fused_source = source;
+  fused_match = match;
+  fused_vectors = *motion_vectors;
+  return motion_vectors;
+}
+
+// SAD of the match block, packed in m with Y, Cb and Cr interleaved in scan
+// order, against the candidate at (sx, sy), summed in the same
+// (y, x) order as motionVectorSearch.  Stops early once the partial sum
+// reaches best or exceeds bound.  Every term is non-negative, so the
+// partial sums never decrease and a candidate that stops early cannot end
+// below where it stopped.
+static float
+sadPDE (const float *m, const float *const s[3], int width, int sx, int sy,
+        int block_size, float best, float bound)
+{
+  const float Y_weight = 0.5;
+  const float Cr_weight = 0.25;
+  const float Cb_weight = 0.25;
+
+  float sad = 0;
+  for (int y = 0; y < block_size; y++)
+    {
+      for (int x = 0; x < block_size; x++)
+        {
+          int s_index = (sx + x) * width + sy + y;
+          const float *mp = &m[3 * (y * block_size + x)];
+          float diff_Y = fabsf (mp[0] - s[0][s_index]);
+          float diff_Cb = fabsf (mp[1] - s[1][s_index]);
+          float diff_Cr = fabsf (mp[2] - s[2][s_index]);
+          sad = sad
+                + (Y_weight * diff_Y + Cb_weight * diff_Cb
+                   + Cr_weight * diff_Cr);
+        }
+      if (sad >= best || sad > bound)
+        break;
+    }
+  return sad;
+}
+
+// Sums of Y, Cb and Cr over every block_size square whose corner lies in
+// the 2 * window square of candidates around (mx, my), indexed like the
+// sad kernel of opt_simd.h.  Built from a summed-area table of the search
+// area in double precision, so the sums are exact to far below the
+// rounding of a float SAD.
+static void
+candidateSums (const float *const s[3], int width, int mx, int my,
+               int window, int block, double *table, double *sums)
+{
+  int n = 2 * window;
+  int side = n + block;
+  for (int c = 0; c < 3; c++)
+    {
+      double *t = table;
+      for (int i = 0; i <= side; i++)
+        t[i] = 0;
+      for (int x = 0; x < side; x++)
+        {
+          const float *row = s[c] + (mx - window + x) * width + my - window;
+          double run = 0;
+          t[(x + 1) * (side + 1)] = 0;
+          for (int y = 0; y < side; y++)
+            {
+              run += row[y];
+              t[(x + 1) * (side + 1) + y + 1] = t[x * (side + 1) + y + 1] + run;
+            }
+        }
+      for (int x = 0; x < n; x++)
+        for (int y = 0; y < n; y++)
+          sums[3 * (y * n + x) + c]
+              = t[(x + block) * (side + 1) + y + block]
+                - t[x * (side + 1) + y + block]
+                - t[(x + block) * (side + 1) + y] + t[x * (side + 1) + y];
+    }
+}
+
+// Exact full search with partial distortion elimination: a candidate's SAD
+// is abandoned as soon as its partial sum shows it cannot replace the best
+// so far.  With eliminate, candidates are first tested against the
+// successive elimination bound
+//   Y_weight |sum(Y_m) - sum(Y_s)| + ... <= SAD
+// and skipped without touching their pixels when it rules them out.
+// Candidates that run to the end are summed exactly like
+// motionVectorSearch and compared in its scan order, so the vectors are
+// identical.
+static std::vector<mVector> *
+motionSearchExact (Frame *source, Frame *match, int width, int height,
+                   bool eliminate)
+{
+  const float Y_weight = 0.5;
+  const float Cr_weight = 0.25;
+  const float Cb_weight = 0.25;
+  int window_size = 16;
+  int block_size = 16;
+  int inset = (int)max ((float)window_size, (float)block_size);
+  int n_candidates = 2 * window_size;
+
+  // Macroblocks in the order motionVectorSearch visits them: n_rows runs of
+  // n_cols blocks along mx
+  int n_rows = 0, n_cols = 0;
+  for (int my = inset; my < height - (inset + window_size) + 1;
+       my += block_size)
+    ++n_rows;
+  for (int mx = inset; mx < width - (inset + window_size) + 1;
+       mx += block_size)
+    ++n_cols;
+
+  const float *const s[] = { source->Y->data, source->Cb->data,
+                             source->Cr->data };
+  const float *const m[] = { match->Y->data, match->Cb->data,
+                             match->Cr->data };
+  std::vector<mVector> *motion_vectors
+      = new std::vector<mVector> (n_rows * n_cols);
+
+#pragma omp parallel
+  {
+    TraceSpan span (eliminate ? "motionVectorSearchSEA"
+                              : "motionVectorSearchPDE");
+    // The match block, Y, Cb and Cr side by side in scan order, so the
+    // inner loop reads it contiguously
+    std::vector<float> packed (3 * block_size * block_size);
+    std::vector<double> table, sums;
+    if (eliminate)
+      {
+        int side = n_candidates + block_size;
+        table.resize ((side + 1) * (side + 1));
+        sums.resize (3 * n_candidates * n_candidates);
+      }
+
+    // A run at a time, so each block can start from its neighbour's vector
+#pragma omp for schedule(dynamic)
+    for (int row = 0; row < n_rows; ++row)
+      {
+        int my = inset + row * block_size;
+        mVector previous = { 0, 0 };
+        for (int col = 0; col < n_cols; ++col)
+          {
+            int mx = inset + col * block_size;
+            double match_sum[3] = { 0, 0, 0 };
+            for (int y = 0; y < block_size; y++)
+              for (int x = 0; x < block_size; x++)
+                for (int c = 0; c < 3; c++)
+                  {
+                    float v = m[c][(mx + x) * width + my + y];
+                    packed[3 * (y * block_size + x) + c] = v;
+                    match_sum[c] += v;
+                  }
+            if (eliminate)
+              candidateSums (s, width, mx, my, window_size, block_size,
+                             table.data (), sums.data ());
+
+            // The minimum is at most the SAD of the zero vector or of the
+            // vector found for the block before, so anything above either
+            // can be dropped.  Ties must still be measured in full, as the
+            // first one in scan order wins.
+            float bound = sadPDE (packed.data (), s, width, mx, my,
+                                  block_size, INFINITY, INFINITY);
+            if (previous.a || previous.b)
+              bound = min (bound, sadPDE (packed.data (), s, width,
+                                          mx + previous.a, my + previous.b,
+                                          block_size, INFINITY, INFINITY));
+
+            float best_match_sad = 1e10;
+            mVector best = { 0, 0 };
+            for (int sy = my - window_size; sy < my + window_size; sy++)
+              for (int sx = mx - window_size; sx < mx + window_size; sx++)
+                {
+                  if (eliminate)
+                    {
+                      const double *sum
+                          = &sums[3
+                                  * ((sy - my + window_size) * n_candidates
+                                     + sx - mx + window_size)];
+                      double lower = Y_weight * fabs (match_sum[0] - sum[0])
+                                     + Cb_weight * fabs (match_sum[1] - sum[1])
+                                     + Cr_weight * fabs (match_sum[2] - sum[2]);
+                      // Leave room for the rounding of the float SAD, a
+                      // relative error below 256 * 2^-24 for 16x16 blocks
+                      lower = lower * (1 - 1e-4) - 1e-3;
+                      if (lower >= best_match_sad || lower > bound)
+                        continue;
+                    }
+
+                  float sad = sadPDE (packed.data (), s, width, sx, sy,
+                                      block_size, best_match_sad, bound);
+                  if (sad < best_match_sad && sad <= bound)
+                    {
+                      best_match_sad = sad;
+                      best.a = sx - mx;
+                      best.b = sy - my;
+                    }
+                }
+            (*motion_vectors)[row * n_cols + col] = best;
+            previous = best;
+          }
+      }
+  }
+  return motion_vectors;
+}
+
+std::vector<mVector> *
+motionVectorSearchPDE (Frame *source, Frame *match, int width, int height)
+{
+  return motionSearchExact (source, match, width, height, false);
+}
+
+// Successive elimination on top of the PDE search, for low-texture content
+// where block sums tell most candidates apart
+std::vector<mVector> *
+motionVectorSearchSEA (Frame *source, Frame *match, int width, int height)
+{
+  return motionSearchExact (source, match, width, height, true);
+}
+
+Frame *
+computeDelta (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+              std::vector<mVector> *motion_vectors)
+{
+  Frame *delta = new Frame (p_frame_ycbcr);
+
+  int width = i_frame_ycbcr->width;
+  int height = i_frame_ycbcr->height;
+  int window_size = 16;
+  int block_size = 16;
+  // How far from the edge we can go since we don't special case the edges
+  int inset = (int)max ((float)window_size, (float)block_size);
+
+  int current_block = 0;
+  for (int my = inset; my < width - (inset + window_size) + 1;
+       my += block_size)
+    {
+      for (int mx = inset; mx < height - (inset + window_size) + 1;
+           mx += block_size)
+        {
+          int vector[2];
+          vector[0] = (int)motion_vectors->at (current_block).a;
+          vector[1] = (int)motion_vectors->at (current_block).b;
+
+          // copy the block
+          for (int y = 0; y < block_size; y++)
+            {
+              for (int x = 0; x < block_size; x++)
+                {
+
+                  int src_x = mx + vector[0] + x;
+                  int src_y = my + vector[1] + y;
+                  int dst_x = mx + x;
+                  int dst_y = my + y;
+                  delta->Y->data[dst_x * width + dst_y]
+                      = delta->Y->data[dst_x * width + dst_y]
+                        - i_frame_ycbcr->Y->data[src_x * width + src_y];
+                  delta->Cb->data[dst_x * width + dst_y]
+                      = delta->Cb->data[dst_x * width + dst_y]
+                        - i_frame_ycbcr->Cb->data[src_x * width + src_y];
+                  delta->Cr->data[dst_x * width + dst_y]
+                      = delta->Cr->data[dst_x * width + dst_y]
+                        - i_frame_ycbcr->Cr->data[src_x * width + src_y];
+                }
+            }
+
+          current_block = current_block + 1;
+        }
+    }
+  return delta;
+}
+
+// computeDelta with the block copy walked along rows, so the inner loop is
+// contiguous in memory
+Frame *
+computeDeltaCache (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                   std::vector<mVector> *motion_vectors)
+{
+  Frame *delta = new Frame (p_frame_ycbcr);
+
+  int width = i_frame_ycbcr->width;
+  int height = i_frame_ycbcr->height;
+  int window_size = 16;
+  int block_size = 16;
+  int inset = (int)max ((float)window_size, (float)block_size);
+
+  int current_block = 0;
+  for (int my = inset; my < width - (inset + window_size) + 1;
+       my += block_size)
+    {
+      for (int mx = inset; mx < height - (inset + window_size) + 1;
+           mx += block_size)
+        {
+          const mVector &v = motion_vectors->at (current_block);
+          float *dst[] = { delta->Y->data, delta->Cb->data, delta->Cr->data };
+          const float *src[] = { i_frame_ycbcr->Y->data,
+                                 i_frame_ycbcr->Cb->data,
+                                 i_frame_ycbcr->Cr->data };
+
+          for (int c = 0; c < 3; c++)
+            for (int x = 0; x < block_size; x++)
+              {
+                float *d = dst[c] + (mx + x) * width + my;
+                const float *s = src[c] + (mx + v.a + x) * width + my + v.b;
+                for (int y = 0; y < block_size; y++)
+                  d[y] = d[y] - s[y];
+              }
+
+          current_block = current_block + 1;
+        }
+    }
+  return delta;
+}
+
+// The residual motionVectorSearchFused wrote while searching, when it was
+// searched with these frames and vectors; computeDeltaCache otherwise
+Frame *
+computeDeltaFused (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                   std::vector<mVector> *motion_vectors)
+{
+  Frame *delta = fused_delta;
+  fused_delta = NULL;
+  if (delta && fused_source == i_frame_ycbcr && fused_match == p_frame_ycbcr
+      && fused_vectors.size () == motion_vectors->size ()
+      && !memcmp (fused_vectors.data (), motion_vectors->data (),
+                  fused_vectors.size () * sizeof (mVector)))
+    return delta;
+
+  releaseDeltaFrame (delta);
+  return computeDeltaCache (i_frame_ycbcr, p_frame_ycbcr, motion_vectors);
+}
+
+Frame *
+computeDeltaCL (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                std::vector<mVector> *motion_vectors)
+{
+  int width = i_frame_ycbcr->width;
+  int height = i_frame_ycbcr->height;
+  Frame *delta = takeDeltaFrame (width, height);
+  const float *s[] = { i_frame_ycbcr->Y->data, i_frame_ycbcr->Cb->data,
+                       i_frame_ycbcr->Cr->data };
+  const float *m[] = { p_frame_ycbcr->Y->data, p_frame_ycbcr->Cb->data,
+                       p_frame_ycbcr->Cr->data };
+  float *out[] = { delta->Y->data, delta->Cb->data, delta->Cr->data };
+  size_t size[] = { (size_t)width, (size_t)height };
+  bool resident = i_frame_ycbcr == cl_source && p_frame_ycbcr == cl_match;
+  deltaCL (size, 16, s, m, resident, (const int *)motion_vectors->data (),
+           out);
+  cl_source = NULL;
+  cl_match = NULL;
+  return delta;
+}
+
+Frame *
+keepReference (Frame *final, int pad, bool on_device)
+{
+  Frame *reference = pad ? padFrame (final, pad) : new Frame (final);
+  // Only an unpadded copy matches the residual on the device
+  cl_reference = on_device && !pad ? reference : NULL;
+  cl_source = NULL;
+  cl_match = NULL;
+  return reference;
+}
+
+static void
+padChannel (const Channel *in, Channel *out, int pad)
+{
+  int width = in->width;
+  int height = in->height;
+  int out_width = out->width;
+
+#pragma omp parallel for
+  for (int x = 0; x < out->height; x++)
+    {
+      const float *row
+          = &in->data[std::min (std::max (x - pad, 0), height - 1) * width];
+      float *padded = &out->data[x * out_width];
+      for (int y = 0; y < pad; y++)
+        padded[y] = row[0];
+      memcpy (&padded[pad], row, width * sizeof (float));
+      for (int y = 0; y < pad; y++)
+        padded[pad + width + y] = row[width - 1];
+    }
+}
+
+Frame *
+padFrame (Frame *in, int pad)
+{
+  Frame *out
+      = new Frame (in->width + 2 * pad, in->height + 2 * pad, FULLSIZE);
+  padChannel (in->Y, out->Y, pad);
+  padChannel (in->Cb, out->Cb, pad);
+  padChannel (in->Cr, out->Cr, pad);
+  return out;
+}
+
+static void
+cropChannel (const Channel *in, Channel *out, int pad)
+{
+  int width = out->width;
+
+#pragma omp parallel for
+  for (int x = 0; x < out->height; x++)
+    memcpy (&out->data[x * width], &in->data[(x + pad) * in->width + pad],
+            width * sizeof (float));
+}
+
+Frame *
+cropFrame (Frame *padded, int pad)
+{
+  Frame *out = new Frame (padded->width - 2 * pad, padded->height - 2 * pad,
+                          FULLSIZE);
+  cropChannel (padded->Y, out->Y, pad);
+  cropChannel (padded->Cb, out->Cb, pad);
+  cropChannel (padded->Cr, out->Cr, pad);
+  return out;
+}
+
+Channel *
+downSample (Channel *in)
+{
+  int width = in->width;
+  int height = in->height;
+  int w2 = width / 2;
+  int h2 = height / 2;
+
+  Channel *out = new Channel ((width / 2), (height / 2));
+
+  for (int y2 = 0, y = 0; y2 < w2; y2++)
+    {
+      for (int x2 = 0, x = 0; x2 < h2; x2++)
+        {
+
+          out->data[x2 * w2 + y2] = in->data[x * width + y];
+          x += 2;
+        }
+      y += 2;
+    }
+
+  return out;
+}
+
+Channel *
+downSampleCache (Channel *in)
+{
+  int width = in->width;
+  int height = in->height;
+  int w2 = width / 2;
+  int h2 = height / 2;
+
+  Channel *out = new Channel ((width / 2), (height / 2));
+
+  for (int x2 = 0; x2 < h2; x2++)
+    {
+      const float *row = in->data + 2 * x2 * width;
+      for (int y2 = 0; y2 < w2; y2++)
+        out->data[x2 * w2 + y2] = row[2 * y2];
+    }
+
+  return out;
+}
+
+// The quantiser steps of round_block, before the scaling by QUALITY
+static const float quant_matrix[8][8] = {
+  { 16, 11, 10, 16, 24, 40, 51, 61 },
+  { 12, 12, 14, 19, 26, 58, 60, 55 },
+  { 14, 13, 16, 24, 40, 57, 69, 56 },
+  { 14, 17, 22, 29, 51, 87, 80, 62 },
+  { 18, 22, 37, 56, 68, 109, 103, 77 },
+  { 24, 35, 55, 64, 81, 104, 113, 92 },
+  { 49, 64, 78, 87, 103, 121, 120, 101 },
+  { 72, 92, 95, 98, 112, 100, 103, 99 },
+};
+
+long dct_flat_blocks;
+
+// The sum of |f - mean| over a block under which every AC coefficient of
+// dct8x8_block quantises to zero.  A coefficient is linear in f - mean, so
+// it is at most the sum times its largest weight; the weights are read off
+// the transform of each unit sample, and the quantiser steps are those of
+// round_block.  The margin covers the rounding of the transform and of the
+// single precision sum in shift_deviation.
+static double
+flatBound ()
+{
+  float unit[64] = { 0 };
+  float out[64];
+  double weight[64] = { 0 };
+  for (int i = 0; i < 64; i++)
+    {
+      unit[i] = 1;
+      dct8x8_block (unit, out, 8);
+      unit[i] = 0;
+      for (int k = 0; k < 64; k++)
+        weight[k] = std::max (weight[k], (double)fabsf (out[k]));
+    }
+
+  double bound = INFINITY;
+  for (int k = 1; k < 64; k++)
+    {
+      float step = ceil (quant_matrix[k / 8][k % 8] / QUALITY);
+      bound = std::min (bound, 0.5 * step / weight[k]);
+    }
+  return bound * (1 - 1e-4) - 0.01;
+}
+
+// dct8x8SIMD with the level shift fused into the block loop, and flat
+// blocks coded as their DC alone.  The AC coefficients it drops are below
+// half a quantiser step, so the quantised result is that of dct8x8.
+void
+dct8x8Flat (Channel *in, Channel *out)
+{
+  static const double bound = flatBound ();
+  int width = in->width;
+  int height = in->height;
+  long flat = 0;
+
+  if (width % 8 || height % 8)
+    memset (out->data, 0, width * height * sizeof (float));
+
+#pragma omp parallel
+  {
+    TraceSpan span ("dct8x8Flat");
+#pragma omp for reduction(+ : flat)
+    for (int x = 0; x < height; x += 8)
+      for (int y = 0; y < width; y += 8)
+        {
+          float *block = &(in->data[x * width + y]);
+          float *coeffs = &(out->data[x * width + y]);
+          if (x + 8 > height || y + 8 > width)
+            {
+              for (int i = 0; i < 8 && x + i < height; i++)
+                for (int j = 0; j < 8 && y + j < width; j++)
+                  block[i * width + j] -= 128;
+              simd.dct8x8_block (block, coeffs, width);
+              continue;
+            }
+
+          if (simd.shift_deviation (block, width) < bound)
+            {
+              float dc = dct8x8_block_dc (block, width);
+              for (int i = 0; i < 8; i++)
+                memset (&coeffs[i * width], 0, 8 * sizeof (float));
+              coeffs[0] = dc;
+              flat++;
+            }
+          else
+            simd.dct8x8_block (block, coeffs, width);
+        }
+  }
+  dct_flat_blocks += flat;
+}
+
+void
+dct8x8 (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  // 8x8 block dct on each block
+  for (int i = 0; i < width * height; i++)
+    {
+      in->data[i] -= 128;
+      out->data[i] = 0; // zeros
+    }
+
+  for (int y = 0; y < width; y += 8)
+    {
+      for (int x = 0; x < height; x += 8)
+        {
+          dct8x8_block (&(in->data[x * width + y]),
+                        &(out->data[x * width + y]), width);
+        }
+    }
+}
+
+// dct8x8 with the level shift done block by block, right before the block is
+// transformed, instead of in a separate pass over the whole channel
+void
+dct8x8Cache (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  if (width % 8 || height % 8)
+    memset (out->data, 0, width * height * sizeof (float));
+
+  for (int x = 0; x < height; x += 8)
+    {
+      for (int y = 0; y < width; y += 8)
+        {
+          float *block = &(in->data[x * width + y]);
+          for (int i = 0; i < 8 && x + i < height; i++)
+            for (int j = 0; j < 8 && y + j < width; j++)
+              block[i * width + j] -= 128;
+          dct8x8_block (block, &(out->data[x * width + y]), width);
+        }
+    }
+}
+
+void
+dct8x8Fixed (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  for (int i = 0; i < width * height; i++)
+    {
+      in->data[i] -= 128;
+      out->data[i] = 0;
+    }
+
+#pragma omp parallel for
+  for (int x = 0; x < height; x += 8)
+    for (int y = 0; y < width; y += 8)
+      dct8x8_block_fixed (&(in->data[x * width + y]),
+                          &(out->data[x * width + y]), width);
+}
+
+void
+dct8x8SIMD (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+#pragma omp parallel
+  {
+    TraceSpan span ("dct8x8SIMD");
+#pragma omp for
+    for (int i = 0; i < width * height; i++)
+      {
+        in->data[i] -= 128;
+        out->data[i] = 0;
+      }
+
+#pragma omp for
+    for (int x = 0; x < height; x += 8)
+      for (int y = 0; y < width; y += 8)
+        simd.dct8x8_block (&(in->data[x * width + y]),
+                           &(out->data[x * width + y]), width);
+  }
+}
+
+void
+round_block (float *in, float *out, int stride)
+{
+  for (int y = 0; y < 8; y++)
+    {
+      for (int x = 0; x < 8; x++)
+        {
+          float step = ceil (quant_matrix[x][y] / QUALITY);
+          out[x * stride + y] = (float)round (in[x * stride + y] / step);
+        }
+    }
+}
+
+void
+quant8x8 (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  for (int i = 0; i < width * height; i++)
+    {
+      out->data[i] = 0; // zeros
+    }
+
+  for (int y = 0; y < width; y += 8)
+    {
+      for (int x = 0; x < height; x += 8)
+        {
+          round_block (&(in->data[x * width + y]), &(out->data[x * width + y]),
+                       width);
+        }
+    }
+}
+
+// quant8x8 without the separate zeroing pass
+void
+quant8x8Cache (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  if (width % 8 || height % 8)
+    memset (out->data, 0, width * height * sizeof (float));
+
+  for (int x = 0; x < height; x += 8)
+    {
+      for (int y = 0; y < width; y += 8)
+        {
+          round_block (&(in->data[x * width + y]), &(out->data[x * width + y]),
+                       width);
+        }
+    }
+}
+
+void
+quant8x8SIMD (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+#pragma omp parallel
+  {
+    TraceSpan span ("quant8x8SIMD");
+#pragma omp for
+    for (int i = 0; i < width * height; i++)
+      out->data[i] = 0;
+
+#pragma omp for
+    for (int x = 0; x < height; x += 8)
+      for (int y = 0; y < width; y += 8)
+        simd.round_block (&(in->data[x * width + y]),
+                          &(out->data[x * width + y]), width);
+  }
+}
+
+// quant8x8SIMD that also records the nonzero coefficients of every block
+// in out->nonzero for zigZagOrderMask
+void
+quant8x8Mask (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+  int blocks_per_row = width / 8;
+  uint64_t *nonzero = out->allocNonzero (width * height / 64);
+
+  if (width % 8 || height % 8)
+    memset (out->data, 0, width * height * sizeof (float));
+
+#pragma omp parallel
+  {
+    TraceSpan span ("quant8x8Mask");
+#pragma omp for
+    for (int x = 0; x < height; x += 8)
+      for (int y = 0; y < width; y += 8)
+        nonzero[x / 8 * blocks_per_row + y / 8] = simd.round_block_mask (
+            &(in->data[x * width + y]), &(out->data[x * width + y]), width);
+  }
+}
+
+// The differences dcDiff takes of the DCs of a channel of width x height,
+// gathered column by column into dc_values
+static void
+dcDiffValues (const double *dc_values, int width, int height, Channel *out)
+{
+  int new_w = std::max (width / 8, 1);
+  int new_h = std::max (height / 8, 1);
+
+  out->data[0] = (float)dc_values[0];
+
+  double prev = 0.;
+  int iter = 0;
+  for (int j = 0; j < new_w; j++)
+    {
+      for (int i = 0; i < new_h; i++)
+        {
+          out->data[iter] = (float)(dc_values[i * new_w + j] - prev);
+          prev = dc_values[i * new_w + j];
+          iter++;
+        }
+    }
+}
+
+void
+dcDiff (Channel *in, Channel *out)
+{
+  int width = in->width;
+  int height = in->height;
+
+  int number_of_dc = width * height / 64;
+  double *dc_values = new double[number_of_dc];
+
+  int iter = 0;
+  for (int j = 0; j < width; j += 8)
+    {
+      for (int i = 0; i < height; i += 8)
+        {
+          dc_values[iter] = in->data[i * width + j];
+          iter++;
+        }
+    }
+
+  dcDiffValues (dc_values, width, height, out);
+  delete[] dc_values;
+}
+
+void
+dcDiffOrdered (Channel *ordered, int width, int height, Channel *out)
+{
+  int blocks_per_row = width / 8;
+  double *dc_values = new double[width * height / 64];
+
+  int iter = 0;
+  for (int j = 0; j < width / 8; j++)
+    for (int i = 0; i < height / 8; i++)
+      dc_values[iter++]
+          = ordered->data[(i * blocks_per_row + j) * MPEG_CONSTANT];
+
+  dcDiffValues (dc_values, width, height, out);
+  delete[] dc_values;
+}
+
+/* The frames submitTransformCL has in flight, oldest first, with the
+ * coefficients submitFrameCL reads back as shorts */
+struct FrameCL
+{
+  Frame *zigzag;
+  std::vector<int16_t> coeffs[3];
+};
+static FrameCL frames_cl[2];
+static int n_submitted_cl, n_finished_cl;
+
+void
+submitTransformCL (Image *in, bool p_frame, Frame *zigzag,
+                   std::vector<mVector> *motion_vectors)
+{
+  float steps[64];
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      steps[x * 8 + y] = ceil (quant_matrix[x][y] / QUALITY);
+
+  FrameCL *frame = &frames_cl[n_submitted_cl++ % 2];
+  frame->zigzag = zigzag;
+  Channel *out[] = { zigzag->Y, zigzag->Cb, zigzag->Cr };
+  int16_t *coeffs_data[3];
+  uint64_t *nonzero[3];
+  for (int c = 0; c < 3; c++)
+    {
+      int n_blocks = out[c]->height;
+      frame->coeffs[c].resize (n_blocks * MPEG_CONSTANT);
+      coeffs_data[c] = frame->coeffs[c].data ();
+      nonzero[c] = out[c]->allocNonzero (n_blocks);
+    }
+
+  const float *rgb[] = { in->rc->data, in->gc->data, in->bc->data };
+  submitFrameCL (rgb, steps, p_frame,
+                 p_frame ? (int *)motion_vectors->data () : NULL,
+                 coeffs_data, nonzero);
+}
+
+void
+finishTransformCL (double *stage_ms)
+{
+  waitFrameCL (stage_ms);
+  FrameCL *frame = &frames_cl[n_finished_cl++ % 2];
+
+  Channel *out[] = { frame->zigzag->Y, frame->zigzag->Cb, frame->zigzag->Cr };
+  for (int c = 0; c < 3; c++)
+    {
+      int n = out[c]->width * out[c]->height;
+      const int16_t *from = frame->coeffs[c].data ();
+      float *to = out[c]->data;
+#pragma omp parallel for
+      for (int i = 0; i < n; i++)
+        to[i] = from[i];
+    }
+}
+
+void
+cpyBlock (float *in, float *out, int blocksize, int stride)
+{
+  for (int j = 0; j < blocksize; j++)
+    {
+      for (int i = 0; i < blocksize; i++)
+        {
+          out[i * blocksize + j] = in[i * stride + j];
+        }
+    }
+}
+
+void
+zigZagOrder (Channel *in, Channel *ordered)
+{
+  int width = in->width;
+  int height = in->height;
+  int zigZagIndex[64]
+      = { 0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+          12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+          35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+          58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+  int blockNumber = 0;
+  float _block[MPEG_CONSTANT];
+
+  for (int x = 0; x < height; x += 8)
+    {
+      for (int y = 0; y < width; y += 8)
+        {
+          cpyBlock (&(in->data[x * width + y]), _block, 8,
+                    width); // block = in(x:x+7,y:y+7);
+          // Put the coefficients in zig-zag order
+          float zigZagOrdered[MPEG_CONSTANT] = { 0 };
+          for (int index = 0; index < MPEG_CONSTANT; index++)
+            {
+              zigZagOrdered[index] = _block[zigZagIndex[index]];
+            }
+          for (int i = 0; i < MPEG_CONSTANT; i++)
+            ordered->data[blockNumber * MPEG_CONSTANT + i] = zigZagOrdered[i];
+          blockNumber++;
+        }
+    }
+}
+
+void
+zigZagOrderSIMD (Channel *in, Channel *ordered)
+{
+  int width = in->width;
+  int height = in->height;
+  int blocks_per_row = (width + 7) / 8;
+
+#pragma omp parallel for
+  for (int x = 0; x < height; x += 8)
+    for (int y = 0; y < width; y += 8)
+      {
+        int blockNumber = (x / 8) * blocks_per_row + y / 8;
+        simd.zigzag_block (&(in->data[x * width + y]),
+                           &(ordered->data[blockNumber * MPEG_CONSTANT]),
+                           width);
+      }
+}
+
+// Zig-zag position of each coefficient of a block in raster order
+static const int zigzag_position[64]
+    = { 0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+        3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+        10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+        21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63 };
+
+// Zig-zag order that moves only the nonzero coefficients, from in->nonzero
+// or found with a compare per block when the quantiser left none, and
+// records their zig-zag positions in ordered->nonzero for encode8x8Mask
+void
+zigZagOrderMask (Channel *in, Channel *ordered)
+{
+  int width = in->width;
+  int height = in->height;
+  int blocks_per_row = width / 8;
+  const uint64_t *nonzero = in->nonzero;
+  uint64_t *ordered_nonzero = ordered->allocNonzero (width * height / 64);
+
+#pragma omp parallel for
+  for (int x = 0; x < height; x += 8)
+    for (int y = 0; y < width; y += 8)
+      {
+        int blockNumber = (x / 8) * blocks_per_row + y / 8;
+        const float *block = &(in->data[x * width + y]);
+        float *out = &(ordered->data[blockNumber * MPEG_CONSTANT]);
+        uint64_t bits = nonzero ? nonzero[blockNumber]
+                                : simd.nonzero_block (block, width);
+
+        memset (out, 0, MPEG_CONSTANT * sizeof (float));
+        uint64_t ordered_bits = 0;
+        for (; bits; bits &= bits - 1)
+          {
+            int i = __builtin_ctzll (bits);
+            int k = zigzag_position[i];
+            out[k] = block[(i >> 3) * width + (i & 7)];
+            ordered_bits |= (uint64_t)1 << k;
+          }
+        ordered_nonzero[blockNumber] = ordered_bits;
+      }
+}
+
+void
+encode8x8 (Channel *ordered, SMatrix *encoded)
+{
+  int width = encoded->height;
+  int height = encoded->width;
+  int num_blocks = height;
+
+  for (int i = 0; i < num_blocks; i++)
+    {
+      std::string block_encode[MPEG_CONSTANT];
+      for (int j = 0; j < MPEG_CONSTANT; j++)
+        {
+          block_encode[j] = "\0"; // necessary to initialize every string
+                                  // position to empty string
+        }
+
+      double *block = new double[width];
+      for (int y = 0; y < width; y++)
+        block[y] = ordered->data[i * width + y];
+      int num_coeff = MPEG_CONSTANT; // width
+      int encoded_index = 0;
+      int in_zero_run = 0;
+      int zero_count = 0;
+
+      // Skip DC coefficient
+      for (int c = 1; c < num_coeff; c++)
+        {
+          double coeff = block[c];
+          if (coeff == 0)
+            {
+              if (in_zero_run == 0)
+                {
+                  zero_count = 0;
+                  in_zero_run = 1;
+                }
+              zero_count = zero_count + 1;
+            }
+          else
+            {
+              if (in_zero_run == 1)
+                {
+                  in_zero_run = 0;
+                  block_encode[encoded_index]
+                      = "Z" + std::to_string (zero_count);
+                  encoded_index = encoded_index + 1;
+                }
+              block_encode[encoded_index] = std::to_string ((int)coeff);
+              encoded_index = encoded_index + 1;
+            }
+        }
+
+      // If we were in a zero run at the end attach it as well.
+      if (in_zero_run == 1)
+        {
+          if (zero_count > 1)
+            {
+              block_encode[encoded_index] = "Z" + std::to_string (zero_count);
+            }
+          else
+            {
+              block_encode[encoded_index] = "0";
+            }
+        }
+
+      for (int it = 0; it < MPEG_CONSTANT; it++)
+        {
+          if (block_encode[it].length () > 0)
+            encoded->data[i * width + it] = new std::string (block_encode[it]);
+          else
+            it = MPEG_CONSTANT;
+        }
+      delete[] block;
+    }
+}
+
+// encode8x8 over the nonzero AC coefficients only, from ordered->nonzero or
+// found with a compare per block.  The gaps between them are the zero runs,
+// so a block costs its nonzero count and an all-zero one a single "Z63".
+void
+encode8x8Mask (Channel *ordered, SMatrix *encoded)
+{
+  int width = encoded->height;
+  int num_blocks = encoded->width;
+  const uint64_t *nonzero = ordered->nonzero;
+
+#pragma omp parallel for
+  for (int i = 0; i < num_blocks; i++)
+    {
+      const float *block = &(ordered->data[i * width]);
+      uint64_t bits
+          = nonzero ? nonzero[i] : simd.nonzero_block (block, 8);
+
+      // Skip DC coefficient
+      bits &= ~(uint64_t)1;
+      std::string **out = &(encoded->data[i * width]);
+      int last = 0;
+      for (; bits; bits &= bits - 1)
+        {
+          int c = __builtin_ctzll (bits);
+          if (c - last > 1)
+            *out++ = new std::string ("Z" + std::to_string (c - last - 1));
+          *out++ = new std::string (std::to_string ((int)block[c]));
+          last = c;
+        }
+
+      int tail = MPEG_CONSTANT - 1 - last;
+      if (tail > 1)
+        *out = new std::string ("Z" + std::to_string (tail));
+      else if (tail == 1)
+        *out = new std::string ("0");
+    }
+}
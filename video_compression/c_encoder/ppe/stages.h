@@ -0,0 +1,125 @@
+#ifndef stages_h
+#define stages_h
+
+#include "custom_types.h"
+#include <stddef.h>
+#include <vector>
+
+// The encoder stages.  Every stage has a plain single-threaded reference
+// implementation; the other implementations must give the same result (see
+// verifyBackends in backend.h).
+
+typedef void (*ConvertFn) (Image *in, Image *out);
+typedef Channel *(*LowPassFn) (Channel *in, Channel *out);
+typedef std::vector<mVector> *(*MotionFn) (Frame *source, Frame *match,
+                                           int width, int height);
+typedef Frame *(*DeltaFn) (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                           std::vector<mVector> *motion_vectors);
+typedef Channel *(*DownSampleFn) (Channel *in);
+typedef void (*ChannelFn) (Channel *in, Channel *out);
+typedef void (*EncodeFn) (Channel *ordered, SMatrix *encoded);
+
+void convertOMP (size_t size, const float *R, const float *G, const float *B,
+                 float *Y, float *Cb, float *Cr);
+
+void convertRGBtoYCbCr (Image *in, Image *out);
+void convertRGBtoYCbCrOMP (Image *in, Image *out);
+void convertRGBtoYCbCrACC (Image *in, Image *out);
+void convertRGBtoYCbCrCL (Image *in, Image *out);
+void convertSIMD (Image *in, Image *out);
+
+Channel *lowPass (Channel *in, Channel *out);
+Channel *lowPassOMP (Channel *in, Channel *out);
+Channel *lowPassSIMD (Channel *in, Channel *out);
+
+std::vector<mVector> *motionVectorSearch (Frame *source, Frame *match,
+                                          int width, int height);
+std::vector<mVector> *motionVectorSearchCL (Frame *source, Frame *match,
+                                            int width, int height);
+std::vector<mVector> *motionVectorSearchSIMD (Frame *source, Frame *match,
+                                              int width, int height);
+std::vector<mVector> *motionVectorSearchPDE (Frame *source, Frame *match,
+                                             int width, int height);
+std::vector<mVector> *motionVectorSearchSEA (Frame *source, Frame *match,
+                                             int width, int height);
+std::vector<mVector> *motionVectorSearchFused (Frame *source, Frame *match,
+                                               int width, int height);
+
+Frame *computeDelta (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                     std::vector<mVector> *motion_vectors);
+Frame *computeDeltaCache (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                          std::vector<mVector> *motion_vectors);
+// Hands out the residual motionVectorSearchFused computed, so motion=fused
+// and delta=fused together skip the separate pass over both frames
+Frame *computeDeltaFused (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                          std::vector<mVector> *motion_vectors);
+
+// The residual on an OpenCL device, from the frames motionVectorSearchCL
+// left there when it was given the same ones
+Frame *computeDeltaCL (Frame *i_frame_ycbcr, Frame *p_frame_ycbcr,
+                       std::vector<mVector> *motion_vectors);
+
+// Give a delta frame that is no longer needed back for the next fused
+// search to fill, instead of deleting it
+void releaseDeltaFrame (Frame *frame);
+
+// With --pad the motion and delta stages get their frames padded by
+// WINDOW_SIZE on every side.  Their macroblocks, which keep an inset of
+// WINDOW_SIZE from the edges, then cover the whole of the unpadded frame,
+// and a search near the edge finds the replicated edge pixels.
+
+// A copy of in with pad more pixels on every side, each a copy of the
+// nearest pixel of in
+Frame *padFrame (Frame *in, int pad);
+
+// The interior of a frame padded by padFrame
+Frame *cropFrame (Frame *padded, int pad);
+
+// The reference the next P frame is searched against: a copy of final,
+// padded by pad.  on_device says final is the residual computeDeltaCL
+// returned, unchanged, so that the next motionVectorSearchCL finds it on the
+// device instead of uploading it.
+Frame *keepReference (Frame *final, int pad, bool on_device);
+
+// Stages 0 to 8 of a frame on the OpenCL device, see submitFrameCL: the
+// quantised coefficients of in in zig-zag order, with their nonzero
+// bitmaps, into the channels of zigzag (64 wide, a row per block), and the
+// motion vectors of a P frame into motion_vectors, which holds one per
+// macroblock searched.  The frame is only enqueued; in, zigzag and
+// motion_vectors must stay until finishTransformCL has returned for it.
+void submitTransformCL (Image *in, bool p_frame, Frame *zigzag,
+                        std::vector<mVector> *motion_vectors);
+// Wait for the oldest frame submitTransformCL has in flight, of at most
+// two, and fill its zigzag.  stage_ms gets the device time of each of the
+// stages.
+void finishTransformCL (double *stage_ms);
+
+Channel *downSample (Channel *in);
+Channel *downSampleCache (Channel *in);
+
+void dct8x8 (Channel *in, Channel *out);
+void dct8x8Cache (Channel *in, Channel *out);
+void dct8x8SIMD (Channel *in, Channel *out);
+void dct8x8Fixed (Channel *in, Channel *out);
+void dct8x8Flat (Channel *in, Channel *out);
+// Blocks dct8x8Flat coded as DC alone; the caller resets it
+extern long dct_flat_blocks;
+
+void round_block (float *in, float *out, int stride);
+void quant8x8 (Channel *in, Channel *out);
+void quant8x8Cache (Channel *in, Channel *out);
+void quant8x8SIMD (Channel *in, Channel *out);
+void quant8x8Mask (Channel *in, Channel *out);
+
+void dcDiff (Channel *in, Channel *out);
+// dcDiff of a channel of width x height from its zig-zag ordered blocks
+void dcDiffOrdered (Channel *ordered, int width, int height, Channel *out);
+
+void zigZagOrder (Channel *in, Channel *ordered);
+void zigZagOrderSIMD (Channel *in, Channel *ordered);
+void zigZagOrderMask (Channel *in, Channel *ordered);
+
+void encode8x8 (Channel *ordered, SMatrix *encoded);
+void encode8x8Mask (Channel *ordered, SMatrix *encoded);
+
+#endif
@@ -0,0 +1,966 @@
+#include "stream_bin.h"
+
+#include <errno.h>
+#include <error.h>
+#include <libxml/xmlreader.h>
+#include <libxml/xmlwriter.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char *const channel_names[] = { "Y", "Cr", "Cb" };
+static const int n_channel_names = 3;
+
+static const char *const header_attrs[]
+    = { "width", "height", "quality", "window_size", "block_size" };
+static const int n_header_attrs = 5;
+
+/* Varint coding */
+
+static void
+putUVarint (string &buf, uint64_t v)
+{
+  while (v >= 0x80)
+    {
+      buf += (char)(v | 0x80);
+      v >>= 7;
+    }
+  buf += (char)v;
+}
+
+static void
+putSVarint (string &buf, int64_t v)
+{
+  putUVarint (buf, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+typedef struct ByteReader
+{
+  const unsigned char *p;
+  const unsigned char *end;
+} ByteReader;
+
+static uint64_t
+getUVarint (ByteReader *r)
+{
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (r->p == r->end)
+        error (EXIT_FAILURE, 0, "truncated binary stream");
+      unsigned char b = *r->p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+  error (EXIT_FAILURE, 0, "malformed varint in binary stream");
+  return 0;
+}
+
+static int64_t
+getSVarint (ByteReader *r)
+{
+  uint64_t v = getUVarint (r);
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint8_t
+getByte (ByteReader *r)
+{
+  if (r->p == r->end)
+    error (EXIT_FAILURE, 0, "truncated binary stream");
+  return *r->p++;
+}
+
+/* Exp-Golomb coding, most significant bit first, of the symbols after the
+   head of a frame record (version 4) */
+
+// Largest value putUE codes
+#define UE_MAX 0xfffffffeu
+
+typedef struct BitWriter
+{
+  string *out;
+  // Pending bits, from the top
+  uint64_t cache;
+  int n;
+} BitWriter;
+
+// The low n <= 33 bits of v
+static void
+putBits (BitWriter *w, uint64_t v, int n)
+{
+  w->cache |= v << (64 - w->n - n);
+  w->n += n;
+  while (w->n >= 8)
+    {
+      *w->out += (char)(w->cache >> 56);
+      w->cache <<= 8;
+      w->n -= 8;
+    }
+}
+
+static void
+putUE (BitWriter *w, uint64_t v)
+{
+  if (v > UE_MAX)
+    error (EXIT_FAILURE, 0, "value %lu too large for the binary stream",
+           (unsigned long)v);
+  int len = 64 - __builtin_clzll (v + 1);
+  putBits (w, 0, len - 1);
+  putBits (w, v + 1, len);
+}
+
+static void
+putSE (BitWriter *w, int64_t v)
+{
+  putUE (w, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+// Pad the last byte with zeros
+static void
+flushBits (BitWriter *w)
+{
+  if (w->n > 0)
+    putBits (w, 0, 8 - w->n);
+}
+
+typedef struct BitReader
+{
+  const unsigned char *p;
+  const unsigned char *end;
+  // Bits not yet read, from the top
+  uint64_t cache;
+  int n;
+  // Zero bytes fed in past end
+  int pad;
+} BitReader;
+
+static void
+refillBits (BitReader *r)
+{
+  if (r->n <= 56 && r->end - r->p >= 8)
+    {
+      // Whole bytes of one big-endian word
+      uint64_t word;
+      memcpy (&word, r->p, 8);
+      int bytes = (63 - r->n) >> 3;
+      r->cache |= __builtin_bswap64 (word) >> r->n;
+      r->p += bytes;
+      r->n += bytes * 8;
+      return;
+    }
+  while (r->n <= 56)
+    {
+      uint64_t byte = 0;
+      if (r->p < r->end)
+        byte = *r->p++;
+      else
+        r->pad++;
+      r->cache |= byte << (56 - r->n);
+      r->n += 8;
+    }
+}
+
+// Drop n bits of the cache, which refillBits has filled
+static void
+skipBits (BitReader *r, int n)
+{
+  r->cache <<= n;
+  r->n -= n;
+  if (r->n < 8 * r->pad)
+    error (EXIT_FAILURE, 0, "truncated binary stream");
+}
+
+// 1 <= n <= 33 bits
+static uint64_t
+getBits (BitReader *r, int n)
+{
+  refillBits (r);
+  uint64_t v = r->cache >> (64 - n);
+  skipBits (r, n);
+  return v;
+}
+
+static uint64_t
+getUE (BitReader *r)
+{
+  refillBits (r);
+  int zeros = r->cache ? __builtin_clzll (r->cache) : 64;
+  if (2 * zeros + 1 <= r->n)
+    {
+      // The whole code is in the cache
+      uint64_t v = r->cache >> (63 - 2 * zeros);
+      skipBits (r, 2 * zeros + 1);
+      return v - 1;
+    }
+  if (zeros > 32)
+    error (EXIT_FAILURE, 0, "malformed Exp-Golomb code in binary stream");
+  skipBits (r, zeros);
+  return getBits (r, zeros + 1) - 1;
+}
+
+static int64_t
+getSE (BitReader *r)
+{
+  uint64_t v = getUE (r);
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Bits of the record left after the ones read
+static long
+bitsLeft (const BitReader *r)
+{
+  return (r->end - r->p) * 8L + r->n - 8L * r->pad;
+}
+
+/* The symbols of a frame record after its head: varints up to version 3,
+   Exp-Golomb codes from version 4 */
+
+typedef struct SymbolReader
+{
+  bool bits;
+  ByteReader bytes;
+  BitReader br;
+} SymbolReader;
+
+static uint64_t
+readU (SymbolReader *r)
+{
+  return r->bits ? getUE (&r->br) : getUVarint (&r->bytes);
+}
+
+static int64_t
+readS (SymbolReader *r)
+{
+  return r->bits ? getSE (&r->br) : getSVarint (&r->bytes);
+}
+
+// A count of symbols to follow, which can not be more than the bits (or
+// bytes) left, as each takes at least one
+static uint64_t
+readCount (SymbolReader *r)
+{
+  uint64_t n = readU (r);
+  long left = r->bits ? bitsLeft (&r->br) : r->bytes.end - r->bytes.p;
+  if (n > (uint64_t)left)
+    error (EXIT_FAILURE, 0, "malformed count in binary stream");
+  return n;
+}
+
+/* Text helpers.  Every number in the stream is printed by std::to_string, so
+   a token is only accepted if printing it back gives the same text; anything
+   else could not be reproduced losslessly.  */
+
+static long
+parseCanonicalInt (const string &tok, const char *what)
+{
+  char *end;
+  errno = 0;
+  long v = strtol (tok.c_str (), &end, 10);
+  if (tok.empty () || *end || errno || to_string (v) != tok)
+    error (EXIT_FAILURE, 0, "non-canonical %s '%s' in XML stream", what,
+           tok.c_str ());
+  return v;
+}
+
+static void
+splitTokens (const char *text, vector<string> &tokens)
+{
+  tokens.clear ();
+  const char *p = text;
+  while (*p)
+    {
+      while (*p == ' ')
+        p++;
+      const char *begin = p;
+      while (*p && *p != ' ')
+        p++;
+      if (p != begin)
+        tokens.emplace_back (begin, p);
+    }
+}
+
+// Strip the brackets of "[ a b c]" (DC) or "[a b]" (MV).
+static string
+bracketContent (const char *text, const char *what)
+{
+  size_t n = strlen (text);
+  if (n < 2 || text[0] != '[' || text[n - 1] != ']')
+    error (EXIT_FAILURE, 0, "malformed %s '%s' in XML stream", what, text);
+  return string (text + 1, n - 2);
+}
+
+/* A <B> block is the zero runs and levels of its nonzero AC coefficients,
+   as (run, level) pairs, and what is left of the AC_COEFFS after the last:
+   "Zn" for n > 1 zeros, "0" for one.  blockText prints the pairs so, the
+   way encode8x8 does.  */
+
+#define AC_COEFFS 63
+
+static void
+blockText (const long *pairs, long n_pairs, string &text)
+{
+  text.clear ();
+  long covered = 0;
+  for (long i = 0; i < n_pairs; ++i)
+    {
+      long run = pairs[2 * i];
+      if (run)
+        text += "Z" + to_string (run) + " ";
+      text += to_string (pairs[2 * i + 1]) + " ";
+      covered += run + 1;
+    }
+  long tail = AC_COEFFS - covered;
+  if (tail > 1)
+    text += "Z" + to_string (tail);
+  else if (tail == 1)
+    text += "0";
+  else if (!text.empty ())
+    text.pop_back ();
+}
+
+/* XML -> binary */
+
+typedef struct ChannelRecord
+{
+  int name;
+  vector<long> dc;
+  long coeffs;
+  vector<long> ids;
+  // For each block its number of pairs, then the (run, level) pairs
+  vector<long> pairs;
+} ChannelRecord;
+
+typedef struct FrameRecord
+{
+  long number;
+  char type;
+  bool has_base;
+  long base;
+  bool has_mv;
+  vector<long> mv;
+  bool has_skip;
+  vector<long> skip;
+  vector<ChannelRecord> channels;
+} FrameRecord;
+
+static string
+readerAttr (xmlTextReaderPtr reader, const char *name, bool required)
+{
+  xmlChar *v = xmlTextReaderGetAttribute (reader, BAD_CAST name);
+  if (!v)
+    {
+      if (required)
+        error (EXIT_FAILURE, 0, "missing attribute '%s' on <%s>", name,
+               (const char *)xmlTextReaderConstName (reader));
+      return string ();
+    }
+  string s ((const char *)v);
+  xmlFree (v);
+  return s;
+}
+
+static string
+readerText (xmlTextReaderPtr reader)
+{
+  if (xmlTextReaderIsEmptyElement (reader))
+    return string ();
+  xmlChar *v = xmlTextReaderReadString (reader);
+  string s = v ? (const char *)v : "";
+  xmlFree (v);
+  return s;
+}
+
+static void
+serializeFrame (const FrameRecord &f, string &out)
+{
+  out.clear ();
+  putSVarint (out, f.number);
+  out += f.type;
+  putUVarint (out, (f.has_base ? 1 : 0) | (f.has_mv ? 2 : 0)
+                       | (f.has_skip ? 4 : 0));
+  if (f.has_base)
+    putSVarint (out, f.base);
+
+  BitWriter w = { &out, 0, 0 };
+  if (f.has_mv)
+    {
+      // Each vector as the difference from the one before
+      putUE (&w, f.mv.size () / 2);
+      long a = 0, b = 0;
+      for (size_t i = 0; i < f.mv.size (); i += 2)
+        {
+          putSE (&w, f.mv[i] - a);
+          putSE (&w, f.mv[i + 1] - b);
+          a = f.mv[i];
+          b = f.mv[i + 1];
+        }
+    }
+  if (f.has_skip)
+    {
+      putUE (&w, f.skip.size ());
+      for (long v : f.skip)
+        putUE (&w, v);
+    }
+
+  putUE (&w, f.channels.size ());
+  for (const ChannelRecord &c : f.channels)
+    {
+      putUE (&w, c.name);
+      putUE (&w, c.dc.size ());
+      for (long v : c.dc)
+        putSE (&w, v);
+
+      bool sequential_ids = true;
+      for (size_t i = 0; i < c.ids.size (); ++i)
+        sequential_ids &= c.ids[i] == (long)i + 1;
+
+      putUE (&w, c.coeffs);
+      putUE (&w, c.ids.size ());
+      putUE (&w, sequential_ids ? 1 : 0);
+      if (!sequential_ids)
+        for (long id : c.ids)
+          putSE (&w, id);
+
+      // A level as its sign, then its magnitude less one
+      for (size_t i = 0; i < c.pairs.size ();)
+        {
+          long n_pairs = c.pairs[i++];
+          putUE (&w, n_pairs);
+          for (long k = 0; k < n_pairs; ++k, i += 2)
+            {
+              long level = c.pairs[i + 1];
+              putUE (&w, c.pairs[i]);
+              putBits (&w, level < 0, 1);
+              putUE (&w, labs (level) - 1);
+            }
+        }
+    }
+  flushBits (&w);
+}
+
+// Append the pairs of the <B> block text to pairs, or exit if blockText
+// would not print them back as text
+static void
+encodeBlock (const char *text, long id, vector<string> &tokens,
+             vector<long> &pairs, string &canonical)
+{
+  splitTokens (text, tokens);
+  size_t count = pairs.size ();
+  pairs.push_back (0);
+  long run = 0;
+  for (const string &tok : tokens)
+    {
+      if (tok[0] == 'Z')
+        run += parseCanonicalInt (tok.substr (1), "zero run");
+      else
+        {
+          long v = parseCanonicalInt (tok, "coefficient");
+          if (v == 0)
+            run++;
+          else
+            {
+              pairs.push_back (run);
+              pairs.push_back (v);
+              pairs[count]++;
+              run = 0;
+            }
+        }
+    }
+  blockText (&pairs[count + 1], pairs[count], canonical);
+  if (canonical != text)
+    error (EXIT_FAILURE, 0, "non-canonical block %ld", id);
+}
+
+static void
+writeOrDie (FILE *fp, const void *data, size_t size, const char *path)
+{
+  if (fwrite (data, 1, size, fp) != size)
+    error (EXIT_FAILURE, errno, "writing %s", path);
+}
+
+void
+stream_xml2bin (const char *xml_path, const char *bin_path,
+                StreamBinStats *stats)
+{
+  xmlTextReaderPtr reader = xmlReaderForFile (xml_path, NULL, 0);
+  if (!reader)
+    error (EXIT_FAILURE, 0, "cannot open XML stream %s", xml_path);
+  FILE *out = bin_path ? fopen (bin_path, "wb") : NULL;
+  if (bin_path && !out)
+    error (EXIT_FAILURE, errno, "cannot open %s", bin_path);
+
+  StreamBinStats st = { 0, 0, 0, 0 };
+  FrameRecord frame;
+  ChannelRecord *channel = NULL;
+  vector<string> tokens;
+  string buf, canonical;
+  bool in_frame = false;
+  bool seen_stream = false;
+
+  int ret;
+  while ((ret = xmlTextReaderRead (reader)) == 1)
+    {
+      int type = xmlTextReaderNodeType (reader);
+      const char *name = (const char *)xmlTextReaderConstName (reader);
+
+      if (type == XML_READER_TYPE_END_ELEMENT && !strcmp (name, "FRAME"))
+        {
+          if (out)
+            {
+              serializeFrame (frame, buf);
+              string rec (1, 'F');
+              putUVarint (rec, buf.size ());
+              writeOrDie (out, rec.data (), rec.size (), bin_path);
+              writeOrDie (out, buf.data (), buf.size (), bin_path);
+              st.out_bytes += rec.size () + buf.size ();
+            }
+          st.frames++;
+          in_frame = false;
+          channel = NULL;
+          continue;
+        }
+      if (type != XML_READER_TYPE_ELEMENT)
+        continue;
+
+      if (!strcmp (name, "STREAM"))
+        {
+          buf = STREAM_BIN_MAGIC;
+          putUVarint (buf, STREAM_BIN_VERSION);
+          for (int i = 0; i < n_header_attrs; ++i)
+            putUVarint (buf, parseCanonicalInt (
+                                 readerAttr (reader, header_attrs[i], true),
+                                 header_attrs[i]));
+          // Optional, written as 0 when absent
+          string pad = readerAttr (reader, "pad", false);
+          long pad_value = pad.empty () ? 0 : parseCanonicalInt (pad, "pad");
+          if (!pad.empty () && pad_value <= 0)
+            error (EXIT_FAILURE, 0, "invalid pad attribute '%s'",
+                   pad.c_str ());
+          putUVarint (buf, pad_value);
+          if (out)
+            {
+              writeOrDie (out, buf.data (), buf.size (), bin_path);
+              st.out_bytes += buf.size ();
+            }
+          seen_stream = true;
+        }
+      else if (!strcmp (name, "FRAME"))
+        {
+          frame.number
+              = parseCanonicalInt (readerAttr (reader, "number", true),
+                                   "frame number");
+          string t = readerAttr (reader, "type", true);
+          if (t != "I" && t != "P")
+            error (EXIT_FAILURE, 0, "unknown frame type '%s'", t.c_str ());
+          frame.type = t[0];
+          string base = readerAttr (reader, "base", false);
+          frame.has_base = !base.empty ();
+          frame.base = frame.has_base
+                           ? parseCanonicalInt (base, "base frame")
+                           : 0;
+          frame.has_mv = false;
+          frame.mv.clear ();
+          frame.has_skip = false;
+          frame.skip.clear ();
+          frame.channels.clear ();
+          in_frame = true;
+        }
+      else if (!in_frame)
+        error (EXIT_FAILURE, 0, "unexpected <%s> outside FRAME", name);
+      else if (!strcmp (name, "MOTION_VECTORS"))
+        frame.has_mv = true;
+      else if (!strcmp (name, "MV"))
+        {
+          string text = readerText (reader);
+          splitTokens (bracketContent (text.c_str (), "motion vector").c_str (),
+                       tokens);
+          if (tokens.size () != 2
+              || "[" + tokens[0] + " " + tokens[1] + "]" != text)
+            error (EXIT_FAILURE, 0, "malformed motion vector '%s'",
+                   text.c_str ());
+          frame.mv.push_back (parseCanonicalInt (tokens[0], "motion"));
+          frame.mv.push_back (parseCanonicalInt (tokens[1], "motion"));
+        }
+      else if (!strcmp (name, "SKIP"))
+        {
+          string text = readerText (reader);
+          splitTokens (bracketContent (text.c_str (), "SKIP").c_str (),
+                       tokens);
+          string canonical = "[ ";
+          for (size_t i = 0; i < tokens.size (); ++i)
+            {
+              if (i != 0)
+                canonical += " ";
+              canonical += tokens[i];
+              long run = parseCanonicalInt (tokens[i], "skip run");
+              if (run < 0)
+                error (EXIT_FAILURE, 0, "negative skip run");
+              frame.skip.push_back (run);
+            }
+          canonical += "]";
+          if (canonical != text)
+            error (EXIT_FAILURE, 0, "non-canonical SKIP list");
+          frame.has_skip = true;
+        }
+      else if (!strcmp (name, "DC"))
+        {
+          if (!channel)
+            error (EXIT_FAILURE, 0, "<DC> outside a channel");
+          string text = readerText (reader);
+          splitTokens (bracketContent (text.c_str (), "DC").c_str (),
+                       tokens);
+          string canonical = "[ ";
+          for (size_t i = 0; i < tokens.size (); ++i)
+            {
+              if (i != 0)
+                canonical += " ";
+              canonical += tokens[i];
+              channel->dc.push_back (parseCanonicalInt (tokens[i], "DC"));
+            }
+          canonical += "]";
+          if (canonical != text)
+            error (EXIT_FAILURE, 0, "non-canonical DC list");
+        }
+      else if (!strcmp (name, "BLOCKS"))
+        {
+          if (!channel)
+            error (EXIT_FAILURE, 0, "<BLOCKS> outside a channel");
+          channel->coeffs
+              = parseCanonicalInt (readerAttr (reader, "coeffs", true),
+                                   "coefficient count");
+        }
+      else if (!strcmp (name, "B"))
+        {
+          if (!channel)
+            error (EXIT_FAILURE, 0, "<B> outside a channel");
+          channel->ids.push_back (
+              parseCanonicalInt (readerAttr (reader, "id", true), "block id"));
+          string text = readerText (reader);
+          encodeBlock (text.c_str (), channel->ids.back (), tokens,
+                       channel->pairs, canonical);
+          st.blocks++;
+        }
+      else
+        {
+          int c;
+          for (c = 0; c < n_channel_names; ++c)
+            if (!strcmp (name, channel_names[c]))
+              break;
+          if (c == n_channel_names)
+            error (EXIT_FAILURE, 0, "unknown element <%s>", name);
+          frame.channels.push_back (ChannelRecord ());
+          channel = &frame.channels.back ();
+          channel->name = c;
+          channel->coeffs = 0;
+        }
+    }
+  if (ret != 0)
+    error (EXIT_FAILURE, 0, "failed to parse %s", xml_path);
+  if (!seen_stream)
+    error (EXIT_FAILURE, 0, "%s has no STREAM element", xml_path);
+
+  st.in_bytes = xmlTextReaderByteConsumed (reader);
+  xmlFreeTextReader (reader);
+  if (out && fclose (out))
+    error (EXIT_FAILURE, errno, "closing %s", bin_path);
+  if (stats)
+    *stats = st;
+}
+
+/* binary -> XML */
+
+#define XW_CHECK(x)                                                           \
+  do                                                                          \
+    {                                                                         \
+      if ((x) < 0)                                                            \
+        error (EXIT_FAILURE, 0, "%s: failed writing XML", #x);               \
+    }                                                                         \
+  while (0)
+
+// The writers below do nothing without w, when a stream is only parsed
+
+static void
+startElement (xmlTextWriterPtr w, const char *name)
+{
+  if (w)
+    XW_CHECK (xmlTextWriterStartElement (w, BAD_CAST name));
+}
+
+static void
+endElement (xmlTextWriterPtr w)
+{
+  if (w)
+    XW_CHECK (xmlTextWriterEndElement (w));
+}
+
+static void
+writeTextElement (xmlTextWriterPtr w, const char *name, const string &text)
+{
+  if (!w)
+    return;
+  XW_CHECK (xmlTextWriterStartElement (w, BAD_CAST name));
+  XW_CHECK (xmlTextWriterWriteString (w, BAD_CAST text.c_str ()));
+  XW_CHECK (xmlTextWriterEndElement (w));
+}
+
+static void
+writeAttr (xmlTextWriterPtr w, const char *name, long v)
+{
+  if (w)
+    XW_CHECK (xmlTextWriterWriteAttribute (w, BAD_CAST name,
+                                           BAD_CAST to_string (v).c_str ()));
+}
+
+// "[ a b c]", as the DC and SKIP lists are printed
+static void
+listText (const vector<long> &values, string &text)
+{
+  text = "[ ";
+  for (size_t i = 0; i < values.size (); ++i)
+    {
+      if (i != 0)
+        text += " ";
+      text += to_string (values[i]);
+    }
+  text += "]";
+}
+
+static void
+decodeFrame (xmlTextWriterPtr w, ByteReader *r, uint64_t version,
+             StreamBinStats *st)
+{
+  string text;
+  vector<long> values;
+
+  startElement (w, "FRAME");
+  writeAttr (w, "number", getSVarint (r));
+  char type[2] = { (char)getByte (r), 0 };
+  if (w)
+    XW_CHECK (
+        xmlTextWriterWriteAttribute (w, BAD_CAST "type", BAD_CAST type));
+  uint64_t flags = getUVarint (r);
+  if (flags & 1)
+    writeAttr (w, "base", getSVarint (r));
+
+  SymbolReader sr = { version >= 4, *r, { r->p, r->end, 0, 0, 0 } };
+  if (flags & 2)
+    {
+      startElement (w, "MOTION_VECTORS");
+      uint64_t n_mv = readCount (&sr);
+      long a = 0, b = 0;
+      for (uint64_t i = 0; i < n_mv; ++i)
+        {
+          // Differences from the vector before since version 4
+          long da = readS (&sr);
+          long db = readS (&sr);
+          a = sr.bits ? a + da : da;
+          b = sr.bits ? b + db : db;
+          if (w)
+            writeTextElement (w, "MV",
+                              "[" + to_string (a) + " " + to_string (b)
+                                  + "]");
+        }
+      endElement (w);
+    }
+  if (flags & 4)
+    {
+      values.resize (readCount (&sr));
+      for (long &v : values)
+        v = readU (&sr);
+      if (w)
+        {
+          listText (values, text);
+          writeTextElement (w, "SKIP", text);
+        }
+    }
+
+  uint64_t n_channels = readCount (&sr);
+  vector<long> pairs;
+  for (uint64_t c = 0; c < n_channels; ++c)
+    {
+      uint64_t name = sr.bits ? getUE (&sr.br) : getByte (&sr.bytes);
+      if (name >= (uint64_t)n_channel_names)
+        error (EXIT_FAILURE, 0, "bad channel id %lu in binary stream",
+               (unsigned long)name);
+      startElement (w, channel_names[name]);
+
+      values.resize (readCount (&sr));
+      for (long &v : values)
+        v = readS (&sr);
+      if (w)
+        {
+          listText (values, text);
+          writeTextElement (w, "DC", text);
+        }
+
+      startElement (w, "BLOCKS");
+      writeAttr (w, "coeffs", readU (&sr));
+      uint64_t n_blocks = readCount (&sr);
+      bool sequential_ids = readU (&sr) & 1;
+      vector<long> ids (sequential_ids ? 0 : n_blocks);
+      for (long &id : ids)
+        id = readS (&sr);
+
+      for (uint64_t i = 0; i < n_blocks; ++i)
+        {
+          startElement (w, "B");
+          writeAttr (w, "id", sequential_ids ? (long)i + 1 : ids[i]);
+          if (sr.bits)
+            {
+              uint64_t n_pairs = getUE (&sr.br);
+              if (n_pairs > AC_COEFFS)
+                error (EXIT_FAILURE, 0, "malformed block in binary stream");
+              pairs.resize (2 * n_pairs);
+              long covered = 0;
+              for (uint64_t k = 0; k < n_pairs; ++k)
+                {
+                  long run = getUE (&sr.br);
+                  bool negative = getBits (&sr.br, 1);
+                  long level = getUE (&sr.br) + 1;
+                  pairs[2 * k] = run;
+                  pairs[2 * k + 1] = negative ? -level : level;
+                  covered += run + 1;
+                }
+              if (covered > AC_COEFFS)
+                error (EXIT_FAILURE, 0, "malformed block in binary stream");
+              if (w)
+                blockText (pairs.data (), n_pairs, text);
+            }
+          else
+            {
+              uint64_t n_tokens = getUVarint (&sr.bytes);
+              text.clear ();
+              for (uint64_t t = 0; t < n_tokens; ++t)
+                {
+                  uint64_t sym = getUVarint (&sr.bytes);
+                  if (!w)
+                    continue;
+                  if (t != 0)
+                    text += " ";
+                  uint64_t v = sym >> 1;
+                  if (sym & 1)
+                    text += "Z" + to_string (v);
+                  else
+                    text += to_string ((int64_t)(v >> 1)
+                                       ^ -(int64_t)(v & 1));
+                }
+            }
+          if (w)
+            XW_CHECK (xmlTextWriterWriteString (w, BAD_CAST text.c_str ()));
+          endElement (w);
+        }
+      st->blocks += n_blocks;
+      endElement (w); // BLOCKS
+      endElement (w); // channel
+    }
+  endElement (w); // FRAME
+  if (sr.bits ? bitsLeft (&sr.br) >= 8 : sr.bytes.p != sr.bytes.end)
+    error (EXIT_FAILURE, 0, "trailing bytes in frame record");
+}
+
+static vector<unsigned char>
+readFile (const char *path)
+{
+  FILE *fp = fopen (path, "rb");
+  if (!fp)
+    error (EXIT_FAILURE, errno, "cannot open %s", path);
+  vector<unsigned char> data;
+  unsigned char chunk[1 << 16];
+  size_t n;
+  while ((n = fread (chunk, 1, sizeof (chunk), fp)) > 0)
+    data.insert (data.end (), chunk, chunk + n);
+  if (ferror (fp))
+    error (EXIT_FAILURE, errno, "reading %s", path);
+  fclose (fp);
+  return data;
+}
+
+void
+stream_bin2xml (const char *bin_path, const char *xml_path,
+                StreamBinStats *stats)
+{
+  vector<unsigned char> data = readFile (bin_path);
+  ByteReader r = { data.data (), data.data () + data.size () };
+  StreamBinStats st = { 0, 0, data.size (), 0 };
+
+  size_t magic_len = strlen (STREAM_BIN_MAGIC);
+  if (data.size () < magic_len
+      || memcmp (data.data (), STREAM_BIN_MAGIC, magic_len))
+    error (EXIT_FAILURE, 0, "%s is not a binary stream", bin_path);
+  r.p += magic_len;
+  uint64_t version = getUVarint (&r);
+  if (version < 1 || version > STREAM_BIN_VERSION)
+    error (EXIT_FAILURE, 0, "unsupported binary stream version %lu",
+           (unsigned long)version);
+
+  xmlTextWriterPtr w = NULL;
+  if (xml_path)
+    {
+      w = xmlNewTextWriterFilename (xml_path, 0);
+      if (!w)
+        error (EXIT_FAILURE, 0, "cannot open %s", xml_path);
+      XW_CHECK (xmlTextWriterSetIndent (w, 1));
+      XW_CHECK (xmlTextWriterSetIndentString (w, BAD_CAST "  "));
+      XW_CHECK (xmlTextWriterStartDocument (w, NULL, "UTF-8", NULL));
+    }
+  startElement (w, "STREAM");
+  for (int i = 0; i < n_header_attrs; ++i)
+    writeAttr (w, header_attrs[i], getUVarint (&r));
+  uint64_t pad = version >= 3 ? getUVarint (&r) : 0;
+  if (pad)
+    writeAttr (w, "pad", pad);
+
+  while (r.p != r.end)
+    {
+      if (getByte (&r) != 'F')
+        error (EXIT_FAILURE, 0, "bad record tag in binary stream");
+      uint64_t len = getUVarint (&r);
+      if (len > (uint64_t)(r.end - r.p))
+        error (EXIT_FAILURE, 0, "truncated frame record");
+      ByteReader fr = { r.p, r.p + len };
+      decodeFrame (w, &fr, version, &st);
+      r.p += len;
+      st.frames++;
+    }
+
+  if (!w)
+    {
+      if (stats)
+        *stats = st;
+      return;
+    }
+  XW_CHECK (xmlTextWriterEndDocument (w));
+  xmlFreeTextWriter (w);
+
+  FILE *fp = fopen (xml_path, "rb");
+  if (fp)
+    {
+      fseek (fp, 0, SEEK_END);
+      st.out_bytes = ftell (fp);
+      fclose (fp);
+    }
+  if (stats)
+    *stats = st;
+}
+
+void
+stream_parse (const char *path, StreamBinStats *stats)
+{
+  FILE *fp = fopen (path, "rb");
+  if (!fp)
+    error (EXIT_FAILURE, errno, "cannot open %s", path);
+  char magic[sizeof (STREAM_BIN_MAGIC)] = { 0 };
+  size_t n = fread (magic, 1, strlen (STREAM_BIN_MAGIC), fp);
+  fclose (fp);
+  if (n == strlen (STREAM_BIN_MAGIC) && !strcmp (magic, STREAM_BIN_MAGIC))
+    stream_bin2xml (path, NULL, stats);
+  else
+    stream_xml2bin (path, NULL, stats);
+}
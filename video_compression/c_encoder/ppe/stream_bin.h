@@ -0,0 +1,51 @@
+#ifndef stream_bin_h
+#define stream_bin_h
+
+#include <stddef.h>
+
+// Compact binary form of the XML stream written by write_stream ().
+//
+// The file starts with the magic "PPES", a format version and the STREAM
+// attributes, followed by one length-prefixed record per FRAME.  The
+// header and the head of a frame record (number, type, flags and base) are
+// LEB128 varint coded; signed values are zig-zag mapped first.  The rest of
+// a record is a bit stream of Exp-Golomb codes, padded to a whole byte:
+// motion vectors as differences from the vector before, and each <B> block
+// as its number of (zero run, level) pairs and the pairs, a level as a sign
+// bit and its magnitude less one.  The trailing "Zn" or "0" of a block is
+// what the pairs leave of its 63 AC coefficients, so it is not stored.
+//
+// Up to version 3 the whole record was varints and an RLE symbol a single
+// varint: a coefficient v stored as zigzag (v) << 1 and a zero run "Zn" as
+// (n << 1) | 1.  Version 2 added the SKIP runs of a frame, flagged by bit 2
+// of the frame flags, and version 3 the pad attribute of STREAM, 0 when it
+// is absent, after the others.  Older streams still decode.
+
+#define STREAM_BIN_MAGIC "PPES"
+#define STREAM_BIN_VERSION 4
+
+typedef struct StreamBinStats
+{
+  size_t frames;
+  size_t blocks;
+  size_t in_bytes;
+  size_t out_bytes;
+} StreamBinStats;
+
+// Transcode the XML stream in xml_path to the binary form in bin_path, or
+// only parse it if bin_path is NULL.  The XML is read with xmlTextReader, so
+// memory use is bounded by one frame.  Exits with an error if the stream
+// holds anything the binary form can not reproduce exactly.
+void stream_xml2bin (const char *xml_path, const char *bin_path,
+                     StreamBinStats *stats);
+
+// Transcode a binary stream back to XML, byte for byte the same as the
+// output of write_stream (), or only decode it if xml_path is NULL.
+void stream_bin2xml (const char *bin_path, const char *xml_path,
+                     StreamBinStats *stats);
+
+// Read every symbol of the stream in path, binary if it starts with the
+// magic and XML otherwise, without writing anything
+void stream_parse (const char *path, StreamBinStats *stats);
+
+#endif
@@ -0,0 +1,368 @@
+#include "synth.h"
+
+#include "config.h"
+#include <algorithm>
+#include <error.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+const Resolution resolutions[N_RESOLUTIONS] = {
+  { "720p", 1280, 720 },
+  { "1080p", 1920, 1080 },
+  { "4k", 3840, 2160 },
+  { "8k", 7680, 4320 },
+};
+
+int
+squareSide (const Resolution *res)
+{
+  int side = (int)sqrt ((double)res->width * res->height);
+  return side / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+// Pixels of an object edge blurred into its neighbours by the low-pass
+// filter; macroblocks this close to an edge have no known vector
+#define EDGE_MARGIN 2
+// Period of the texture lattice
+#define TEXTURE_CELL 8
+
+static const char *kind_names[] = { "static", "pan", "noise", "objects" };
+
+typedef struct Object
+{
+  int row;
+  int col;
+  int height;
+  int width;
+  // Motion per frame, down and right
+  int vy;
+  int vx;
+} Object;
+
+static uint32_t
+synthHash (uint32_t x, uint32_t y, uint32_t z)
+{
+  uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ z * 0xcb1ab31fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+static int
+floorDiv (int a, int b)
+{
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Texture value at row r, column c of the plane salt: smooth value noise
+// with fine grain on top, so every macroblock matches only itself
+static float
+texture (int r, int c, uint32_t salt)
+{
+  int cr = floorDiv (r, TEXTURE_CELL);
+  int cc = floorDiv (c, TEXTURE_CELL);
+  float fr = (float)(r - cr * TEXTURE_CELL) / TEXTURE_CELL;
+  float fc = (float)(c - cc * TEXTURE_CELL) / TEXTURE_CELL;
+  float v00 = synthHash (cr, cc, salt) & 255;
+  float v01 = synthHash (cr, cc + 1, salt) & 255;
+  float v10 = synthHash (cr + 1, cc, salt) & 255;
+  float v11 = synthHash (cr + 1, cc + 1, salt) & 255;
+  float smooth = (1 - fr) * ((1 - fc) * v00 + fc * v01)
+                 + fr * ((1 - fc) * v10 + fc * v11);
+  float grain = synthHash (r, c, salt ^ 0x9e3779b9u) & 255;
+  return floorf (0.6f * smooth + 0.4f * grain);
+}
+
+// Object k in frame number.  Objects leave the frame on one side and come
+// back on the other.
+static Object
+synthObject (const Synth *synth, int k, int number)
+{
+  int side = synth->side;
+  uint32_t h[6];
+  for (int i = 0; i < 6; ++i)
+    h[i] = synthHash (synth->seed, k, 0x4f1bbcdcu + i);
+
+  int extent = max (1, side / 4);
+  Object o;
+  o.height = min (side, BLOCK_SIZE * 2 + (int)(h[0] % extent));
+  o.width = min (side, BLOCK_SIZE * 2 + (int)(h[1] % extent));
+  o.vy = (int)(h[2] % (WINDOW_SIZE + 1)) - WINDOW_SIZE / 2;
+  o.vx = (int)(h[3] % (WINDOW_SIZE + 1)) - WINDOW_SIZE / 2;
+
+  // Top left corner runs over -height .. side - 1
+  long period_r = side + o.height;
+  long period_c = side + o.width;
+  long r = (long)(h[4] % side) + (long)number * o.vy;
+  long c = (long)(h[5] % side) + (long)number * o.vx;
+  o.row = (int)(((r % period_r) + period_r) % period_r) - o.height;
+  o.col = (int)(((c % period_c) + period_c) % period_c) - o.width;
+  return o;
+}
+
+static int
+overlaps (const Object *o, int row, int col, int height, int width)
+{
+  return row < o->row + o->height && o->row < row + height
+         && col < o->col + o->width && o->col < col + width;
+}
+
+static int
+inside (const Object *o, int row, int col, int height, int width)
+{
+  return row >= o->row && row + height <= o->row + o->height
+         && col >= o->col && col + width <= o->col + o->width;
+}
+
+static void
+parseSize (Synth *synth, const string &value)
+{
+  for (int i = 0; i < N_RESOLUTIONS; ++i)
+    if (value == resolutions[i].name)
+      {
+        synth->side = squareSide (&resolutions[i]);
+        return;
+      }
+
+  Resolution res = { NULL, 0, 0 };
+  char *end;
+  res.width = strtol (value.c_str (), &end, 10);
+  if (*end == 'x')
+    res.height = strtol (end + 1, &end, 10);
+  else
+    res.height = res.width;
+  synth->side = squareSide (&res);
+  if (*end || res.width < 1 || res.height < 1
+      || synth->side < 2 * (WINDOW_SIZE + BLOCK_SIZE))
+    error (EXIT_FAILURE, 0, "--synth: bad size '%s'", value.c_str ());
+}
+
+void
+initSynth (Synth *synth, const char *spec)
+{
+  string list = spec;
+  size_t comma = list.find (',');
+  string kind = list.substr (0, comma);
+  list = comma == string::npos ? "" : list.substr (comma + 1);
+
+  int k;
+  for (k = 0; k < 4; ++k)
+    if (kind == kind_names[k])
+      break;
+  if (k == 4)
+    error (EXIT_FAILURE, 0,
+           "--synth: unknown kind '%s' (static, pan, noise, objects)",
+           kind.c_str ());
+
+  synth->kind = (SynthKind)k;
+  synth->side = squareSide (&resolutions[1]);
+  synth->frames = N_FRAMES;
+  synth->dx = synth->kind == SynthPan ? 3 : 0;
+  synth->dy = synth->kind == SynthPan ? -2 : 0;
+  synth->objects = synth->kind == SynthObjects ? 8 : 0;
+  synth->noise = 0;
+  synth->seed = 1;
+
+  size_t pos = 0;
+  while (pos <= list.size ())
+    {
+      comma = list.find (',', pos);
+      if (comma == string::npos)
+        comma = list.size ();
+      string item = list.substr (pos, comma - pos);
+      pos = comma + 1;
+      if (item.empty ())
+        continue;
+
+      size_t eq = item.find ('=');
+      if (eq == string::npos)
+        error (EXIT_FAILURE, 0, "--synth: expected key=value, got '%s'",
+               item.c_str ());
+      string key = item.substr (0, eq);
+      string value = item.substr (eq + 1);
+      if (key == "size")
+        {
+          parseSize (synth, value);
+          continue;
+        }
+
+      char *end;
+      long n = strtol (value.c_str (), &end, 10);
+      if (*end || value.empty ())
+        error (EXIT_FAILURE, 0, "--synth: bad number in '%s'", item.c_str ());
+      if (key == "frames" && n > 0)
+        synth->frames = n;
+      else if (key == "dx")
+        synth->dx = n;
+      else if (key == "dy")
+        synth->dy = n;
+      else if (key == "objects" && n >= 0)
+        synth->objects = n;
+      else if (key == "noise" && n >= 0 && n < 256)
+        synth->noise = n;
+      else if (key == "seed")
+        synth->seed = n;
+      else
+        error (EXIT_FAILURE, 0, "--synth: bad item '%s'", item.c_str ());
+    }
+}
+
+void
+synthImage (const Synth *synth, int number, Image **photo)
+{
+  int side = synth->side;
+  if (*photo == NULL)
+    *photo = new Image (side, side, FULLSIZE);
+
+  vector<Object> objects (synth->objects);
+  for (int k = 0; k < synth->objects; ++k)
+    objects[k] = synthObject (synth, k, number);
+
+  Channel *planes[3] = { (*photo)->rc, (*photo)->gc, (*photo)->bc };
+  uint32_t frame_salt = synth->kind == SynthNoise ? number + 1 : 0;
+  uint32_t seed_salt = synth->seed * 0x10001u;
+
+#pragma omp parallel for
+  for (int row = 0; row < side; ++row)
+    {
+      for (int col = 0; col < side; ++col)
+        {
+          // Topmost object at this pixel, or -1 for the background
+          int owner = -1;
+          for (int k = synth->objects - 1; k >= 0; --k)
+            if (overlaps (&objects[k], row, col, 1, 1))
+              {
+                owner = k;
+                break;
+              }
+
+          for (int ch = 0; ch < 3; ++ch)
+            {
+              float v;
+              if (owner < 0)
+                v = texture (row - number * synth->dy,
+                             col - number * synth->dx,
+                             seed_salt + frame_salt * 3 + ch);
+              else
+                v = texture (row - objects[owner].row,
+                             col - objects[owner].col,
+                             seed_salt + 0x100000u + owner * 3 + ch);
+              if (synth->noise)
+                v += (int)(synthHash (row, col, (number * 3 + ch) ^ 0x5bd1e995u)
+                           % (2 * synth->noise + 1))
+                     - synth->noise;
+              planes[ch]->data[row * side + col]
+                  = min (255.f, max (0.f, v));
+            }
+        }
+    }
+}
+
+// Whatever shows in the block at row, col of frame number: an object
+// index, -1 for the background, or -2 for a mix of both
+static int
+blockOwner (const Synth *synth, int number, int row, int col)
+{
+  int size = BLOCK_SIZE + 2 * EDGE_MARGIN;
+  row -= EDGE_MARGIN;
+  col -= EDGE_MARGIN;
+  for (int k = synth->objects - 1; k >= 0; --k)
+    {
+      Object o = synthObject (synth, k, number);
+      if (inside (&o, row, col, size, size))
+        return k;
+      if (overlaps (&o, row, col, size, size))
+        return -2;
+    }
+  return -1;
+}
+
+int
+synthMotion (const Synth *synth, int number, int mx, int my, mVector *v)
+{
+  if (synth->kind == SynthNoise || number < 1)
+    return 0;
+
+  int owner = blockOwner (synth, number, mx, my);
+  int vy, vx;
+  if (owner == -2)
+    return 0;
+  if (owner < 0)
+    {
+      vy = synth->dy;
+      vx = synth->dx;
+    }
+  else
+    {
+      Object now = synthObject (synth, owner, number);
+      Object before = synthObject (synth, owner, number - 1);
+      // Wrapped around between the frames
+      if (now.row - before.row != now.vy || now.col - before.col != now.vx)
+        return 0;
+      vy = now.vy;
+      vx = now.vx;
+    }
+
+  // The matching block of the previous frame, at mx + a, my + b
+  v->a = -vy;
+  v->b = -vx;
+  if (v->a < -WINDOW_SIZE || v->a >= WINDOW_SIZE || v->b < -WINDOW_SIZE
+      || v->b >= WINDOW_SIZE)
+    return 0;
+  return blockOwner (synth, number - 1, mx + v->a, my + v->b) == owner;
+}
+
+int
+checkSynthMotion (const Synth *synth, int number,
+                  const vector<mVector> *motion_vectors, int pad, FILE *log)
+{
+  int side = synth->side;
+  int inset = max (WINDOW_SIZE, BLOCK_SIZE) - pad;
+  int end = side + pad - (max (WINDOW_SIZE, BLOCK_SIZE) + WINDOW_SIZE) + 1;
+  size_t i = 0;
+  int known = 0, wrong = 0, first_mx = -1, first_my = -1;
+  mVector first_expected = { 0, 0 }, first_found = { 0, 0 };
+
+  // Macroblocks in the order motionVectorSearch visits them in the frame
+  // padded by pad.  A block that moved in from outside the frame matches
+  // replicated edge pixels instead, so its motion is not known.
+  for (int my = inset; my < end; my += BLOCK_SIZE)
+    for (int mx = inset; mx < end; mx += BLOCK_SIZE, ++i)
+      {
+        mVector expected;
+        if (i >= motion_vectors->size ()
+            || !synthMotion (synth, number, mx, my, &expected)
+            || mx + expected.a < 0 || mx + expected.a + BLOCK_SIZE > side
+            || my + expected.b < 0 || my + expected.b + BLOCK_SIZE > side)
+          continue;
+        ++known;
+        const mVector *found = &(*motion_vectors)[i];
+        if (found->a == expected.a && found->b == expected.b)
+          continue;
+        if (!wrong++)
+          {
+            first_mx = mx;
+            first_my = my;
+            first_expected = expected;
+            first_found = *found;
+          }
+      }
+
+  fprintf (log, "Motion frame %d: %d of %d known vectors match", number,
+           known - wrong, known);
+  if (wrong)
+    fprintf (log,
+             ", first miss at row %d column %d (%d, %d) instead of (%d, %d)",
+             first_mx, first_my, first_found.a, first_found.b,
+             first_expected.a, first_expected.b);
+  fprintf (log, "\n");
+  return wrong;
+}
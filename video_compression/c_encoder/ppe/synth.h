@@ -0,0 +1,77 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "custom_types.h"
+#include <stdio.h>
+#include <vector>
+
+// Synthetic input sequences, generated in memory at any resolution instead
+// of read from the TIFF sets, with content whose motion is known so the
+// motion vectors can be checked against it.
+
+typedef struct Resolution
+{
+  const char *name;
+  int width;
+  int height;
+} Resolution;
+
+// 720p, 1080p, 4k and 8k
+extern const Resolution resolutions[];
+#define N_RESOLUTIONS 4
+
+// The stages index frames as if they were square (see computeDelta), so
+// every resolution is run on a square frame of the same number of pixels,
+// rounded to whole macroblocks
+int squareSide (const Resolution *res);
+
+typedef enum SynthKind
+{
+  // A still textured scene
+  SynthStatic,
+  // The scene moves by dx, dy pixels every frame
+  SynthPan,
+  // Every frame is new, uncorrelated texture: nothing to find
+  SynthNoise,
+  // Textured rectangles moving over the scene, each at its own speed
+  SynthObjects
+} SynthKind;
+
+typedef struct Synth
+{
+  SynthKind kind;
+  // Side of the square frames
+  int side;
+  int frames;
+  // Motion of the background per frame, right and down
+  int dx;
+  int dy;
+  int objects;
+  // Amplitude of the per frame noise added to every pixel
+  int noise;
+  unsigned seed;
+} Synth;
+
+// Parse spec, a kind (static, pan, noise, objects) followed by a comma
+// separated list of size=WxH or a resolution name, frames=N, dx=N, dy=N,
+// objects=N, noise=N and seed=N; exits on a bad spec
+void initSynth (Synth *synth, const char *spec);
+
+// Generate frame number of the sequence into *photo, allocated on first
+// use, in place of loadImage.  Pixels are whole numbers in 0..255 as read
+// from a TIFF.
+void synthImage (const Synth *synth, int number, Image **photo);
+
+// The motion vector the search should find for the macroblock at row mx,
+// column my of frame number against frame number - 1.  Returns 0 where it
+// is not known: macroblocks an object edge crosses, vectors outside the
+// search window and the noise kind.
+int synthMotion (const Synth *synth, int number, int mx, int my, mVector *v);
+
+// Compare the motion vectors of frame number with the known ones and log
+// how many agree.  Returns the number that differ.
+int checkSynthMotion (const Synth *synth, int number,
+                      const std::vector<mVector> *motion_vectors, int pad,
+                      FILE *log);
+
+#endif
@@ -0,0 +1,140 @@
+#include "trace.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+// Events a thread can record before its buffer has to grow
+#define TRACE_RESERVE 4096
+
+typedef struct TraceEvent
+{
+  const char *name;
+  int frame;
+  int64_t begin;
+  // -1 while the span is open
+  int64_t end;
+} TraceEvent;
+
+typedef struct TraceBuffer
+{
+  int tid;
+  vector<TraceEvent> events;
+  // Indices of the open spans, innermost last
+  vector<size_t> open;
+  struct TraceBuffer *next;
+} TraceBuffer;
+
+int trace_enabled = 0;
+
+static string trace_path;
+static int64_t trace_start;
+// Every thread's buffer, pushed on first use and never freed, so the
+// writer can walk it after the workers went idle
+static atomic<TraceBuffer *> trace_buffers (NULL);
+static atomic<int> trace_threads (0);
+static thread_local TraceBuffer *trace_buffer = NULL;
+
+static int64_t
+traceNow (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static TraceBuffer *
+threadBuffer (void)
+{
+  if (trace_buffer)
+    return trace_buffer;
+
+  TraceBuffer *buffer = new TraceBuffer;
+  buffer->tid = trace_threads++;
+  buffer->events.reserve (TRACE_RESERVE);
+  buffer->next = trace_buffers.load ();
+  while (!trace_buffers.compare_exchange_weak (buffer->next, buffer))
+    ;
+  trace_buffer = buffer;
+  return buffer;
+}
+
+static void
+writeTrace (void)
+{
+  FILE *fp = fopen (trace_path.c_str (), "w");
+  if (!fp)
+    {
+      fprintf (stderr, "Failed writing trace %s\n", trace_path.c_str ());
+      return;
+    }
+
+  const char *sep = "";
+  fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (TraceBuffer *b = trace_buffers.load (); b; b = b->next)
+    {
+      if (b->tid == 0)
+        fprintf (fp,
+                 "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":0,\"args\":{\"name\":\"main\"}}",
+                 sep);
+      else
+        fprintf (fp,
+                 "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+                 sep, b->tid, b->tid);
+      sep = ",\n";
+
+      for (size_t i = 0; i < b->events.size (); ++i)
+        {
+          const TraceEvent *e = &b->events[i];
+          if (e->end < 0)
+            continue;
+          fprintf (fp,
+                   ",\n{\"name\":\"%s\",\"cat\":\"ppe\",\"ph\":\"X\","
+                   "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                   e->name, b->tid, (e->begin - trace_start) / 1e3,
+                   (e->end - e->begin) / 1e3);
+          if (e->frame >= 0)
+            fprintf (fp, ",\"args\":{\"frame\":%d}", e->frame);
+          fprintf (fp, "}");
+        }
+    }
+  fprintf (fp, "\n]}\n");
+  fclose (fp);
+}
+
+void
+initTrace (const char *path)
+{
+  trace_path = path;
+  trace_start = traceNow ();
+  threadBuffer ();
+  trace_enabled = 1;
+  atexit (writeTrace);
+}
+
+void
+traceBegin (const char *name, int frame)
+{
+  TraceBuffer *b = threadBuffer ();
+  TraceEvent e = { name, frame, traceNow (), -1 };
+  b->open.push_back (b->events.size ());
+  b->events.push_back (e);
+}
+
+void
+traceEnd (void)
+{
+  TraceBuffer *b = threadBuffer ();
+  if (b->open.empty ())
+    return;
+  b->events[b->open.back ()].end = traceNow ();
+  b->open.pop_back ();
+}
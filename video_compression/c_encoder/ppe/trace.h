@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timeline of the encoder in Chrome trace format, for chrome://tracing and
+// ui.perfetto.dev.  Every thread records its spans in its own buffer
+// without locking; the file is written when the program exits.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  extern int trace_enabled;
+
+  // Start recording, with the calling thread as the main thread, and write
+  // the trace to path at exit
+  void initTrace (const char *path);
+
+  // Open a span on the calling thread.  name must outlive the program
+  // (a string literal); frame is shown as an argument unless negative.
+  void traceBegin (const char *name, int frame);
+
+  // Close the innermost open span of the calling thread
+  void traceEnd (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define TRACE_BEGIN(name, frame)                                              \
+  do                                                                          \
+    {                                                                         \
+      if (trace_enabled)                                                      \
+        traceBegin (name, frame);                                             \
+    }                                                                         \
+  while (0)
+
+#define TRACE_END()                                                           \
+  do                                                                          \
+    {                                                                         \
+      if (trace_enabled)                                                      \
+        traceEnd ();                                                          \
+    }                                                                         \
+  while (0)
+
+#ifdef __cplusplus
+// A span for the rest of the enclosing scope
+class TraceSpan
+{
+public:
+  TraceSpan (const char *name, int frame = -1) : active (trace_enabled)
+  {
+    if (active)
+      traceBegin (name, frame);
+  }
+
+  ~TraceSpan ()
+  {
+    if (active)
+      traceEnd ();
+  }
+
+private:
+  int active;
+};
+#endif
+
+#endif
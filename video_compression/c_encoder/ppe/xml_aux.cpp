@@ -18,7 +18,7 @@ print (std::string s)
 
 xmlDocPtr
 create_xml_stream (int width, int height, int quality, int window_size,
-                   int block_size)
+                   int block_size, int pad)
 {
   xmlDocPtr doc = xmlNewDoc (BAD_CAST "1.0");
   xmlNodePtr root_node = xmlNewNode (NULL, BAD_CAST "STREAM");
@@ -40,6 +40,12 @@ create_xml_stream (int width, int height, int quality, int window_size,
   sprintf (buf, "%d", block_size);
   xmlNewProp (root_node, BAD_CAST "block_size", BAD_CAST buf);
 
+  if (pad)
+    {
+      sprintf (buf, "%d", pad);
+      xmlNewProp (root_node, BAD_CAST "pad", BAD_CAST buf);
+    }
+
   // xmlSaveFormatFileEnc("-", doc, "UTF-8", 1);
 
   return doc;
@@ -77,10 +83,13 @@ array2str_ (int *block_count, std::string **arr, int size)
   return buf;
 }
 
+// ids holds the stream id of each block of image_zero, or is NULL when
+// they are numbered from 1
 void
 stream_image (
     xmlDocPtr XML, xmlNodePtr parentNode, Channel *dc_diff,
-    SMatrix *image_zero /*, int width, int height, int image_zero_size*/)
+    SMatrix *image_zero /*, int width, int height, int image_zero_size*/,
+    const std::vector<int> *ids)
 {
   xmlNodePtr dcNode = xmlNewNode (NULL, BAD_CAST "DC");
   std::string buf;
@@ -99,7 +108,7 @@ stream_image (
     {
       xmlNodePtr bNode = xmlNewNode (NULL, BAD_CAST "B");
       buf = "\0";
-      buf += std::to_string (i + 1);
+      buf += std::to_string (ids ? (*ids)[i] : i + 1);
       xmlNewProp (bNode, BAD_CAST "id", BAD_CAST buf.c_str ());
       std::string *s = image_zero->data[i * 64];
       buf.clear ();
@@ -118,7 +127,8 @@ stream_image (
 void
 stream_frame (xmlDocPtr XML, int frame_number,
               std::vector<mVector> *motion_vectors, int ref_frame_number,
-              Frame *dc_diff, FrameEncode *image_zero)
+              Frame *dc_diff, FrameEncode *image_zero, const SkipMap *skip,
+              const CodedBlocks *coded)
 {
   // char buf[16];
   std::string buf;
@@ -153,6 +163,13 @@ stream_frame (xmlDocPtr XML, int frame_number,
       xmlAddChild (frameNode, motionVectorsNode);
     }
 
+  if (skip)
+    {
+      xmlNodePtr skipNode = xmlNewNode (NULL, BAD_CAST "SKIP");
+      xmlAddChild (skipNode, xmlNewText (BAD_CAST skipRuns (skip).c_str ()));
+      xmlAddChild (frameNode, skipNode);
+    }
+
   xmlNodePtr YNode = xmlNewNode (NULL, BAD_CAST "Y");
   xmlNodePtr CrNode = xmlNewNode (NULL, BAD_CAST "Cr");
   xmlNodePtr CbNode = xmlNewNode (NULL, BAD_CAST "Cb");
@@ -160,9 +177,12 @@ stream_frame (xmlDocPtr XML, int frame_number,
   xmlAddChild (frameNode, CrNode);
   xmlAddChild (frameNode, CbNode);
 
-  stream_image (XML, YNode, dc_diff->Y, image_zero->Y /*, 128, 128, 256*/);
-  stream_image (XML, CrNode, dc_diff->Cr, image_zero->Cr /*, 64, 64, 64*/);
-  stream_image (XML, CbNode, dc_diff->Cb, image_zero->Cb /*, 64, 64, 64*/);
+  stream_image (XML, YNode, dc_diff->Y, image_zero->Y /*, 128, 128, 256*/,
+                coded ? &coded->ids[0] : NULL);
+  stream_image (XML, CrNode, dc_diff->Cr, image_zero->Cr /*, 64, 64, 64*/,
+                coded ? &coded->ids[2] : NULL);
+  stream_image (XML, CbNode, dc_diff->Cb, image_zero->Cb /*, 64, 64, 64*/,
+                coded ? &coded->ids[1] : NULL);
 }
 
 void
@@ -386,6 +406,20 @@ std::string function_name[10] = { "Convert to YCbCr:",
                                   "Zig-zag order:",
                                   "Encode coefficients:" };
 double runtime_accum[10] = { 0 };
+PerfCounts perf_accum[10];
+int perf_stats = 0;
+StageWork work_accum[10];
+int roofline_stats = 0;
+DCOnlyCount dc_only_accum = { 0, 0 };
+int dc_only_stats = 0;
+
+// The line under the DCT stage for dc_only
+static string
+formatDCOnly (const DCOnlyCount *dc_only)
+{
+  return "DC-only blocks: " + to_string (dc_only->dc_only) + " of "
+         + to_string (dc_only->blocks);
+}
 
 void
 createStatsFile (void)
@@ -396,7 +430,9 @@ createStatsFile (void)
 }
 
 void
-writestats (int framenum, int is_pframe, double *runtime)
+writestats (int framenum, int is_pframe, double *runtime,
+            const PerfCounts *perf, const StageWork *work,
+            const DCOnlyCount *dc_only)
 {
   std::ofstream file;
   file.open ("../../outputs/execution_stats.txt", ios::app);
@@ -411,6 +447,29 @@ writestats (int framenum, int is_pframe, double *runtime)
           runtime_accum[i] += runtime[i];
           file << setw (30) << left << function_name[i]
                << std::setprecision (0) << runtime[i] << "ms" << std::endl;
+          if (perf)
+            {
+              perf_stats = 1;
+              perfCountsAdd (&perf_accum[i], &perf[i]);
+              string counts = formatPerfCounts (&perf[i], runtime[i]);
+              if (!counts.empty ())
+                file << setw (30) << "" << counts << std::endl;
+            }
+          if (work)
+            {
+              roofline_stats = 1;
+              stageWorkAdd (&work_accum[i], &work[i]);
+              string roof = formatRoofline (&work[i], runtime[i]);
+              if (!roof.empty ())
+                file << setw (30) << "" << roof << std::endl;
+            }
+          if (dc_only && i == 5)
+            {
+              dc_only_stats = 1;
+              dc_only_accum.dc_only += dc_only->dc_only;
+              dc_only_accum.blocks += dc_only->blocks;
+              file << setw (30) << "" << formatDCOnly (dc_only) << std::endl;
+            }
         }
     }
   file << std::endl;
@@ -431,6 +490,18 @@ closeStats (void)
       total += runtime_accum[i];
       file << setw (30) << left << function_name[i] << std::setprecision (0)
            << runtime_accum[i] << "ms" << std::endl;
+      string counts = perf_stats ? formatPerfCounts (&perf_accum[i],
+                                                     runtime_accum[i])
+                                 : "";
+      if (!counts.empty ())
+        file << setw (30) << "" << counts << std::endl;
+      string roof = roofline_stats ? formatRoofline (&work_accum[i],
+                                                     runtime_accum[i])
+                                   : "";
+      if (!roof.empty ())
+        file << setw (30) << "" << roof << std::endl;
+      if (dc_only_stats && i == 5)
+        file << setw (30) << "" << formatDCOnly (&dc_only_accum) << std::endl;
     }
   file << std::endl;
   file << setw (30) << left << "Total runtime: " << total << "ms" << std::endl;
@@ -2,6 +2,9 @@
 #define xml_aux_h
 
 #include "custom_types.h"
+#include "perf_counters.h"
+#include "roofline.h"
+#include "skip.h"
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <stdio.h>
@@ -11,8 +14,10 @@
 
 void print (std::string s);
 
+// pad is the border of the frames motion is searched on (see padFrame),
+// written only when it is not 0
 xmlDocPtr create_xml_stream (int width, int height, int quality,
-                             int window_size, int block_size);
+                             int window_size, int block_size, int pad);
 
 void mat2str (char *buf, float *mat, int width, int height);
 
@@ -22,9 +27,12 @@ void stream_image (xmlDocPtr XML, xmlNodePtr parentNode, Channel *dc_diff,
                    SMatrix *image_zero, int width, int height,
                    int image_zero_size);
 
+// skip and coded are the skipped macroblocks and the coded blocks of each
+// channel, or NULL when every block is coded
 void stream_frame (xmlDocPtr XML, int frame_number,
                    std::vector<mVector> *motion_vectors, int ref_frame_number,
-                   Frame *dc_diff, FrameEncode *image_zero);
+                   Frame *dc_diff, FrameEncode *image_zero,
+                   const SkipMap *skip, const CodedBlocks *coded);
 
 void write_stream (std::string stream_path, xmlDocPtr stream);
 
@@ -41,7 +49,21 @@ void dump_motion_vectors(int* motion, int frame_number);
 
 void createStatsFile (void);
 
-void writestats (int framenum, int is_pframe, double *runtime);
+// Blocks of a frame the DC-only DCT path (see dct8x8Flat) took, of all the
+// blocks transformed
+typedef struct DCOnlyCount
+{
+  long dc_only;
+  long blocks;
+} DCOnlyCount;
+
+// perf holds the hardware counts of each stage, or is NULL without --perf;
+// work the bytes and operations of each stage, or is NULL without
+// --roofline; dc_only the DC-only blocks of the DCT, or is NULL when its
+// backend has no DC-only path
+void writestats (int framenum, int is_pframe, double *runtime,
+                 const PerfCounts *perf, const StageWork *work,
+                 const DCOnlyCount *dc_only);
 
 void closeStats (void);
 
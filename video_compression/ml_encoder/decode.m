@@ -22,6 +22,7 @@ function decode()
 	[width, height] = getStreamSize(stream);
     window_size = getStreamWindowSize(stream);
     block_size = getStreamBlockSize(stream);
+    pad = getStreamPad(stream);
 	quality = getStreamQuality(stream);
 	numberOfFrames = getNumberOfFrames(stream);
     
@@ -66,7 +67,7 @@ function decode()
 			title(t)
             
 			% Decode the motion vectors
-			motion_delta = do_motion_vectors(motion_vectors, base_frame_ycrcb, window_size, block_size, frame_number);
+			motion_delta = do_motion_vectors(motion_vectors, base_frame_ycrcb, window_size, block_size, pad, frame_number);
 			
 			% Add the results of the motion vectors to the decoded frame
 			frame_ycrcb = frame_ycrcb + motion_delta;
@@ -109,11 +110,18 @@ function decode()
 end
 
 
-function delta = do_motion_vectors(motion_vectors, base_frame_ycrcb, window_size, block_size, frame_number)
+function delta = do_motion_vectors(motion_vectors, base_frame_ycrcb, window_size, block_size, pad, frame_number)
     global settings;
-    delta = zeros(size(base_frame_ycrcb));
+    % Motion was searched on frames with pad more pixels on every side,
+    % copies of the nearest edge pixel
 	width = size(base_frame_ycrcb,2);
 	height = size(base_frame_ycrcb,1);
+    rows = min(max((1:height+2*pad)-pad, 1), height);
+    cols = min(max((1:width+2*pad)-pad, 1), width);
+    base_frame_ycrcb = base_frame_ycrcb(rows, cols, :);
+	width = width+2*pad;
+	height = height+2*pad;
+    delta = zeros(size(base_frame_ycrcb));
 
 	% How far from the edge we can go since we don't special case the edges
     inset = max(window_size, block_size);
@@ -138,6 +146,7 @@ function delta = do_motion_vectors(motion_vectors, base_frame_ycrcb, window_size
 			end
 		end
     end
+    delta = delta(pad+1:height-pad, pad+1:width-pad, :);
     
     if (settings.COMPARE_TO_DEBUG == 1)
         vector_file = sprintf('dump/%sdata/%d-%s.mat', settings.image_path, int32(frame_number), 'motion_vectors');
@@ -210,7 +219,7 @@ function ycbcr = decode_frame(stream, frame_number)
 		
 		% Do the processing
 		dc_data = getFrameDC(frame, channel);
-		block_data = getFrameBlocks(frame, channel);
+		block_data = getFrameBlocks(frame, channel, width*height/64);
 		dc{channel} = decodeDCcoeff(dc_data, width, height);
 		decoded_blocks{channel} = decodeACBlocks(block_data);
 		un_zig_zagged{channel} = unZigZagBlocks(decoded_blocks{channel});
@@ -335,6 +344,14 @@ function block_size = getStreamBlockSize(stream)
     block_size = str2double(a.getAttribute('block_size'));
 end
 
+function pad = getStreamPad(stream)
+    a = stream.getDocumentElement;
+    pad = str2double(a.getAttribute('pad'));
+    if isnan(pad)
+        pad = 0;
+    end
+end
+
 function quality = getStreamQuality(stream)
 	a = stream.getDocumentElement;
 	quality = str2double(a.getAttribute('quality'));
@@ -347,16 +364,17 @@ function dc = getFrameDC(frame, component)
     dc = eval(dc_text.item(0).getData);
 end
 
-function blocks = getFrameBlocks(frame, component)
+% Blocks are placed by their id; the blocks of skipped macroblocks have no
+% <B> and are left empty
+function blocks = getFrameBlocks(frame, component, number_of_blocks)
 	search = getChannelName(component);   
     component = getItem(frame, search);
     blocksNode = getItem(component, 'BLOCKS');
-    blocks = {};
-    count = 1;
+    blocks = cell(1, number_of_blocks);
     for i=0:blocksNode.getLength-1
         if strcmp(blocksNode.item(i).getNodeName, 'B')
-            blocks{count} = blocksNode.item(i).item(0).getData; 
-            count = count + 1;
+            id = str2double(blocksNode.item(i).getAttribute('id'));
+            blocks{id} = blocksNode.item(i).item(0).getData; 
         end
     end
 end
@@ -412,6 +430,11 @@ function block_coeff_in_place = decodeACBlocks(frame_block_data)
    
     for i=1:number_of_blocks
        block = frame_block_data{i};
+       if isempty(block)
+           % Skipped block, all AC coefficients zero
+           block_coeff_in_place{i} = zeros(block_length,1);
+           continue
+       end
        char_array = (block.toCharArray)';
        split = strsplit(char_array);
        decoded_block = zeros(block_length,1);